@@ -0,0 +1,473 @@
+//
+// Implementation of a B+-tree that stores void *
+//
+#include "BTreeVoid.h"
+
+// Fewest keys of a node other than the root
+const int BTreeVoidMinimum = BTreeVoidOrder / 2;
+
+// First eight bytes of a key, to compare as a number. Shorter keys are
+// padded with zeros.
+unsigned long long BTreeVoid::head(const char * key)
+{
+	unsigned long long h = 0;
+	int i = 0;
+	while (i < 8 && key[i] != '\0')
+	{
+		h = (h << 8) | (unsigned char)key[i];
+		i ++;
+	}
+	while (i < 8)
+	{
+		h <<= 8;
+		i ++;
+	}
+	return h;
+}
+
+// Compares key, with head h, to key i of node n, like strcmp
+int BTreeVoid::compare(unsigned long long h, const char * key, BTreeVoidNode * n, int i)
+{
+	if (h != n->_heads[i])
+	{
+		return h < n->_heads[i] ? -1 : 1;
+	}
+	// Keys with the same head are the same if they end within it
+	if ((h & 0xff) == 0)
+	{
+		return 0;
+	}
+	return strcmp(key + 8, n->_keys[i] + 8);
+}
+
+// Index of the first key of n not less than key
+int BTreeVoid::lowerIndex(BTreeVoidNode * n, unsigned long long h, const char * key)
+{
+	int low = 0;
+	int high = n->_count;
+	while (low < high)
+	{
+		int middle = (low + high) / 2;
+		if (compare(h, key, n, middle) > 0)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	return low;
+}
+
+// Index of the child of inner node n that can hold key
+int BTreeVoid::childIndex(BTreeVoidNode * n, unsigned long long h, const char * key)
+{
+	int low = 0;
+	int high = n->_count;
+	while (low < high)
+	{
+		int middle = (low + high) / 2;
+		if (compare(h, key, n, middle) >= 0)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	return low;
+}
+
+BTreeVoidNode * BTreeVoid::newNode(bool leaf)
+{
+	BTreeVoidNode * n = (BTreeVoidNode *)malloc(sizeof(BTreeVoidNode));
+	n->_count = 0;
+	n->_leaf = leaf;
+	n->_next = NULL;
+	return n;
+}
+
+// Frees n, its subtree and their separators
+void BTreeVoid::freeNode(BTreeVoidNode * n)
+{
+	if (!n->_leaf)
+	{
+		for (int i = 0; i < n->_count; i ++)
+		{
+			free((void *)n->_keys[i]);
+		}
+		for (int i = 0; i <= n->_count; i ++)
+		{
+			freeNode(n->_children[i]);
+		}
+	}
+	free(n);
+}
+
+// Constructor for the tree, which starts as an empty leaf
+BTreeVoid::BTreeVoid()
+{
+	_root = newNode(true);
+	_last = _root;
+	_count = 0;
+}
+
+BTreeVoid::~BTreeVoid()
+{
+	freeNode(_root);
+}
+
+// Adds key to the subtree of n. If n splits, returns the new node to its
+// right and places in separator its first key, otherwise NULL.
+BTreeVoidNode * BTreeVoid::insert(BTreeVoidNode * n, unsigned long long h, const char * key,
+				  void * data, bool * existed, const char ** separator)
+{
+	if (n->_leaf)
+	{
+		int i = lowerIndex(n, h, key);
+		if (i < n->_count && compare(h, key, n, i) == 0)
+		{
+			n->_data[i] = data;
+			*existed = true;
+			return NULL;
+		}
+		memmove(&n->_heads[i + 1], &n->_heads[i], (n->_count - i)*sizeof(unsigned long long));
+		memmove(&n->_keys[i + 1], &n->_keys[i], (n->_count - i)*sizeof(const char *));
+		memmove(&n->_data[i + 1], &n->_data[i], (n->_count - i)*sizeof(void *));
+		n->_heads[i] = h;
+		n->_keys[i] = key;
+		n->_data[i] = data;
+		n->_count ++;
+		_count ++;
+		if (n->_count <= BTreeVoidOrder)
+		{
+			return NULL;
+		}
+
+		// Split in halves, unless the key went at the end of the tree.
+		// Keys added in order then leave full leaves behind.
+		BTreeVoidNode * r = newNode(true);
+		int half = n->_count / 2;
+		if (n == _last && i == n->_count - 1)
+		{
+			half = i;
+		}
+		r->_count = n->_count - half;
+		memcpy(r->_heads, &n->_heads[half], r->_count*sizeof(unsigned long long));
+		memcpy(r->_keys, &n->_keys[half], r->_count*sizeof(const char *));
+		memcpy(r->_data, &n->_data[half], r->_count*sizeof(void *));
+		n->_count = half;
+		r->_next = n->_next;
+		n->_next = r;
+		if (_last == n)
+		{
+			_last = r;
+		}
+		*separator = strdup(r->_keys[0]);
+		return r;
+	}
+
+	int c = childIndex(n, h, key);
+	const char * childSeparator;
+	BTreeVoidNode * right = insert(n->_children[c], h, key, data, existed, &childSeparator);
+	if (right == NULL)
+	{
+		return NULL;
+	}
+	memmove(&n->_heads[c + 1], &n->_heads[c], (n->_count - c)*sizeof(unsigned long long));
+	memmove(&n->_keys[c + 1], &n->_keys[c], (n->_count - c)*sizeof(const char *));
+	memmove(&n->_children[c + 2], &n->_children[c + 1], (n->_count - c)*sizeof(BTreeVoidNode *));
+	n->_heads[c] = head(childSeparator);
+	n->_keys[c] = childSeparator;
+	n->_children[c + 1] = right;
+	n->_count ++;
+	if (n->_count <= BTreeVoidOrder)
+	{
+		return NULL;
+	}
+
+	// Split around the middle key, which moves up
+	BTreeVoidNode * r = newNode(false);
+	int half = n->_count / 2;
+	r->_count = n->_count - half - 1;
+	memcpy(r->_heads, &n->_heads[half + 1], r->_count*sizeof(unsigned long long));
+	memcpy(r->_keys, &n->_keys[half + 1], r->_count*sizeof(const char *));
+	memcpy(r->_children, &n->_children[half + 1], (r->_count + 1)*sizeof(BTreeVoidNode *));
+	*separator = n->_keys[half];
+	n->_count = half;
+	return r;
+}
+
+// Add a record to the tree. Returns true if key already exists.
+// Substitute content if key already exists.
+bool BTreeVoid::insertItem( const char * key, void * data)
+{
+	unsigned long long h = head(key);
+
+	// Keys added in order go straight to the end of the last leaf
+	BTreeVoidNode * l = _last;
+	if (l->_count > 0 && l->_count < BTreeVoidOrder && compare(h, key, l, l->_count - 1) > 0)
+	{
+		l->_heads[l->_count] = h;
+		l->_keys[l->_count] = key;
+		l->_data[l->_count] = data;
+		l->_count ++;
+		_count ++;
+		return false;
+	}
+
+	bool existed = false;
+	const char * separator;
+	BTreeVoidNode * right = insert(_root, h, key, data, &existed, &separator);
+	if (right != NULL)
+	{
+		// The root split, so the tree grows a level
+		BTreeVoidNode * root = newNode(false);
+		root->_count = 1;
+		root->_heads[0] = head(separator);
+		root->_keys[0] = separator;
+		root->_children[0] = _root;
+		root->_children[1] = right;
+		_root = root;
+	}
+	return existed;
+}
+
+// Find a key in the dictionary and place in "data" the corresponding record
+// Returns false if key is does not exist
+bool BTreeVoid::find( const char * key, void ** data)
+{
+	unsigned long long h = head(key);
+	BTreeVoidNode * n = _root;
+	while (!n->_leaf)
+	{
+		n = n->_children[childIndex(n, h, key)];
+	}
+	int i = lowerIndex(n, h, key);
+	if (i == n->_count || compare(h, key, n, i) != 0)
+	{
+		return false;
+	}
+	*data = n->_data[i];
+	return true;
+}
+
+// Leaf and index of the first key not less than key, or NULL if there is
+// none
+BTreeVoidNode * BTreeVoid::lowerBound(const char * key, int * index)
+{
+	unsigned long long h = head(key);
+	BTreeVoidNode * n = _root;
+	while (!n->_leaf)
+	{
+		n = n->_children[childIndex(n, h, key)];
+	}
+	int i = lowerIndex(n, h, key);
+	while (n != NULL && i >= n->_count)
+	{
+		n = n->_next;
+		i = 0;
+	}
+	*index = i;
+	return n;
+}
+
+// Moves child i + 1 of n into child i
+void BTreeVoid::merge(BTreeVoidNode * n, int i)
+{
+	BTreeVoidNode * left = n->_children[i];
+	BTreeVoidNode * right = n->_children[i + 1];
+	if (left->_leaf)
+	{
+		// The separator is not needed any more
+		free((void *)n->_keys[i]);
+		memcpy(&left->_data[left->_count], right->_data, right->_count*sizeof(void *));
+		left->_next = right->_next;
+		if (_last == right)
+		{
+			_last = left;
+		}
+	}
+	else
+	{
+		// The separator comes down between the keys of both
+		left->_heads[left->_count] = n->_heads[i];
+		left->_keys[left->_count] = n->_keys[i];
+		left->_count ++;
+		memcpy(&left->_children[left->_count], right->_children, (right->_count + 1)*sizeof(BTreeVoidNode *));
+	}
+	memcpy(&left->_heads[left->_count], right->_heads, right->_count*sizeof(unsigned long long));
+	memcpy(&left->_keys[left->_count], right->_keys, right->_count*sizeof(const char *));
+	left->_count += right->_count;
+	free(right);
+
+	memmove(&n->_heads[i], &n->_heads[i + 1], (n->_count - i - 1)*sizeof(unsigned long long));
+	memmove(&n->_keys[i], &n->_keys[i + 1], (n->_count - i - 1)*sizeof(const char *));
+	memmove(&n->_children[i + 1], &n->_children[i + 2], (n->_count - i - 1)*sizeof(BTreeVoidNode *));
+	n->_count --;
+}
+
+// Refills child i of n after it dropped below half full, with a key of a
+// sibling if one can spare it, or else by merging it with a sibling
+void BTreeVoid::rebalance(BTreeVoidNode * n, int i)
+{
+	BTreeVoidNode * c = n->_children[i];
+	BTreeVoidNode * left = i > 0 ? n->_children[i - 1] : NULL;
+	BTreeVoidNode * right = i < n->_count ? n->_children[i + 1] : NULL;
+
+	if (left != NULL && left->_count > BTreeVoidMinimum)
+	{
+		// Take the last key of the left sibling
+		memmove(&c->_heads[1], c->_heads, c->_count*sizeof(unsigned long long));
+		memmove(&c->_keys[1], c->_keys, c->_count*sizeof(const char *));
+		int last = left->_count - 1;
+		if (c->_leaf)
+		{
+			memmove(&c->_data[1], c->_data, c->_count*sizeof(void *));
+			c->_heads[0] = left->_heads[last];
+			c->_keys[0] = left->_keys[last];
+			c->_data[0] = left->_data[last];
+			free((void *)n->_keys[i - 1]);
+			n->_heads[i - 1] = c->_heads[0];
+			n->_keys[i - 1] = strdup(c->_keys[0]);
+		}
+		else
+		{
+			memmove(&c->_children[1], c->_children, (c->_count + 1)*sizeof(BTreeVoidNode *));
+			c->_heads[0] = n->_heads[i - 1];
+			c->_keys[0] = n->_keys[i - 1];
+			c->_children[0] = left->_children[last + 1];
+			n->_heads[i - 1] = left->_heads[last];
+			n->_keys[i - 1] = left->_keys[last];
+		}
+		left->_count --;
+		c->_count ++;
+		return;
+	}
+
+	if (right != NULL && right->_count > BTreeVoidMinimum)
+	{
+		// Take the first key of the right sibling
+		if (c->_leaf)
+		{
+			c->_heads[c->_count] = right->_heads[0];
+			c->_keys[c->_count] = right->_keys[0];
+			c->_data[c->_count] = right->_data[0];
+			memmove(right->_data, &right->_data[1], (right->_count - 1)*sizeof(void *));
+		}
+		else
+		{
+			c->_heads[c->_count] = n->_heads[i];
+			c->_keys[c->_count] = n->_keys[i];
+			c->_children[c->_count + 1] = right->_children[0];
+			n->_heads[i] = right->_heads[0];
+			n->_keys[i] = right->_keys[0];
+			memmove(right->_children, &right->_children[1], right->_count*sizeof(BTreeVoidNode *));
+		}
+		memmove(right->_heads, &right->_heads[1], (right->_count - 1)*sizeof(unsigned long long));
+		memmove(right->_keys, &right->_keys[1], (right->_count - 1)*sizeof(const char *));
+		right->_count --;
+		c->_count ++;
+		if (c->_leaf)
+		{
+			free((void *)n->_keys[i]);
+			n->_heads[i] = right->_heads[0];
+			n->_keys[i] = strdup(right->_keys[0]);
+		}
+		return;
+	}
+
+	if (left != NULL)
+	{
+		merge(n, i - 1);
+	}
+	else
+	{
+		merge(n, i);
+	}
+}
+
+// Removes key from the subtree of n. Returns false if it is not there.
+bool BTreeVoid::remove(BTreeVoidNode * n, unsigned long long h, const char * key)
+{
+	if (n->_leaf)
+	{
+		int i = lowerIndex(n, h, key);
+		if (i == n->_count || compare(h, key, n, i) != 0)
+		{
+			return false;
+		}
+		memmove(&n->_heads[i], &n->_heads[i + 1], (n->_count - i - 1)*sizeof(unsigned long long));
+		memmove(&n->_keys[i], &n->_keys[i + 1], (n->_count - i - 1)*sizeof(const char *));
+		memmove(&n->_data[i], &n->_data[i + 1], (n->_count - i - 1)*sizeof(void *));
+		n->_count --;
+		_count --;
+		return true;
+	}
+
+	int c = childIndex(n, h, key);
+	if (!remove(n->_children[c], h, key))
+	{
+		return false;
+	}
+	if (n->_children[c]->_count < BTreeVoidMinimum)
+	{
+		rebalance(n, c);
+	}
+	return true;
+}
+
+// Removes an element in the tree. Return false if key does not exist.
+bool BTreeVoid::removeElement(const char * key)
+{
+	if (!remove(_root, head(key), key))
+	{
+		return false;
+	}
+	// A root left with a single child gives way to it
+	if (!_root->_leaf && _root->_count == 0)
+	{
+		BTreeVoidNode * root = _root;
+		_root = root->_children[0];
+		free(root);
+	}
+	return true;
+}
+
+// Creates an iterator over the keys from the first one not less than
+// from that start with prefix
+BTreeVoidIterator::BTreeVoidIterator(BTreeVoid * tree, const char * from, const char * prefix)
+{
+	// Keys less than the prefix do not start with it
+	const char * start = strcmp(from, prefix) > 0 ? from : prefix;
+	_leaf = tree->lowerBound(start, &_index);
+	_prefix = prefix;
+	_prefixLength = strlen(prefix);
+}
+
+// Returns true if there is a next element. Stores its key in key and its
+// data value in data.
+bool BTreeVoidIterator::next(const char * & key, void * & data)
+{
+	while (_leaf != NULL && _index >= _leaf->_count)
+	{
+		_leaf = _leaf->_next;
+		_index = 0;
+	}
+	if (_leaf == NULL)
+	{
+		return false;
+	}
+	if (strncmp(_leaf->_keys[_index], _prefix, _prefixLength) != 0)
+	{
+		// Past the keys with the prefix
+		_leaf = NULL;
+		return false;
+	}
+	key = _leaf->_keys[_index];
+	data = _leaf->_data[_index];
+	_index ++;
+	return true;
+}
@@ -0,0 +1,110 @@
+#ifndef BTREE_VOID
+#define BTREE_VOID
+
+//
+// Ordered map of string keys to void *, a B+-tree
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+// Most keys per node
+enum { BTreeVoidOrder = 32 };
+
+// A node holds its keys in order, each with its first eight bytes in a
+// number, so that most comparisons stay within the node. A leaf holds a
+// record for each key and points to the next leaf. An inner node holds
+// a child more than it has keys, which it copies: child i has the keys
+// from key i - 1 up to, but not including, key i.
+struct BTreeVoidNode {
+  int _count;
+  bool _leaf;
+  BTreeVoidNode * _next;
+  // One more than the order, for the key added just before a split
+  unsigned long long _heads[BTreeVoidOrder + 1];
+  const char * _keys[BTreeVoidOrder + 1];
+  union {
+    void * _data[BTreeVoidOrder + 1];
+    BTreeVoidNode * _children[BTreeVoidOrder + 2];
+  };
+};
+
+// This is a map of string keys to objects of type Data that keeps the
+// keys in strcmp order. The keys are not copied and must stay as they are
+// while they are in the tree.
+class BTreeVoid {
+ public:
+  BTreeVoidNode * _root;
+
+  // Leaf with the greatest keys, where keys added in order go
+  BTreeVoidNode * _last;
+
+  // Number of keys
+  int _count;
+
+  // First eight bytes of a key, to compare as a number
+  static unsigned long long head(const char * key);
+
+  // Compares key, with head h, to key i of node n, like strcmp
+  static int compare(unsigned long long h, const char * key, BTreeVoidNode * n, int i);
+
+  // Index of the first key of n not less than key, and of the child of
+  // inner node n that can hold key
+  static int lowerIndex(BTreeVoidNode * n, unsigned long long h, const char * key);
+  static int childIndex(BTreeVoidNode * n, unsigned long long h, const char * key);
+
+  static BTreeVoidNode * newNode(bool leaf);
+  static void freeNode(BTreeVoidNode * n);
+
+  // Adds key to the subtree of n. If n splits, returns the new node to
+  // its right and places in separator its first key, otherwise NULL.
+  BTreeVoidNode * insert(BTreeVoidNode * n, unsigned long long h, const char * key,
+                         void * data, bool * existed, const char ** separator);
+
+  // Removes key from the subtree of n. Returns false if it is not there.
+  bool remove(BTreeVoidNode * n, unsigned long long h, const char * key);
+
+  // Refills child i of n after it dropped below half full
+  void rebalance(BTreeVoidNode * n, int i);
+
+  // Moves child i + 1 of n into child i
+  void merge(BTreeVoidNode * n, int i);
+
+  // Leaf and index of the first key not less than key
+  BTreeVoidNode * lowerBound(const char * key, int * index);
+
+ public:
+  BTreeVoid();
+  ~BTreeVoid();
+
+  // Add a record to the tree. Returns true if key already exists.
+  // Substitute content, but not the key, if key already exists.
+  bool insertItem( const char * key, void * data);
+
+  // Find a key in the dictionary and place in "data" the corresponding record
+  // Returns false if key is does not exist
+  bool find( const char * key, void ** data);
+
+  // Removes an element in the tree. Return false if key does not exist.
+  bool removeElement(const char * key);
+
+  int count() { return _count; }
+
+  friend class BTreeVoidIterator;
+};
+
+// Walks the keys of a tree in order, from the first one not less than
+// from, and only as long as they start with prefix, which must last as
+// long as the iterator. Starting costs O(log N), and each key after that
+// O(1).
+class BTreeVoidIterator {
+  BTreeVoidNode * _leaf;
+  int _index;
+  const char * _prefix;
+  int _prefixLength;
+ public:
+  BTreeVoidIterator(BTreeVoid * tree, const char * from = "", const char * prefix = "");
+  bool next(const char * & key, void * & data);
+};
+
+#endif
@@ -0,0 +1,252 @@
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "BTreeVoid.h"
+
+void test1()
+{
+  BTreeVoid t;
+  void * data;
+  assert(t.count() == 0);
+  assert(!t.find("a", &data));
+
+  const char * keys[] = { "Rachael", "Monica", "Phoebe", "Joey", "Ross", "Chandler" };
+  for (int i = 0; i < 6; i++) {
+    assert(!t.insertItem(keys[i], (void *)(long)(i + 1)));
+  }
+  assert(t.count() == 6);
+  for (int i = 0; i < 6; i++) {
+    assert(t.find(keys[i], &data));
+    assert(data == (void *)(long)(i + 1));
+  }
+  assert(!t.find("John", &data));
+
+  // Replacing keeps the count
+  assert(t.insertItem("Joey", (void *) 10));
+  assert(t.count() == 6);
+  assert(t.find("Joey", &data) && data == (void *) 10);
+
+  // In order, whatever the order they went in
+  const char * sorted[] = { "Chandler", "Joey", "Monica", "Phoebe", "Rachael", "Ross" };
+  BTreeVoidIterator it(&t);
+  const char * key;
+  int i = 0;
+  while (it.next(key, data)) {
+    assert(!strcmp(key, sorted[i]));
+    i++;
+  }
+  assert(i == 6);
+
+  assert(t.removeElement("Monica"));
+  assert(!t.removeElement("Monica"));
+  assert(!t.find("Monica", &data));
+  assert(t.count() == 5);
+
+  printf("Test1 passed\n");
+}
+
+void test2()
+{
+  // Keys that share their first eight bytes, and prefixes of each other
+  BTreeVoid t;
+  const char * keys[] = { "abcdefgh", "abcdefghi", "abcdefg", "abcdefghij", "abcdefgz",
+                          "abcdefgha", "", "a", "abcdefgh\x80" };
+  for (int i = 0; i < 9; i++) {
+    assert(!t.insertItem(keys[i], (void *)(long) i));
+  }
+  for (int i = 0; i < 9; i++) {
+    void * data;
+    assert(t.find(keys[i], &data) && data == (void *)(long) i);
+  }
+  BTreeVoidIterator it(&t);
+  const char * key;
+  const char * last = NULL;
+  void * data;
+  int n = 0;
+  while (it.next(key, data)) {
+    if (last != NULL) {
+      assert(strcmp(last, key) < 0);
+    }
+    last = key;
+    n++;
+  }
+  assert(n == 9);
+
+  printf("Test2 passed\n");
+}
+
+// Number of keys of the other tests, enough for a few levels
+const int N = 20000;
+
+static void
+makeKey(char * s, int i)
+{
+  sprintf(s, "user%d", i);
+}
+
+static int
+compareKeys(const void * a, const void * b)
+{
+  return strcmp(*(const char **) a, *(const char **) b);
+}
+
+void test3()
+{
+  // Random inserts and removes against a plain array of which keys are in
+  BTreeVoid t;
+  bool * in = (bool *) calloc(N, sizeof(bool));
+  char (*names)[16] = new char[N][16];
+  for (int i = 0; i < N; i++) {
+    makeKey(names[i], i);
+  }
+  int count = 0;
+  srand(1);
+  for (int step = 0; step < 10 * N; step++) {
+    int i = rand() % N;
+    const char * key = names[i];
+    if (rand() % 3 != 0) {
+      assert(t.insertItem(key, (void *)(long) i) == in[i]);
+      if (!in[i]) {
+        in[i] = true;
+        count++;
+      }
+    }
+    else {
+      assert(t.removeElement(key) == in[i]);
+      if (in[i]) {
+        in[i] = false;
+        count--;
+      }
+    }
+    assert(t.count() == count);
+  }
+  char key[16];
+  for (int i = 0; i < N; i++) {
+    void * data;
+    makeKey(key, i);
+    assert(t.find(key, &data) == in[i]);
+    if (in[i]) {
+      assert(data == (void *)(long) i);
+    }
+  }
+
+  // Remove all of them, so the tree shrinks back to a leaf
+  for (int i = 0; i < N; i++) {
+    makeKey(key, i);
+    assert(t.removeElement(key) == in[i]);
+  }
+  assert(t.count() == 0);
+  assert(t._root->_leaf);
+  const char * k;
+  void * data;
+  BTreeVoidIterator it(&t);
+  assert(!it.next(k, data));
+
+  free(in);
+  delete [] names;
+
+  printf("Test3 passed\n");
+}
+
+void test4()
+{
+  // Keys added in order, as when a sorted file is loaded
+  char (*names)[16] = new char[N][16];
+  const char ** sorted = new const char *[N];
+  for (int i = 0; i < N; i++) {
+    makeKey(names[i], i);
+    sorted[i] = names[i];
+  }
+  qsort(sorted, N, sizeof(const char *), compareKeys);
+
+  BTreeVoid t;
+  for (int i = 0; i < N; i++) {
+    assert(!t.insertItem(sorted[i], (void *) sorted[i]));
+  }
+  assert(t.count() == N);
+
+  const char * key;
+  void * data;
+  int i = 0;
+  BTreeVoidIterator all(&t);
+  while (all.next(key, data)) {
+    assert(!strcmp(key, sorted[i]));
+    assert(data == (void *) sorted[i]);
+    i++;
+  }
+  assert(i == N);
+
+  // From a key in the middle, and from one that is not there
+  BTreeVoidIterator from(&t, sorted[N / 2]);
+  assert(from.next(key, data) && !strcmp(key, sorted[N / 2]));
+  assert(from.next(key, data) && !strcmp(key, sorted[N / 2 + 1]));
+  BTreeVoidIterator between(&t, "user1000/");
+  assert(between.next(key, data) && !strcmp(key, "user10000"));
+  BTreeVoidIterator past(&t, "z");
+  assert(!past.next(key, data));
+
+  // Only the keys with a prefix: user123 and user1230 to user1239, and
+  // user12300 to user12399
+  BTreeVoidIterator prefix(&t, "", "user123");
+  i = 0;
+  while (prefix.next(key, data)) {
+    assert(!strncmp(key, "user123", 7));
+    i++;
+  }
+  assert(i == 111);
+
+  // A prefix and a key to start from within it
+  BTreeVoidIterator page(&t, "user1235", "user123");
+  i = 0;
+  while (page.next(key, data)) {
+    assert(strcmp(key, "user1235") >= 0);
+    i++;
+  }
+  // user1235 to user1239, and user12350 to user12399
+  assert(i == 55);
+
+  BTreeVoidIterator none(&t, "", "nobody");
+  assert(!none.next(key, data));
+
+  delete [] names;
+  delete [] sorted;
+
+  printf("Test4 passed\n");
+}
+
+void
+usage()
+{
+  // Print usage
+  fprintf(stderr, "BTreeVoidTest test1|test2|test3|test4\n");
+}
+
+int
+main( int argc, char **argv)
+{
+  if (argc == 1) {
+    usage();
+    exit(1);
+  }
+
+  if ( !strcmp(argv[1], "test1")) {
+    test1();
+  }
+  else if ( !strcmp(argv[1], "test2")) {
+    test2();
+  }
+  else if ( !strcmp(argv[1], "test3")) {
+    test3();
+  }
+  else if ( !strcmp(argv[1], "test4")) {
+    test4();
+  }
+  else {
+    usage();
+    exit(1);
+  }
+
+  exit(0);
+}
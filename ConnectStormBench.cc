@@ -0,0 +1,161 @@
+
+//
+// Connect storm benchmark for IRCServer
+//
+// Starts many clients at once, each one opening connections back to back
+// with a one-line request, and reports how long connections took. With a
+// short listen backlog the SYN and accept queues overflow and clients
+// stall for a full SYN retransmit, one second or more.
+//
+#include <assert.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+struct Client {
+  int rounds;
+  double * latencies;
+  int failures;
+  int busy;
+};
+
+struct sockaddr_in serverAddress;
+pthread_barrier_t startBarrier;
+
+double
+now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void *
+runClient(void * arg)
+{
+  Client * c = (Client *) arg;
+  const char * request = "LIST-ROOMS storm storm\r\n";
+  pthread_barrier_wait(&startBarrier);
+
+  for (int i = 0; i < c->rounds; i++) {
+    double start = now();
+    c->latencies[i] = -1;
+
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0 ||
+	connect(fd, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0 ||
+	write(fd, request, strlen(request)) < 0) {
+      c->failures++;
+      if (fd >= 0) {
+	close(fd);
+      }
+      continue;
+    }
+
+    char answer[256];
+    int length = 0;
+    int n;
+    while ((n = read(fd, answer + length, sizeof(answer) - 1 - length)) > 0) {
+      length += n;
+      if (length == sizeof(answer) - 1) {
+	break;
+      }
+    }
+    answer[length] = 0;
+    close(fd);
+
+    if (length == 0) {
+      c->failures++;
+      continue;
+    }
+    if (!strncmp(answer, "BUSY", 4)) {
+      c->busy++;
+    }
+    c->latencies[i] = (now() - start) * 1000;
+  }
+  return NULL;
+}
+
+int
+compareDouble(const void * a, const void * b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, char ** argv)
+{
+  if (argc < 5) {
+    fprintf(stderr, "ConnectStormBench <host> <port> <clients> <connections-per-client>\n");
+    exit(1);
+  }
+
+  struct hostent * host = gethostbyname(argv[1]);
+  if (host == NULL) {
+    fprintf(stderr, "Unknown host %s\n", argv[1]);
+    exit(1);
+  }
+  memset(&serverAddress, 0, sizeof(serverAddress));
+  serverAddress.sin_family = AF_INET;
+  memcpy(&serverAddress.sin_addr, host->h_addr, host->h_length);
+  serverAddress.sin_port = htons(atoi(argv[2]));
+
+  int clients = atoi(argv[3]);
+  int rounds = atoi(argv[4]);
+
+  Client * c = new Client[clients];
+  pthread_t * threads = new pthread_t[clients];
+  pthread_barrier_init(&startBarrier, NULL, clients + 1);
+  for (int i = 0; i < clients; i++) {
+    c[i].rounds = rounds;
+    c[i].latencies = new double[rounds];
+    c[i].failures = 0;
+    c[i].busy = 0;
+    pthread_create(&threads[i], NULL, runClient, &c[i]);
+  }
+
+  pthread_barrier_wait(&startBarrier);
+  double start = now();
+  for (int i = 0; i < clients; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = now() - start;
+
+  // Collect the latencies of the connections that got an answer
+  double * all = new double[clients * rounds];
+  int count = 0;
+  int failures = 0;
+  int busy = 0;
+  int stalled = 0;
+  for (int i = 0; i < clients; i++) {
+    failures += c[i].failures;
+    busy += c[i].busy;
+    for (int j = 0; j < rounds; j++) {
+      if (c[i].latencies[j] >= 0) {
+	all[count++] = c[i].latencies[j];
+	if (c[i].latencies[j] >= 1000) {
+	  stalled++;
+	}
+      }
+    }
+  }
+  qsort(all, count, sizeof(double), compareDouble);
+
+  printf("connections: %d answered, %d failed, %d busy\n", count, failures, busy);
+  printf("elapsed:     %.3f s (%.0f connections/s)\n", elapsed, count / elapsed);
+  if (count > 0) {
+    printf("latency ms:  p50 %.2f  p99 %.2f  max %.2f\n",
+	   all[count / 2], all[(int)(count * 0.99)], all[count - 1]);
+  }
+  printf("stalled >1s: %d\n", stalled);
+  exit(0);
+}
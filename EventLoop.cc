@@ -0,0 +1,175 @@
+
+//
+// Implementation of the epoll event loop
+//
+#include <errno.h>
+#include <new>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "EventLoop.h"
+
+// Number of events handled per epoll_wait
+const int MaxEvents = 256;
+
+void
+EventLoop::Readiness::await_suspend(std::coroutine_handle<> h)
+{
+	if (_write)
+	{
+		_loop->_waiters[_fd]._writer = h;
+	}
+	else
+	{
+		_loop->_waiters[_fd]._reader = h;
+	}
+}
+
+EventLoop::EventLoop() : _timers(now())
+{
+	_epollFd = -1;
+	_waiters = NULL;
+	_waiterMax = 0;
+}
+
+EventLoop::~EventLoop()
+{
+	free(_waiters);
+	if (_epollFd >= 0)
+	{
+		close(_epollFd);
+	}
+}
+
+bool
+EventLoop::init()
+{
+	_epollFd = epoll_create1(EPOLL_CLOEXEC);
+	return _epollFd >= 0;
+}
+
+bool
+EventLoop::watch(int fd)
+{
+	if (fd >= _waiterMax)
+	{
+		int max = _waiterMax == 0 ? 1024 : _waiterMax;
+		while (max <= fd)
+		{
+			max *= 2;
+		}
+		_waiters = (Waiters *)realloc(_waiters, max * sizeof(Waiters));
+		for (int i = _waiterMax; i < max; i++)
+		{
+			new (&_waiters[i]) Waiters();
+		}
+		_waiterMax = max;
+	}
+	_waiters[fd]._reader = nullptr;
+	_waiters[fd]._writer = nullptr;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.fd = fd;
+	return epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+void
+EventLoop::forget(int fd)
+{
+	epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, NULL);
+	_waiters[fd]._reader = nullptr;
+	_waiters[fd]._writer = nullptr;
+}
+
+EventLoop::Readiness
+EventLoop::readable(int fd)
+{
+	Readiness r = { this, fd, false };
+	return r;
+}
+
+EventLoop::Readiness
+EventLoop::writable(int fd)
+{
+	Readiness r = { this, fd, true };
+	return r;
+}
+
+Task
+EventLoop::writeAll(int fd, const char * data, size_t length, bool * ok)
+{
+	*ok = true;
+	while (length > 0)
+	{
+		ssize_t n = write(fd, data, length);
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				co_await writable(fd);
+				continue;
+			}
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			*ok = false;
+			co_return;
+		}
+		data += n;
+		length -= n;
+	}
+}
+
+unsigned long long
+EventLoop::now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000ULL + t.tv_nsec / 1000000;
+}
+
+void
+EventLoop::poll(int timeout)
+{
+	int due = _timers.timeout();
+	if (due >= 0 && (timeout < 0 || due < timeout))
+	{
+		timeout = due;
+	}
+
+	struct epoll_event events[MaxEvents];
+	int n = epoll_wait(_epollFd, events, MaxEvents, timeout);
+	for (int i = 0; i < n; i++)
+	{
+		int fd = events[i].data.fd;
+		unsigned e = events[i].events;
+		bool failed = (e & (EPOLLERR | EPOLLHUP)) != 0;
+
+		// Resuming a coroutine may forget or reuse the socket, so each
+		// waiter is taken out before it runs.
+		if ((e & (EPOLLIN | EPOLLRDHUP)) || failed)
+		{
+			std::coroutine_handle<> h = _waiters[fd]._reader;
+			_waiters[fd]._reader = nullptr;
+			if (h)
+			{
+				h.resume();
+			}
+		}
+		if ((e & EPOLLOUT) || failed)
+		{
+			std::coroutine_handle<> h = _waiters[fd]._writer;
+			_waiters[fd]._writer = nullptr;
+			if (h)
+			{
+				h.resume();
+			}
+		}
+	}
+
+	_timers.advance(now());
+}
@@ -0,0 +1,73 @@
+
+#ifndef EVENT_LOOP
+#define EVENT_LOOP
+
+//
+// Readiness-based event loop that resumes coroutines waiting on sockets
+//
+
+#include <stddef.h>
+
+#include "Task.h"
+#include "TimerWheel.h"
+
+// Sockets are watched with edge-triggered epoll. A coroutine tries its
+// non-blocking read or write first and only awaits readable() or
+// writable() after getting EAGAIN. A resumption can be spurious, so the
+// call is retried, and awaited again on EAGAIN.
+class EventLoop {
+  int _epollFd;
+
+  // Coroutines waiting on each socket
+  struct Waiters {
+    std::coroutine_handle<> _reader;
+    std::coroutine_handle<> _writer;
+  };
+  Waiters * _waiters;
+  int _waiterMax;
+
+  TimerWheel _timers;
+
+ public:
+  // Awaitable that resumes the coroutine once a socket is ready
+  struct Readiness {
+    EventLoop * _loop;
+    int _fd;
+    bool _write;
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() {}
+  };
+
+  EventLoop();
+  ~EventLoop();
+
+  // Creates the epoll instance. Returns false on failure.
+  bool init();
+
+  // Starts watching a non-blocking socket
+  bool watch(int fd);
+
+  // Stops watching a socket. Must be called before closing it.
+  void forget(int fd);
+
+  Readiness readable(int fd);
+  Readiness writable(int fd);
+
+  // Writes all of data, waiting whenever the socket is full. Sets *ok to
+  // false if the connection fails.
+  Task writeAll(int fd, const char * data, size_t length, bool * ok);
+
+  // Current time in milliseconds
+  static unsigned long long now();
+
+  // Deadlines of the loop. Their callbacks run from poll().
+  TimerWheel * timers() { return &_timers; }
+
+  // Waits up to timeout milliseconds (-1 for ever), or until the next
+  // timer is due, resumes the coroutines whose socket became ready and
+  // runs the expired timers
+  void poll(int timeout);
+};
+
+#endif
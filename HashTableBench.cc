@@ -0,0 +1,83 @@
+
+//
+// Lookup benchmark for HashTableVoid
+//
+// Fills a table with the given number of keys and looks up random ones,
+// one at a time with find and in batches with findBatch. Once the table
+// is larger than the last level cache every lookup misses it, and the
+// batches overlap those misses.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "HashTableVoid.h"
+
+double
+now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char ** argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "HashTableBench <keys> <lookups> [<batch-size> ...]\n");
+    exit(1);
+  }
+  int n = atoi(argv[1]);
+  int lookups = atoi(argv[2]);
+
+  HashTableVoid h;
+  char name[32];
+  for (int i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "user%d", i);
+    h.insertItem(name, (void *)(long)(i + 1));
+  }
+
+  // The keys to look up, in random order and away from the table
+  srand(1);
+  char (*names)[32] = new char[lookups][32];
+  const char ** keys = new const char *[lookups];
+  for (int i = 0; i < lookups; i++) {
+    snprintf(names[i], sizeof(names[i]), "user%d", (int)((rand() * (long long)RAND_MAX + rand()) % n));
+    keys[i] = names[i];
+  }
+  void ** data = new void *[lookups];
+
+  double start = now();
+  long sum = 0;
+  for (int i = 0; i < lookups; i++) {
+    h.find(keys[i], &data[i]);
+    sum += (long) data[i];
+  }
+  double single = (now() - start) * 1e9 / lookups;
+  printf("keys %d  buckets %d\n", n, h._tableSize);
+  printf("find           %7.1f ns/lookup\n", single);
+
+  // Three is about what one request looks up
+  int defaults[] = { 3, 16, 64 };
+  int batches = argc > 3 ? argc - 3 : 3;
+  for (int b = 0; b < batches; b++) {
+    int batch = argc > 3 ? atoi(argv[3 + b]) : defaults[b];
+    long check = 0;
+    start = now();
+    for (int i = 0; i < lookups; i += batch) {
+      int count = lookups - i < batch ? lookups - i : batch;
+      h.findBatch(keys + i, count, data + i);
+      for (int j = 0; j < count; j++) {
+        check += (long) data[i + j];
+      }
+    }
+    double batched = (now() - start) * 1e9 / lookups;
+    if (check != sum) {
+      printf("FAILED: batches of %d found other records\n", batch);
+      exit(1);
+    }
+    printf("findBatch %4d %7.1f ns/lookup  %.2fx\n", batch, batched, single / batched);
+  }
+  exit(0);
+}
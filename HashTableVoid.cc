@@ -1,59 +1,275 @@
-
 //
 // Implementation of a HashTable that stores void *
 //
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "HashTableVoid.h"
 
-// Obtain the hash code of a key
-int HashTableVoid::hash(const char * key)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Compares two zero padded inline keys as a whole
+static inline bool sameInlineKey(const char * a, const char * b)
+{
+#ifdef __SSE2__
+	// Two overlapping loads cover the 24 bytes
+	__m128i low = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a),
+				     _mm_loadu_si128((const __m128i *)b));
+	__m128i high = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + HashTableVoidInlineKey - 16)),
+				      _mm_loadu_si128((const __m128i *)(b + HashTableVoidInlineKey - 16)));
+	return _mm_movemask_epi8(_mm_and_si128(low, high)) == 0xFFFF;
+#else
+	return memcmp(a, b, HashTableVoidInlineKey) == 0;
+#endif
+}
+
+// Returns true if e holds the key k
+static inline bool sameKey(HashTableVoidEntry * e, HashTableVoidKey * k)
+{
+	if (e->_tag != k->_tag || e->_length != k->_length)
+	{
+		return false;
+	}
+	if (k->_length < HashTableVoidInlineKey)
+	{
+		return sameInlineKey(e->_inlineKey, k->_padded);
+	}
+	return memcmp(e->_key, k->_key, k->_length) == 0;
+}
+
+// Returns true if the entry e of image holds the key k
+static inline bool sameImageKey(const char * image, HashTableVoidImageEntry * e, HashTableVoidKey * k)
+{
+	if (e->_tag != k->_tag || e->_length != k->_length)
+	{
+		return false;
+	}
+	if (k->_length < HashTableVoidInlineKey)
+	{
+		return sameInlineKey(e->_inlineKey, k->_padded);
+	}
+	return memcmp(image + e->_key, k->_key, k->_length) == 0;
+}
+
+char HashTableVoid::_removed;
+
+// Obtain the hash code of a key and its length. This is FNV-1a, so that
+// every bit of the key reaches the low bits used to pick a bucket.
+unsigned HashTableVoid::hash(const char * key, unsigned * length)
 {
-	//Add implementation here
-	int sum = 0;
+	unsigned h = 2166136261u;
 	const char * p = key;
 	while (*p != '\0')
 	{
-		sum += *p;
+		h ^= (unsigned char)*p;
+		h *= 16777619u;
 		p ++;
 	}
-	
-	return sum % TableSize;
+	*length = p - key;
+
+	return h;
+}
+
+// Prepares key for lookups
+void HashTableVoid::makeKey(const char * key, HashTableVoidKey * k)
+{
+	k->_key = key;
+	k->_hash = hash(key, &k->_length);
+	// Buckets use the low bits of the hash, the tag the high ones
+	k->_tag = k->_hash >> 24;
+	if (k->_length < HashTableVoidInlineKey)
+	{
+		memset(k->_padded, 0, HashTableVoidInlineKey);
+		memcpy(k->_padded, key, k->_length);
+	}
 }
 
 // Constructor for hash table. Initializes hash table
 HashTableVoid::HashTableVoid()
 {
 	// Add implementation here
-	_buckets = (HashTableVoidEntry **)malloc(TableSize*sizeof(HashTableVoidEntry*));
-	for (int i = 0; i < TableSize; i ++)
+	_tableSize = TableSize;
+	_count = 0;
+	_image = NULL;
+	_buckets = (HashTableVoidEntry **)malloc(_tableSize*sizeof(HashTableVoidEntry*));
+	for (int i = 0; i < _tableSize; i ++)
 	{
 		_buckets[i] = NULL;
 	}
 }
 
-// Add a record to the hash table. Returns true if key already exists.
-// Substitute content if key already exists.
-bool HashTableVoid::insertItem( const char * key, void * data)
+// Frees the table, and unmaps its image
+HashTableVoid::~HashTableVoid()
 {
-	// Add implementation here
-	int h = hash(key);
-	HashTableVoidEntry * e = _buckets[h];
-	while(e != NULL)
+	freeEntries();
+	free(_buckets);
+	if (_image != NULL)
 	{
-		if (strcmp(e->_key,key) == 0)
+		munmap(_image, _image->_length);
+	}
+}
+
+// Frees the entries in memory
+void HashTableVoid::freeEntries()
+{
+	for (int i = 0; i < _tableSize; i ++)
+	{
+		HashTableVoidEntry * e = _buckets[i];
+		while (e != NULL)
 		{
-			//Entry found
-			e->_data = data;
-			return true;
+			HashTableVoidEntry * next = e->_next;
+			if (e->_length >= HashTableVoidInlineKey)
+			{
+				free((void*)e->_key);
+			}
+			delete e;
+			e = next;
 		}
+		_buckets[i] = NULL;
+	}
+	_count = 0;
+}
+
+// Doubles the number of buckets and moves every entry to its new bucket
+void HashTableVoid::grow()
+{
+	int size = _tableSize * 2;
+	HashTableVoidEntry ** buckets = (HashTableVoidEntry **)malloc(size*sizeof(HashTableVoidEntry*));
+	for (int i = 0; i < size; i ++)
+	{
+		buckets[i] = NULL;
+	}
+	for (int i = 0; i < _tableSize; i ++)
+	{
+		HashTableVoidEntry * e = _buckets[i];
+		while (e != NULL)
+		{
+			HashTableVoidEntry * next = e->_next;
+			unsigned length;
+			int h = hash(e->key(), &length) & (size - 1);
+			e->_next = buckets[h];
+			buckets[h] = e;
+			e = next;
+		}
+	}
+	free(_buckets);
+	_buckets = buckets;
+	_tableSize = size;
+}
+
+// Finds the entry of k in its bucket, or returns NULL
+HashTableVoidEntry * HashTableVoid::findEntry(HashTableVoidKey * k)
+{
+	HashTableVoidEntry * e = _buckets[k->_hash & (_tableSize - 1)];
+	while (e != NULL && !sameKey(e, k))
+	{
 		e = e->_next;
 	}
-	//Entry not found
-	e = new HashTableVoidEntry;
-	e->_key = strdup(key);
+	return e;
+}
+
+// Finds the entry of k in the image, or returns NULL
+HashTableVoidImageEntry * HashTableVoid::findImageEntry(HashTableVoidKey * k)
+{
+	if (_image == NULL)
+	{
+		return NULL;
+	}
+	const char * base = (const char *)_image;
+	unsigned long long o = _image->_buckets[k->_hash & (_image->_tableSize - 1)];
+	while (o != 0)
+	{
+		HashTableVoidImageEntry * e = (HashTableVoidImageEntry *)(base + o);
+		if (sameImageKey(base, e, k))
+		{
+			return e;
+		}
+		o = e->_next;
+	}
+	return NULL;
+}
+
+HashTableVoidImageEntry * HashTableVoid::imageEntry(int i)
+{
+	return (HashTableVoidImageEntry *)&_image->_buckets[_image->_tableSize] + i;
+}
+
+const char * HashTableVoid::imageKey(HashTableVoidImageEntry * e)
+{
+	return e->_length < HashTableVoidInlineKey ? e->_inlineKey : (const char *)_image + e->_key;
+}
+
+void * HashTableVoid::imageData(HashTableVoidImageEntry * e)
+{
+	return e->_data != 0 ? (char *)_image + e->_data : NULL;
+}
+
+// Places in data the record of k. Returns false if k does not exist.
+bool HashTableVoid::lookup(HashTableVoidKey * k, void ** data)
+{
+	// Changes come before the image
+	HashTableVoidEntry * e = findEntry(k);
+	if (e != NULL)
+	{
+		*data = e->_data;
+		return e->_data != &_removed;
+	}
+	HashTableVoidImageEntry * i = findImageEntry(k);
+	if (i != NULL)
+	{
+		*data = imageData(i);
+		return true;
+	}
+	return false;
+}
+
+// Adds an entry for k, which is not in the table
+void HashTableVoid::addEntry(HashTableVoidKey * k, void * data)
+{
+	if (_count >= _tableSize)
+	{
+		grow();
+	}
+	_count++;
+	HashTableVoidEntry * e = new HashTableVoidEntry;
+	e->_length = k->_length;
+	e->_tag = k->_tag;
+	if (k->_length < HashTableVoidInlineKey)
+	{
+		memcpy(e->_inlineKey, k->_padded, HashTableVoidInlineKey);
+	}
+	else
+	{
+		e->_key = strdup(k->_key);
+	}
 	e->_data = data;
+	int h = k->_hash & (_tableSize - 1);
 	e->_next = _buckets[h];
 	_buckets[h] = e;
-	return false;
+}
+
+// Add a record to the hash table. Returns true if key already exists.
+// Substitute content if key already exists.
+bool HashTableVoid::insertItem( const char * key, void * data)
+{
+	// Add implementation here
+	HashTableVoidKey k;
+	makeKey(key, &k);
+	HashTableVoidEntry * e = findEntry(&k);
+	if (e != NULL)
+	{
+		//Entry found, unless it hides a removed key
+		bool existed = e->_data != &_removed;
+		e->_data = data;
+		return existed;
+	}
+	//Entry not found here, and it may change one of the image
+	addEntry(&k, data);
+	return findImageEntry(&k) != NULL;
 }
 
 // Find a key in the dictionary and place in "data" the corresponding record
@@ -61,31 +277,122 @@ bool HashTableVoid::insertItem( const char * key, void * data)
 bool HashTableVoid::find( const char * key, void ** data)
 {
 	// Add implementation here
-	int h = hash(key);
-	HashTableVoidEntry * e = _buckets[h];
-	while(e != NULL)
+	HashTableVoidKey k;
+	makeKey(key, &k);
+	return lookup(&k, data);
+}
+
+// Each lookup misses the cache up to three times in a row: on the bucket,
+// on the first entry and, for a long key, on the key. The misses of the
+// keys of a batch are taken one level at a time, so they all wait at the
+// same time.
+void HashTableVoid::prefetchBatch(const char ** keys, int n, HashTableVoidKey * k)
+{
+	for (int i = 0; i < n; i ++)
 	{
-		if (strcmp(e->_key, key) == 0)
+		makeKey(keys[i], &k[i]);
+		__builtin_prefetch(&_buckets[k[i]._hash & (_tableSize - 1)]);
+		if (_image != NULL)
 		{
-			*data = e->_data;
-			return true;
+			__builtin_prefetch(&_image->_buckets[k[i]._hash & (_image->_tableSize - 1)]);
 		}
-		e = e->_next;
 	}
-	return false;
+	for (int i = 0; i < n; i ++)
+	{
+		HashTableVoidEntry * e = _buckets[k[i]._hash & (_tableSize - 1)];
+		if (e != NULL)
+		{
+			__builtin_prefetch(e);
+		}
+	}
+	for (int i = 0; i < n; i ++)
+	{
+		HashTableVoidEntry * e = _buckets[k[i]._hash & (_tableSize - 1)];
+		if (e != NULL && e->_length >= HashTableVoidInlineKey)
+		{
+			__builtin_prefetch(e->_key);
+		}
+	}
+}
+
+// Finds n keys at once and places in data[i] the record of keys[i], or
+// NULL if it does not exist. Returns how many keys exist.
+int HashTableVoid::findBatch( const char ** keys, int n, void ** data)
+{
+	int found = 0;
+	HashTableVoidKey k[BatchSize];
+	for (int start = 0; start < n; start += BatchSize)
+	{
+		int count = n - start < BatchSize ? n - start : BatchSize;
+		prefetchBatch(keys + start, count, k);
+		for (int i = 0; i < count; i ++)
+		{
+			void * d;
+			bool exists = lookup(&k[i], &d);
+			data[start + i] = exists ? d : NULL;
+			found += exists;
+		}
+	}
+	return found;
+}
+
+// Adds n records at once like insertItem. Returns how many keys already
+// existed.
+int HashTableVoid::insertBatch( const char ** keys, void ** data, int n)
+{
+	int existing = 0;
+	HashTableVoidKey k[BatchSize];
+	for (int start = 0; start < n; start += BatchSize)
+	{
+		int count = n - start < BatchSize ? n - start : BatchSize;
+		// Grow first, so that the buckets prefetched stay the same for
+		// the group
+		while (_count + count > _tableSize)
+		{
+			grow();
+		}
+		prefetchBatch(keys + start, count, k);
+		for (int i = 0; i < count; i ++)
+		{
+			// The bucket is read again, as a key before may have been
+			// added to it
+			HashTableVoidEntry * e = findEntry(&k[i]);
+			if (e != NULL)
+			{
+				existing += e->_data != &_removed;
+				e->_data = data[start + i];
+				continue;
+			}
+			existing += findImageEntry(&k[i]) != NULL;
+			addEntry(&k[i], data[start + i]);
+		}
+	}
+	return existing;
 }
 
 // Removes an element in the hash table. Return false if key does not exist.
 bool HashTableVoid::removeElement(const char * key)
 {
 	// Add implementation here
-	int h = hash(key);
+	HashTableVoidKey k;
+	makeKey(key, &k);
+	int h = k._hash & (_tableSize - 1);
 	HashTableVoidEntry * e = _buckets[h];
 	HashTableVoidEntry * prev = NULL;
 	while (e != NULL)
 	{
-		if (strcmp(e->_key, key) == 0)
+		if (sameKey(e, &k))
 		{
+			if (e->_data == &_removed)
+			{
+				return false;
+			}
+			if (findImageEntry(&k) != NULL)
+			{
+				// Keep hiding the key of the image
+				e->_data = &_removed;
+				return true;
+			}
 			if (prev != NULL)
 			{
 				prev->_next = e->_next;
@@ -94,39 +401,253 @@ bool HashTableVoid::removeElement(const char * key)
 			{
 				_buckets[h] = e->_next;
 			}
-			free((void*)e->_key);
+			if (e->_length >= HashTableVoidInlineKey)
+			{
+				free((void*)e->_key);
+			}
 			delete e;
+			_count--;
 			return true;
 		}
 		prev = e;
 		e = e->_next;
 	}
+	if (findImageEntry(&k) != NULL)
+	{
+		addEntry(&k, &_removed);
+		return true;
+	}
 	return false;
 }
 
+struct HashTableVoidRecord {
+	const char * key;
+	void * data;
+};
+
+static int compareRecords(const void * a, const void * b)
+{
+	return strcmp(((const HashTableVoidRecord *)a)->key, ((const HashTableVoidRecord *)b)->key);
+}
+
+// Writes the records to path in a form openMapped can use without
+// reading it. Returns false if the file cannot be written.
+bool HashTableVoid::save(const char * path,
+			 const char * (*recordBytes)(void * data, unsigned * length))
+{
+	// Everything the table holds, in the order of the keys
+	int n = 0;
+	int max = _count + (_image != NULL ? _image->_count : 0);
+	HashTableVoidRecord * records = (HashTableVoidRecord *)malloc((max + 1)*sizeof(HashTableVoidRecord));
+	HashTableVoidIterator iterator(this);
+	while (iterator.next(records[n].key, records[n].data))
+	{
+		n++;
+	}
+	qsort(records, n, sizeof(HashTableVoidRecord), compareRecords);
+
+	// As many buckets as entries
+	unsigned tableSize = 1;
+	while (tableSize < (unsigned)n)
+	{
+		tableSize *= 2;
+	}
+	unsigned long long entries = sizeof(HashTableVoidImage) + (tableSize - 1)*sizeof(unsigned long long);
+	unsigned long long length = entries + n*sizeof(HashTableVoidImageEntry);
+	const char ** bytes = (const char **)malloc((n + 1)*sizeof(const char *));
+	unsigned * byteLengths = (unsigned *)malloc((n + 1)*sizeof(unsigned));
+	for (int i = 0; i < n; i ++)
+	{
+		unsigned keyLength = strlen(records[i].key);
+		if (keyLength >= HashTableVoidInlineKey)
+		{
+			length += keyLength + 1;
+		}
+		if (records[i].data == NULL)
+		{
+			// Found as NULL again
+			bytes[i] = NULL;
+			byteLengths[i] = 0;
+		}
+		else if (recordBytes != NULL)
+		{
+			bytes[i] = recordBytes(records[i].data, &byteLengths[i]);
+		}
+		else
+		{
+			bytes[i] = (const char *)records[i].data;
+			byteLengths[i] = strlen(bytes[i]) + 1;
+		}
+		// Records start at multiples of 8, for those that are structures
+		length = (length + 7) & ~7ull;
+		length += byteLengths[i];
+	}
+
+	char * image = (char *)calloc(1, length);
+	HashTableVoidImage * header = (HashTableVoidImage *)image;
+	header->_magic = HashTableVoidImageMagic;
+	header->_tableSize = tableSize;
+	header->_count = n;
+	header->_length = length;
+	unsigned long long at = entries + n*sizeof(HashTableVoidImageEntry);
+	for (int i = 0; i < n; i ++)
+	{
+		HashTableVoidKey k;
+		makeKey(records[i].key, &k);
+		unsigned long long o = entries + i*sizeof(HashTableVoidImageEntry);
+		HashTableVoidImageEntry * e = (HashTableVoidImageEntry *)(image + o);
+		e->_length = k._length;
+		e->_tag = k._tag;
+		if (k._length < HashTableVoidInlineKey)
+		{
+			memcpy(e->_inlineKey, k._padded, HashTableVoidInlineKey);
+		}
+		else
+		{
+			memcpy(image + at, records[i].key, k._length + 1);
+			e->_key = at;
+			at += k._length + 1;
+		}
+		at = (at + 7) & ~7ull;
+		if (bytes[i] != NULL)
+		{
+			memcpy(image + at, bytes[i], byteLengths[i]);
+			e->_data = at;
+			at += byteLengths[i];
+		}
+
+		unsigned b = k._hash & (tableSize - 1);
+		e->_next = header->_buckets[b];
+		header->_buckets[b] = o;
+	}
+	free(records);
+	free(bytes);
+	free(byteLengths);
+
+	// Replace the file as a whole, so that a mapping of the old one stays
+	// valid and nobody maps half of the new one
+	char tmp[strlen(path) + 5];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	bool ok = fd >= 0;
+	for (unsigned long long done = 0; ok && done < length; )
+	{
+		ssize_t w = write(fd, image + done, length - done);
+		ok = w > 0;
+		done += w;
+	}
+	if (fd >= 0)
+	{
+		ok = close(fd) == 0 && ok;
+	}
+	free(image);
+	if (!ok || rename(tmp, path) < 0)
+	{
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+// Maps a file written by save and makes its records the contents of the
+// table. Returns false if the file cannot be mapped or was not written
+// by save.
+bool HashTableVoid::openMapped(const char * path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(HashTableVoidImage))
+	{
+		close(fd);
+		return false;
+	}
+	void * p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		return false;
+	}
+	// The entries are trusted, but their array has to be there
+	HashTableVoidImage * image = (HashTableVoidImage *)p;
+	if (image->_magic != HashTableVoidImageMagic ||
+	    image->_length != (unsigned long long)st.st_size ||
+	    image->_tableSize == 0 ||
+	    (image->_tableSize & (image->_tableSize - 1)) != 0 ||
+	    sizeof(HashTableVoidImage) + (image->_tableSize - 1)*sizeof(unsigned long long) +
+	    (unsigned long long)image->_count*sizeof(HashTableVoidImageEntry) > image->_length)
+	{
+		munmap(p, st.st_size);
+		return false;
+	}
+
+	// Drop what the table held before
+	freeEntries();
+	if (_image != NULL)
+	{
+		munmap(_image, _image->_length);
+	}
+	_image = image;
+	return true;
+}
+
 // Creates an iterator object for this hash table
 HashTableVoidIterator::HashTableVoidIterator(HashTableVoid * hashTable)
 {
 	// Add implementation here
 	_hashTable = hashTable;
 	_currentBucket = 0;
+	_currentEntry = NULL;
+	_imageEntry = 0;
 }
 
 // Returns true if there is a next element. Stores data value in data.
 bool HashTableVoidIterator::next(const char * & key, void * & data)
 {
 	// Add implementation here
-	while (_currentBucket < _hashTable->TableSize)
+	// Walk the rest of the current chain before moving to the next bucket
+	while (1)
 	{
-		_currentEntry = _hashTable->_buckets[_currentBucket];
-		if (_currentEntry != NULL)
+		while (_currentEntry == NULL && _currentBucket < _hashTable->_tableSize)
 		{
-			key = _currentEntry->_key;
-			data = _currentEntry->_data;
+			_currentEntry = _hashTable->_buckets[_currentBucket];
 			_currentBucket ++;
+		}
+		if (_currentEntry == NULL)
+		{
+			break;
+		}
+		HashTableVoidEntry * e = _currentEntry;
+		_currentEntry = e->_next;
+		if (e->_data != &HashTableVoid::_removed)
+		{
+			key = e->key();
+			data = e->_data;
 			return true;
 		}
-		_currentBucket ++;
+	}
+
+	// Then the entries of the image that were not changed
+	HashTableVoidImage * image = _hashTable->_image;
+	while (image != NULL && _imageEntry < (int)image->_count)
+	{
+		HashTableVoidImageEntry * e = _hashTable->imageEntry(_imageEntry);
+		_imageEntry ++;
+		if (_hashTable->_count > 0)
+		{
+			HashTableVoidKey k;
+			HashTableVoid::makeKey(_hashTable->imageKey(e), &k);
+			if (_hashTable->findEntry(&k) != NULL)
+			{
+				continue;
+			}
+		}
+		key = _hashTable->imageKey(e);
+		data = _hashTable->imageData(e);
+		return true;
 	}
 	return false;
 }
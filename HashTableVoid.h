@@ -7,27 +7,125 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Keys shorter than this are kept in the entry itself, padded with zeros
+enum { HashTableVoidInlineKey = 24 };
+
 // Each hash entry stores a key, object pair
 struct HashTableVoidEntry {
-  const char * _key;
-  void * _data;
   HashTableVoidEntry * _next;
+  void * _data;
+  // Length of the key and top byte of its hash. Entries of other keys are
+  // nearly always told apart by these without comparing the keys.
+  unsigned _length;
+  unsigned char _tag;
+  union {
+    char _inlineKey[HashTableVoidInlineKey];
+    const char * _key;
+  };
+
+  const char * key() { return _length < HashTableVoidInlineKey ? _inlineKey : _key; }
+};
+
+// Layout of a table written by HashTableVoid::save. Everything refers to
+// everything else by its offset in the file, so a mapping of the file is
+// used as it is, wherever it lands. The header is followed by the bucket
+// array and then by the entries, in the order of their keys, and the long
+// keys and the records.
+enum { HashTableVoidImageMagic = 0x48544931 };
+
+struct HashTableVoidImage {
+  unsigned _magic;
+  unsigned _tableSize;
+  unsigned _count;
+  unsigned _reserved;
+  unsigned long long _length;
+  // Offset of the first entry of each bucket, or 0
+  unsigned long long _buckets[1];
+};
+
+struct HashTableVoidImageEntry {
+  unsigned long long _next;
+  // Offset of the record
+  unsigned long long _data;
+  unsigned _length;
+  unsigned char _tag;
+  union {
+    char _inlineKey[HashTableVoidInlineKey];
+    unsigned long long _key;
+  };
+};
+
+// A key being looked up, with its hash and, if it is short, a padded copy
+// that compares with an inline key as a whole
+struct HashTableVoidKey {
+  const char * _key;
+  unsigned _length;
+  unsigned _hash;
+  unsigned char _tag;
+  char _padded[HashTableVoidInlineKey];
 };
 
 // This is a Hash table that maps string keys to objects of type Data
 class HashTableVoid {
  public:
-  // Number of buckets
-  enum { TableSize = 2039};
+  // Initial number of buckets. The table doubles, staying a power of two,
+  // when it holds more entries than buckets.
+  enum { TableSize = 2048};
+
+  // Keys looked up together by findBatch and insertBatch
+  enum { BatchSize = 16 };
   
   // Array of the hash buckets.
   HashTableVoidEntry **_buckets;
+
+  // Number of buckets and of entries
+  int _tableSize;
+  int _count;
+
+  // Image the table was opened from, or NULL. The entries in _buckets
+  // then hold the changes made since, which hide the entries of the
+  // image with the same keys.
+  HashTableVoidImage * _image;
+
+  // Record of an entry that hides a key of the image which was removed
+  static char _removed;
   
   // Obtain the hash code of a key
-  int hash(const char * key);
+  static unsigned hash(const char * key, unsigned * length);
+
+  // Prepares key for lookups
+  static void makeKey(const char * key, HashTableVoidKey * k);
+
+  // Finds the entry of k in its bucket, or returns NULL
+  HashTableVoidEntry * findEntry(HashTableVoidKey * k);
+
+  // Adds an entry for k, which is not in the table
+  void addEntry(HashTableVoidKey * k, void * data);
+
+  // Places in data the record of k. Returns false if k does not exist.
+  bool lookup(HashTableVoidKey * k, void ** data);
+
+  // Doubles the number of buckets
+  void grow();
+
+  // Frees the entries in memory
+  void freeEntries();
+
+  // Finds the entry of k in the image, or returns NULL
+  HashTableVoidImageEntry * findImageEntry(HashTableVoidKey * k);
+
+  // Key and record of an entry of the image
+  const char * imageKey(HashTableVoidImageEntry * e);
+  void * imageData(HashTableVoidImageEntry * e);
+  HashTableVoidImageEntry * imageEntry(int i);
+
+  // Prepares keys and brings their buckets and the first entry and key
+  // of each into the cache
+  void prefetchBatch(const char ** keys, int n, HashTableVoidKey * k);
   
  public:
   HashTableVoid();
+  ~HashTableVoid();
   
   // Add a record to the hash table. Returns true if key already exists.
   // Substitute content if key already exists.
@@ -37,13 +135,40 @@ class HashTableVoid {
   // Returns false if key is does not exist
   bool find( const char * key, void ** data);
 
+  // Finds n keys at once and places in data[i] the record of keys[i], or
+  // NULL if it does not exist. Returns how many keys exist. The buckets
+  // of a group of keys are all fetched before any of them is probed, so
+  // their cache misses overlap.
+  int findBatch( const char ** keys, int n, void ** data);
+
+  // Adds n records at once like insertItem. Returns how many keys already
+  // existed.
+  int insertBatch( const char ** keys, void ** data, int n);
+
   // Removes an element in the hash table. Return false if key does not exist.
   bool removeElement(const char * key);
+
+  // Writes the records to path in a form openMapped can use without
+  // reading it. The record of a key is written as the length bytes
+  // that recordBytes returns for it, or when it is NULL, as the string
+  // the record points to. Returns false if the file cannot be written.
+  bool save(const char * path,
+            const char * (*recordBytes)(void * data, unsigned * length) = NULL);
+
+  // Maps a file written by save, read only, and makes its records the
+  // contents of the table. find then returns pointers to the records
+  // in the mapping. The file is never changed: records added, changed
+  // or removed afterwards are kept apart from it, in memory. Returns
+  // false if the file cannot be mapped or was not written by save.
+  bool openMapped(const char * path);
 };
 
+// Returns the entries in memory and then those of the image, in the
+// order of their keys, that they do not hide
 class HashTableVoidIterator {
   int _currentBucket;
   HashTableVoidEntry *_currentEntry;
+  int _imageEntry;
   HashTableVoid * _hashTable;
  public:
   HashTableVoidIterator(HashTableVoid * hashTable);
@@ -1,5 +1,6 @@
 
 #include <stdio.h>
+#include <unistd.h>
 #include "HashTableVoid.h"
 
 
@@ -212,11 +213,228 @@ void test6()
 
 }
 
+void test7()
+{
+  HashTableVoid h;
+
+  // Enough keys to grow the table several times
+  const int n = 20000;
+  char (*names)[16] = new char[n][16];
+  const char ** keys = new const char *[n];
+  void ** values = new void *[n];
+  for (int i = 0; i < n; i++) {
+    sprintf(names[i], "user%d", i);
+    keys[i] = names[i];
+    values[i] = (void *)(long)(i + 1);
+  }
+
+  int e = h.insertBatch(keys, values, n / 2);
+  assert(e == 0);
+  for (int i = n / 2; i < n; i++) {
+    assert(!h.insertItem(keys[i], values[i]));
+  }
+  // The same key twice in one batch is added once
+  const char * twice[] = { "twice", "twice" };
+  void * twiceValues[] = { (void *) 1, (void *) 2 };
+  e = h.insertBatch(twice, twiceValues, 2);
+  assert(e == 1);
+
+  void ** found = new void *[n];
+  e = h.findBatch(keys, n, found);
+  assert(e == n);
+  for (int i = 0; i < n; i++) {
+    assert(found[i] == values[i]);
+  }
+
+  for (int i = 0; i < n; i += 2) {
+    assert(h.removeElement(keys[i]));
+  }
+  e = h.findBatch(keys, n, found);
+  assert(e == n / 2);
+  for (int i = 0; i < n; i++) {
+    assert(found[i] == (i % 2 ? values[i] : NULL));
+  }
+
+  // The iterator sees every entry, also those sharing a bucket
+  HashTableVoidIterator iterator(&h);
+  long sum = 0;
+  int count = 0;
+  const char * key;
+  void * data;
+  while (iterator.next(key, data)) {
+    sum += (long) data;
+    count++;
+  }
+  long expected = 2;
+  for (int i = 1; i < n; i += 2) {
+    expected += i + 1;
+  }
+  assert(count == n / 2 + 1);
+  assert(sum == expected);
+
+  delete [] names;
+  delete [] keys;
+  delete [] values;
+  delete [] found;
+
+  printf("Test7 passed\n");
+}
+
+void test8()
+{
+  HashTableVoid h;
+
+  // Keys kept in the entry and outside of it, around the limit, and keys
+  // that differ only in their last byte
+  const char * keys[] = {
+    "",
+    "a",
+    "abcdefghijklmnopqrstuv",
+    "abcdefghijklmnopqrstuvw",
+    "abcdefghijklmnopqrstuvx",
+    "abcdefghijklmnopqrstuvwx",
+    "abcdefghijklmnopqrstuvwy",
+    "a much longer key that is kept outside of the entry",
+    "a much longer key that is kept outside of the entrz",
+  };
+  int n = sizeof(keys) / sizeof(keys[0]);
+  for (int i = 0; i < n; i++) {
+    assert(!h.insertItem(keys[i], (void *)(long)(i + 1)));
+  }
+  for (int i = 0; i < n; i++) {
+    void * data;
+    assert(h.find(keys[i], &data));
+    assert(data == (void *)(long)(i + 1));
+  }
+
+  void * data;
+  assert(!h.find("abcdefghijklmnopqrstu", &data));
+  assert(!h.find("abcdefghijklmnopqrstuvwxy", &data));
+  assert(!h.find("a much longer key that is kept outside of the entr", &data));
+
+  // Keys returned by the iterator are whole
+  HashTableVoidIterator iterator(&h);
+  const char * key;
+  int count = 0;
+  while (iterator.next(key, data)) {
+    assert(!strcmp(key, keys[(long) data - 1]));
+    count++;
+  }
+  assert(count == n);
+
+  for (int i = 0; i < n; i++) {
+    assert(h.removeElement(keys[i]));
+    assert(!h.find(keys[i], &data));
+  }
+
+  printf("Test8 passed\n");
+}
+
+void test9()
+{
+  const char * path = "HashTableVoidTest.img";
+  const int n = 5000;
+  char (*names)[48] = new char[n][48];
+  char (*values)[16] = new char[n][16];
+  {
+    HashTableVoid h;
+    for (int i = 0; i < n; i++) {
+      // Short and long keys
+      sprintf(names[i], i % 3 ? "user%d" : "a-rather-long-user-name-%d", i);
+      sprintf(values[i], "pw%d", i);
+      h.insertItem(names[i], values[i]);
+    }
+    assert(h.save(path));
+  }
+
+  // The records come straight from the mapping
+  HashTableVoid m;
+  assert(m.openMapped(path));
+  for (int i = 0; i < n; i++) {
+    void * data;
+    assert(m.find(names[i], &data));
+    assert(data != values[i]);
+    assert(!strcmp((const char *) data, values[i]));
+  }
+  void * data;
+  assert(!m.find("user-none", &data));
+  const char * keys[] = { "user1", "nobody", "a-rather-long-user-name-3" };
+  void * found[3];
+  assert(m.findBatch(keys, 3, found) == 2);
+  assert(!strcmp((const char *) found[0], "pw1"));
+  assert(found[1] == NULL);
+  assert(!strcmp((const char *) found[2], "pw3"));
+
+  // An image is walked in the order of its keys
+  HashTableVoidIterator all(&m);
+  const char * key;
+  const char * last = "";
+  int count = 0;
+  while (all.next(key, data)) {
+    assert(strcmp(last, key) < 0);
+    last = key;
+    count++;
+  }
+  assert(count == n);
+
+  // Changes stay in memory and hide the image
+  assert(m.insertItem("user1", (void *) "changed"));
+  assert(!m.insertItem("newcomer", (void *) "new"));
+  assert(m.removeElement("user2"));
+  assert(!m.removeElement("user2"));
+  assert(m.removeElement("a-rather-long-user-name-3"));
+  assert(!m.removeElement("nobody"));
+  assert(m.find("user1", &data) && !strcmp((const char *) data, "changed"));
+  assert(m.find("newcomer", &data) && !strcmp((const char *) data, "new"));
+  assert(!m.find("user2", &data));
+  assert(!m.find("a-rather-long-user-name-3", &data));
+  assert(!m.insertItem("user2", (void *) "back"));
+  assert(m.find("user2", &data) && !strcmp((const char *) data, "back"));
+  assert(m.removeElement("user2"));
+  // Only user1 is there of these, the removed key comes back
+  void * batch[] = { (void *) "changed", NULL, (void *) "pw3" };
+  assert(m.insertBatch(keys, batch, 3) == 1);
+  assert(m.find("a-rather-long-user-name-3", &data) && !strcmp((const char *) data, "pw3"));
+
+  HashTableVoidIterator changed(&m);
+  count = 0;
+  while (changed.next(key, data)) {
+    assert(strcmp(key, "user2"));
+    count++;
+  }
+  assert(count == n + 1);
+
+  // Saving the changed table again, over the file that is still mapped
+  assert(m.save(path));
+  assert(m.find("user1", &data) && !strcmp((const char *) data, "changed"));
+  HashTableVoid again;
+  assert(again.openMapped(path));
+  assert(again.find("user1", &data) && !strcmp((const char *) data, "changed"));
+  assert(again.find("newcomer", &data) && !strcmp((const char *) data, "new"));
+  assert(!again.find("user2", &data));
+  assert(again.find("nobody", &data) && data == NULL);
+  assert(again.find("user4", &data) && !strcmp((const char *) data, "pw4"));
+
+  // Anything else is turned down
+  FILE * f = fopen(path, "w");
+  fprintf(f, "not an image at all, but long enough to hold a header\n");
+  fclose(f);
+  HashTableVoid bad;
+  assert(!bad.openMapped(path));
+  assert(!bad.openMapped("HashTableVoidTest.none"));
+  unlink(path);
+
+  delete [] names;
+  delete [] values;
+
+  printf("Test9 passed\n");
+}
+
 void
 usage()
 {
   // Print usage
-  fprintf(stderr, "HashTableTemplateTest test1|test2|test3|test4|test5|test6\n");
+  fprintf(stderr, "HashTableTemplateTest test1|test2|test3|test4|test5|test6|test7|test8|test9\n");
 }
 
 int
@@ -245,6 +463,15 @@ main( int argc, char **argv)
   else if ( !strcmp(argv[1], "test6")) {
     test6();
   }
+  else if ( !strcmp(argv[1], "test7")) {
+    test7();
+  }
+  else if ( !strcmp(argv[1], "test8")) {
+    test8();
+  }
+  else if ( !strcmp(argv[1], "test9")) {
+    test9();
+  }
   else {
     usage();
     exit(1);
@@ -6,9 +6,30 @@ const char * usage =
 "                                                               \n"
 "To use it in one window type:                                  \n"
 "                                                               \n"
-"   IRCServer <port>                                          \n"
+"   IRCServer <port> [blocking|uring|epoll] [<backlog>]        \n"
+"             [<primary-port>]                                  \n"
 "                                                               \n"
-"Where 1024 < port < 65536.                                     \n"
+"Where 1024 < port < 65536. The second argument selects how     \n"
+"connections are served: one at a time with blocking calls      \n"
+"(the default), through io_uring, or by coroutines on an epoll  \n"
+"event loop. <backlog> is the length of the queue of            \n"
+"connections waiting to be accepted (1024 by default).          \n"
+"                                                               \n"
+"Starting a server on the port of a running one restarts it in  \n"
+"place: the new server takes over the listening socket, the     \n"
+"subscribed connections and every user, room and message, and   \n"
+"the old one exits once its requests in flight are done.        \n"
+"                                                               \n"
+"With <primary-port> the server follows the server on that port \n"
+"of this host: it copies every user, room and message from it   \n"
+"and keeps up with its changes, answering only the commands     \n"
+"that change nothing. It takes writes itself once the primary   \n"
+"is gone.                                                       \n"
+"                                                               \n"
+"If cluster.txt lists ports of this host, one per line, the     \n"
+"servers on those ports share the rooms: each one keeps the     \n"
+"rooms that hash to it and answers MOVED <port> for the others. \n"
+"Users are copied to all of them.                               \n"
 "                                                               \n"
 "In another window type:                                        \n"
 "                                                               \n"
@@ -22,17 +43,139 @@ const char * usage =
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include <string>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "IRCServer.h"
+#include "IoUring.h"
+#include "EventLoop.h"
+
+int QueueLength = 1024;
+
+// Connections accepted in a row by the blocking loop before serving them
+const int AcceptBatch = 64;
+
+// Requests per second, and burst size, allowed to a single user and to a
+// single client address
+double UserRequestRate = 20;
+double UserRequestBurst = 40;
+double AddressRequestRate = 100;
+double AddressRequestBurst = 200;
+// Seconds between sweeps of the buckets that are full again, which are
+// dropped
+double BucketSweepSeconds = 10;
+
+// New connections are answered BUSY while the accept queue is this full,
+// or while the server uses more CPU than this over the last sample.
+double MaxBacklogFill = 0.75;
+double MaxCpuLoad = 0.95;
+double CpuSampleSeconds = 0.1;
+
+// Time a client has to send its command line, and then to take the
+// answer, in milliseconds
+int ReadTimeoutMs = 10000;
+int RequestTimeoutMs = 30000;
+
+// Time another node of the cluster has to answer JOIN. Two nodes that
+// start together wait for each other until then, and join each other
+// later.
+int JoinTimeoutMs = 1000;
+
+// Longest wait, in seconds, between two tries of a follower to restart
+// and follow its primary again. The wait doubles from one second.
+int FollowRetryMaxSeconds = 64;
+
+// Size of the io_uring queues, and number and size of the buffers the
+// kernel picks from to receive command lines
+const unsigned UringEntries = 1024;
+const int UringBufferCount = 512;
+const int UringBufferSize = 2048;
+
+// Kind of operation of an io_uring completion, kept in the upper half of
+// its user_data. The lower half holds the socket.
+enum { AcceptOp = 1, RecvOp, SendOp, CloseOp, TimeoutOp, UpgradeOp, CancelOp };
+
+// Sockets passed per message when handing over to a new server, below
+// the kernel limit of 253
+const int MaxHandOffFds = 250;
+const unsigned HandOffMagic = 0x49524331;
+
+// Sent by the old server before the sockets and the state
+struct HandOffHeader {
+	unsigned magic;
+	unsigned fdCount;
+	unsigned long long length;
+};
+
+// Commands, in the order of their names below. Their values are the
+// opcodes of binary requests, so new ones go at the end.
+enum {
+	AddUserCommand, EnterRoomCommand, LeaveRoomCommand, SendMessageCommand,
+	GetMessagesCommand, GetUsersInRoomCommand, GetAllUsersCommand,
+	CreateRoomCommand, ListRoomsCommand, SearchMessagesCommand,
+	SyncCommand, SubscribeCommand, BatchCommand, FollowCommand, JoinCommand,
+	CommandCount
+};
 
-int QueueLength = 5;
+constexpr const char * commandNames[CommandCount] = {
+	"ADD-USER", "ENTER-ROOM", "LEAVE-ROOM", "SEND-MESSAGE",
+	"GET-MESSAGES", "GET-USERS-IN-ROOM", "GET-ALL-USERS",
+	"CREATE-ROOM", "LIST-ROOMS", "SEARCH-MESSAGES",
+	"SYNC", "SUBSCRIBE", "BATCH", "FOLLOW", "JOIN"
+};
+
+// Built by the compiler, so a command is found with a single comparison
+constexpr StaticPerfectHash<CommandCount> commandTable(commandNames);
+
+// Arguments the server was started with, to start it again
+static char ** serverArgv;
+
+// Upper bound of threads used to parse the password file, and the
+// smallest slice of the file worth handing to a thread of its own.
+const int MaxLoaderThreads = 16;
+const long MinLoaderChunk = 64 * 1024;
+
+static double
+now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// CPU time used by the process so far
+static double
+cpuSeconds()
+{
+	struct rusage u;
+	getrusage(RUSAGE_SELF, &u);
+	return u.ru_utime.tv_sec + u.ru_utime.tv_usec / 1e6 +
+		u.ru_stime.tv_sec + u.ru_stime.tv_usec / 1e6;
+}
 
 int
 IRCServer::open_server_socket(int port) {
@@ -45,7 +188,7 @@ IRCServer::open_server_socket(int port) {
 	serverIPAddress.sin_port = htons((u_short) port);
   
 	// Allocate a socket
-	int masterSocket =  socket(PF_INET, SOCK_STREAM, 0);
+	int masterSocket =  socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if ( masterSocket < 0) {
 		perror("socket");
 		exit( -1 );
@@ -66,6 +209,14 @@ IRCServer::open_server_socket(int port) {
 		exit( -1 );
 	}
 	
+	// Answers are small and sent at once, so do not hold them back
+	setsockopt(masterSocket, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(int));
+
+	// Only wake up the server once the client has sent its command
+	int deferSeconds = (ReadTimeoutMs + 999) / 1000;
+	setsockopt(masterSocket, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		   &deferSeconds, sizeof(int));
+
 	// Put socket in listening mode and set the 
 	// size of the queue of unprocessed connections
 	error = listen( masterSocket, QueueLength);
@@ -78,28 +229,115 @@ IRCServer::open_server_socket(int port) {
 }
 
 void
-IRCServer::runServer(int port)
+IRCServer::runServer(int port, Backend backend, int primaryPort)
 {
-	int masterSocket = open_server_socket(port);
+	serverPort = port;
+	upgradeConnection = -1;
+	activeConnections = 0;
+	this->primaryPort = primaryPort;
+	pthread_mutex_init(&stateLock, NULL);
+
+	// Take over from a server already running on the port, or start
+	// from scratch, or from the state of the primary
+	if (!takeOver(port)) {
+		masterSocket = open_server_socket(port);
+		if (primaryPort == 0) {
+			initialize();
+		}
+		else {
+			resetState();
+			bool refused;
+			if (!connectPrimary(&refused) || !readBootstrap(primary, false)) {
+				fprintf(stderr, "Could not follow port %d\n", primaryPort);
+				exit(-1);
+			}
+		}
+	}
+	open_upgrade_socket(port);
 
-	initialize();
+	// Apply the changes of the primary as they come, or those of the
+	// other nodes of the cluster
+	if (primary != NULL) {
+		printf("Following port %d, %d users and %d rooms\n",
+		       primaryPort, userCount, roomIndex.count);
+		pthread_t thread;
+		pthread_create(&thread, NULL, followPrimary, this);
+		pthread_detach(thread);
+	}
+	else {
+		joinCluster();
+	}
+
+	// Subscribers that went away are detected by failed writes
+	signal(SIGPIPE, SIG_IGN);
+
+	if (backend == UringBackend && !runUringServer()) {
+		fprintf(stderr, "io_uring is not available, using blocking calls\n");
+	}
+	if (backend == EpollBackend && !runEventLoopServer()) {
+		fprintf(stderr, "epoll is not available, using blocking calls\n");
+	}
 	
+	// Drain the accept queue in batches
+	fcntl(masterSocket, F_SETFL, fcntl(masterSocket, F_GETFL) | O_NONBLOCK);
+	int batch[AcceptBatch];
+
 	while ( 1 ) {
+
+		// A server taking over gets everything between two batches,
+		// when no request is in flight
+		upgradeConnection = accept4( upgradeSocket, NULL, NULL, SOCK_CLOEXEC );
+		if ( upgradeConnection >= 0 ) {
+			handOff();
+		}
 		
-		// Accept incoming connections
-		struct sockaddr_in clientIPAddress;
-		int alen = sizeof( clientIPAddress );
-		int slaveSocket = accept( masterSocket,
-					  (struct sockaddr *)&clientIPAddress,
-					  (socklen_t*)&alen);
-		
-		if ( slaveSocket < 0 ) {
-			perror( "accept" );
-			exit( -1 );
+		// Accept incoming connections until none is waiting. The
+		// accepted sockets stay blocking for processRequest.
+		int n = 0;
+		while ( n < AcceptBatch ) {
+			int slaveSocket = accept4( masterSocket, NULL, NULL, SOCK_CLOEXEC );
+			if ( slaveSocket < 0 ) {
+				if ( errno == EINTR || errno == ECONNABORTED ) {
+					continue;
+				}
+				if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+					perror( "accept" );
+				}
+				break;
+			}
+			batch[ n++ ] = slaveSocket;
+		}
+
+		if ( n == 0 ) {
+			// Wait for connections, waking up now and then while a
+			// subscriber has queued messages
+			struct pollfd p[2];
+			p[0].fd = masterSocket;
+			p[0].events = POLLIN;
+			p[1].fd = upgradeSocket;
+			p[1].events = POLLIN;
+			poll( p, 2, flushTimeoutMs() );
+			flushSubscribers();
+			continue;
 		}
+
+		for ( int i = 0; i < n; i++ ) {
+			int slaveSocket = batch[ i ];
+
+			// Shed the connection without reading it if overloaded
+			if ( !admitConnection() ) {
+				const char * msg = "BUSY\r\n";
+				write(slaveSocket, msg, strlen(msg));
+				close(slaveSocket);
+				continue;
+			}
 		
-		// Process request.
-		processRequest( slaveSocket );		
+			// Process request.
+			processRequest( slaveSocket );		
+
+			// Retry subscribers whose socket buffer was full
+			flushSubscribers();
+		}
 	}
 }
 
@@ -115,861 +353,5207 @@ main( int argc, char ** argv )
 	// Get the port from the arguments
 	int port = atoi( argv[1] );
 
+	IRCServer::Backend backend = IRCServer::BlockingBackend;
+	if ( argc > 2 ) {
+		if ( !strcmp(argv[2], "uring") ) {
+			backend = IRCServer::UringBackend;
+		}
+		else if ( !strcmp(argv[2], "epoll") ) {
+			backend = IRCServer::EpollBackend;
+		}
+		else if ( strcmp(argv[2], "blocking") ) {
+			fprintf( stderr, "%s", usage );
+			exit( -1 );
+		}
+	}
+
+	if ( argc > 3 ) {
+		QueueLength = atoi( argv[3] );
+	}
+
+	int primaryPort = 0;
+	if ( argc > 4 ) {
+		primaryPort = atoi( argv[4] );
+	}
+	serverArgv = argv;
+
 	IRCServer ircServer;
 
 	// It will never return
-	ircServer.runServer(port);
+	ircServer.runServer(port, backend, primaryPort);
 	
 }
 
 //
-// Commands:
-//   Commands are started y the client.
-//
-//   Request: ADD-USER <USER> <PASSWD>\r\n
-//   Answer: OK\r\n or DENIED\r\n
-//
-//   REQUEST: GET-ALL-USERS <USER> <PASSWD>\r\n
-//   Answer: USER1\r\n
-//            USER2\r\n
-//            ...
-//            \r\n
-//
-//   REQUEST: CREATE-ROOM <USER> <PASSWD> <ROOM>\r\n
-//   Answer: OK\n or DENIED\r\n
-//
-//   Request: LIST-ROOMS <USER> <PASSWD>\r\n
-//   Answer: room1\r\n
-//           room2\r\n
-//           ...
-//           \r\n
-//
-//   Request: ENTER-ROOM <USER> <PASSWD> <ROOM>\r\n
-//   Answer: OK\n or DENIED\r\n
-//
-//   Request: LEAVE-ROOM <USER> <PASSWD>\r\n
-//   Answer: OK\n or DENIED\r\n
-//
-//   Request: SEND-MESSAGE <USER> <PASSWD> <MESSAGE> <ROOM>\n
-//   Answer: OK\n or DENIED\n
-//
-//   Request: GET-MESSAGES <USER> <PASSWD> <LAST-MESSAGE-NUM> <ROOM>\r\n
-//   Answer: MSGNUM1 USER1 MESSAGE1\r\n
-//           MSGNUM2 USER2 MESSAGE2\r\n
-//           MSGNUM3 USER2 MESSAGE2\r\n
-//           ...\r\n
-//           \r\n
-//
-//    REQUEST: GET-USERS-IN-ROOM <USER> <PASSWD> <ROOM>\r\n
-//    Answer: USER1\r\n
-//            USER2\r\n
-//            ...
-//            \r\n
+// Restarting without downtime:
+//   A server listens on the abstract local socket "IRCServer.<port>". A
+//   new server started on the same port connects to it instead of
+//   binding the port. The old server stops accepting, finishes the
+//   requests in flight, and passes the listening socket and the sockets
+//   of its subscribers with SCM_RIGHTS, followed by a snapshot of its
+//   state. It exits once the new server has restored the snapshot.
+//   Connections arriving meanwhile wait in the accept queue.
 //
 
-void
-IRCServer::processRequest( int fd )
+static socklen_t
+upgradeAddress(int port, struct sockaddr_un * address)
 {
-	// Buffer used to store the comand received from the client
-	const int MaxCommandLine = 1024;
-	char commandLine[ MaxCommandLine + 1 ];
-	int commandLineLength = 0;
-	int n;
-	
-	// Currently character read
-	unsigned char prevChar = 0;
-	unsigned char newChar = 0;
-	
-	//
-	// The client should send COMMAND-LINE\n
-	// Read the name of the client character by character until a
-	// \n is found.
-	//
-
-	// Read character by character until a \n is found or the command string is full.
-	while ( commandLineLength < MaxCommandLine &&
-		read( fd, &newChar, 1) > 0 ) {
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	// Abstract names start with a NUL and go away with the socket
+	int n = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1,
+			 "IRCServer.%d", port);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
 
-		if (newChar == '\n' && prevChar == '\r') {
-			break;
+static bool
+writeFully(int fd, const void * data, size_t length)
+{
+	const char * p = (const char *)data;
+	while (length > 0) {
+		ssize_t n = write(fd, p, length);
+		if (n < 0 && errno == EINTR) {
+			continue;
 		}
-		
-		commandLine[ commandLineLength ] = newChar;
-		commandLineLength++;
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		length -= n;
+	}
+	return true;
+}
 
-		prevChar = newChar;
+static bool
+readFully(int fd, void * data, size_t length)
+{
+	char * p = (char *)data;
+	while (length > 0) {
+		ssize_t n = read(fd, p, length);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		length -= n;
 	}
-	
-	// Add null character at the end of the string
-	// Eliminate last \r
-	commandLineLength--;
-        commandLine[ commandLineLength ] = 0;
+	return true;
+}
 
-	printf("RECEIVED: %s\n", commandLine);
+// Sends count sockets, at most MaxHandOffFds, along with a single byte
+static bool
+sendFds(int sock, const int * fds, int count)
+{
+	union {
+		struct cmsghdr header;
+		char data[CMSG_SPACE(MaxHandOffFds * sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
 
-	//printf("The commandLine has the following format:\n");
-	//printf("COMMAND <user> <password> <arguments>. See below.\n");
-	//printf("You need to separate the commandLine into those components\n");
-	//printf("For now, command, user, and password are hardwired.\n");
+	char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
 
-	char * tempCommand = (char*)malloc(MaxCommandLine*sizeof(char));
-	char * tempUser = (char*)malloc(MaxCommandLine*sizeof(char));
-	char * tempPassword = (char*)malloc(MaxCommandLine*sizeof(char));
-	char * tempArgs = (char*)malloc(MaxCommandLine*sizeof(char));
-	char * tempInput = (char*)malloc(MaxCommandLine*sizeof(char));
-	strcpy(tempInput, commandLine);
+	struct cmsghdr * c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(count * sizeof(int));
+	memcpy(CMSG_DATA(c), fds, count * sizeof(int));
 
-	int position = 0;
-	while(*tempInput != '\0' && *tempInput != ' ')
-	{
-		tempCommand[position] = *tempInput;
-		tempInput ++;
-		position ++;
-	}
-	position = 0;
-	tempInput ++;
-	while(*tempInput != '\0' && *tempInput != ' ')
-	{
-		tempUser[position] = *tempInput;
-		tempInput ++;
-		position ++;
-	}
-	position = 0;
-	tempInput ++;
-	while(*tempInput != '\0' && *tempInput != ' ')
-	{
-		tempPassword[position] = *tempInput;
-		tempInput ++;
-		position ++;
-	}
-	position = 0;
-	tempInput ++;
-	tempArgs = tempInput;
+	ssize_t n;
+	do {
+		n = sendmsg(sock, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	return n == 1;
+}
 
-	const char * command = tempCommand;
-	const char * user = tempUser;
-	const char * password = tempPassword;
-	const char * args = tempArgs;
+// Receives the count sockets sent by sendFds()
+static bool
+receiveFds(int sock, int * fds, int count)
+{
+	union {
+		struct cmsghdr header;
+		char data[CMSG_SPACE(MaxHandOffFds * sizeof(int))];
+	} control;
 
-	printf("command=%s\n", command);
-	printf("user=%s\n", user);
-	printf( "password=%s\n", password );
-	printf("args=%s\n", args);
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data;
+	msg.msg_controllen = sizeof(control.data);
 
-	if (!strcmp(command, "ADD-USER")) {
-		addUser(fd, user, password, args);
-	}
-	else if (!strcmp(command, "ENTER-ROOM")) {
-		enterRoom(fd, user, password, args);
-	}
-	else if (!strcmp(command, "LEAVE-ROOM")) {
-		leaveRoom(fd, user, password, args);
-	}
-	else if (!strcmp(command, "SEND-MESSAGE")) {
-		sendMessage(fd, user, password, args);
-	}
-	else if (!strcmp(command, "GET-MESSAGES")) {
-		getMessages(fd, user, password, args);
-	}
-	else if (!strcmp(command, "GET-USERS-IN-ROOM")) {
-		getUsersInRoom(fd, user, password, args);
-	}
-	else if (!strcmp(command, "GET-ALL-USERS")) {
-		getAllUsers(fd, user, password, args);
-	}
-	else if (!strcmp(command, "CREATE-ROOM")) {
-		createRoom(fd, user, password, args);
-	}
-	else if (!strcmp(command, "LIST-ROOMS")) {
-		listRooms(fd, user, password, args);
-	}
-	else {
-		const char * msg =  "UNKNOWN COMMAND\r\n";
-		write(fd, msg, strlen(msg));
+	ssize_t n;
+	do {
+		n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	struct cmsghdr * c = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (c == NULL || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS ||
+	    c->cmsg_len != CMSG_LEN(count * sizeof(int))) {
+		return false;
 	}
+	memcpy(fds, CMSG_DATA(c), count * sizeof(int));
+	return true;
+}
 
-	// Send OK answer
-	//const char * msg =  "OK\n";
-	//write(fd, msg, strlen(msg));
-	close(fd);	
+// Snapshot fields are native unsigned ints and strings written with
+// their length and terminating NUL, so that the new server keeps the
+// strings in the snapshot buffer instead of copying them.
+static void
+putNumber(std::string * out, unsigned n)
+{
+	out->append((const char *)&n, sizeof(n));
 }
 
-void
-IRCServer::initialize()
+static void
+putLong(std::string * out, unsigned long long n)
 {
-	// Open password file
+	out->append((const char *)&n, sizeof(n));
+}
 
-	// Initialize users in room
-	userList.head = NULL;
-	roomList.head = NULL;
-	// Initalize message list
-	messList.head = NULL;
-	messCount = 0;
+static void
+putBytes(std::string * out, const char * data, unsigned length)
+{
+	putNumber(out, length);
+	out->append(data, length);
+	out->push_back('\0');
 }
 
-bool
-IRCServer::checkPassword(int fd, const char * user, const char * password) {
-	// Here check the password
-	Person * e = userList.head;
-	while (e->next != NULL)
-	{
-		if (strcmp(e->username, user) == 0)
-		{
-			if (strcmp(e->password, password) == 0)
-			{	
-				return true;
-			}
-		}
-		e = e->next;
-	}
-	if (strcmp(e->username, user) == 0)
-	{
-		if (strcmp(e->password, password) == 0)
-		{
-			return true;
-		}
+static void
+putString(std::string * out, const char * s)
+{
+	putBytes(out, s, strlen(s));
+}
+
+struct SnapshotReader {
+	char * p;
+	char * end;
+	bool ok;
+};
+
+static unsigned
+getNumber(SnapshotReader * in)
+{
+	unsigned n = 0;
+	if (in->end - in->p < (long)sizeof(n)) {
+		in->ok = false;
+		return 0;
 	}
+	memcpy(&n, in->p, sizeof(n));
+	in->p += sizeof(n);
+	return n;
+}
 
-	return false;
+static unsigned long long
+getLong(SnapshotReader * in)
+{
+	unsigned long long n = 0;
+	if (in->end - in->p < (long)sizeof(n)) {
+		in->ok = false;
+		return 0;
+	}
+	memcpy(&n, in->p, sizeof(n));
+	in->p += sizeof(n);
+	return n;
 }
 
-bool
-IRCServer::checkRoom(int fd, const char * user, const char * password, const char * args) 
+static char *
+getBytes(SnapshotReader * in, unsigned * length)
 {
-	Room * e;
-	if (roomList.head == NULL)
-	{
-		return false;
+	*length = getNumber(in);
+	if (!in->ok || in->end - in->p < (long)*length + 1 || in->p[*length] != '\0') {
+		in->ok = false;
+		*length = 0;
+		return (char *)"";
 	}
-	e = roomList.head;
-	while (e->next != NULL)
-	{
-		if (strcmp(args, e->roomName) == 0)
-		{
-			return true;
+	char * s = in->p;
+	in->p += *length + 1;
+	return s;
+}
+
+static char *
+getString(SnapshotReader * in)
+{
+	unsigned length;
+	return getBytes(in, &length);
+}
+
+// Listens for a server that wants to take over. Without it the server
+// runs as usual but cannot be restarted in place.
+void
+IRCServer::open_upgrade_socket(int port)
+{
+	struct sockaddr_un address;
+	socklen_t length = upgradeAddress(port, &address);
+	upgradeSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (upgradeSocket < 0 ||
+	    bind(upgradeSocket, (struct sockaddr *)&address, length) < 0 ||
+	    listen(upgradeSocket, 1) < 0) {
+		perror("upgrade socket");
+		if (upgradeSocket >= 0) {
+			close(upgradeSocket);
 		}
-		e = e->next;
-	}
-	if (strcmp(args, e->roomName) == 0)
-	{
-		return true;
+		upgradeSocket = -1;
 	}
-	return false;
 }
 
+// Connects to a server already running on port and takes over its
+// listening socket, subscribers and state. Returns false if there is no
+// such server.
 bool
-IRCServer::checkUserInRoom(int fd, const char * user, const char * password, const char * args)
+IRCServer::takeOver(int port)
 {
-	Person * e;
-	Room * f;
-	if (userList.head == NULL)
-	{
+	struct sockaddr_un address;
+	socklen_t addressLength = upgradeAddress(port, &address);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
 		return false;
 	}
-	e = userList.head;
-	while(e->next != NULL)
-	{
-		if (strcmp(e->username, user) == 0)
-		{
-			f = e->roomIn;
-			if (f != NULL)
-			{
-				while (f->next != NULL)
-				{
-					if (strcmp(f->roomName, args) == 0)
-					{
-						return true;
-					}
-					f = f->next;
-				}
-				if (strcmp(f->roomName, args) == 0)
-				{
-					return true;
-				}
-			}
+	if (connect(fd, (struct sockaddr *)&address, addressLength) < 0) {
+		close(fd);
+		return false;
+	}
+	printf("Taking over port %d\n", port);
+	double start = now();
+
+	// The old server answers once its requests in flight are done
+	HandOffHeader header;
+	bool ok = readFully(fd, &header, sizeof(header)) &&
+		header.magic == HandOffMagic && header.fdCount >= 1;
+	int * fds = NULL;
+	char * snapshot = NULL;
+	if (ok) {
+		fds = (int *)malloc(header.fdCount * sizeof(int));
+		for (unsigned i = 0; ok && i < header.fdCount; i += MaxHandOffFds) {
+			int n = header.fdCount - i < (unsigned)MaxHandOffFds ?
+				header.fdCount - i : MaxHandOffFds;
+			ok = receiveFds(fd, fds + i, n);
 		}
-		e = e->next;
 	}
-	if (strcmp(e->username, user) == 0)
-        {
-		f = e->roomIn;
-		if (f != NULL)
-		{
-                	while (f->next != NULL)
-                	{
-	        	        if (strcmp(f->roomName, args) == 0)
-                	        {
-                	                return true;
-                	        }
-                	        f = f->next;
-                	}
-                	if (strcmp(f->roomName, args) == 0)
-                	{
-                	        return true;
-                	}
+	if (ok) {
+		// Names and messages stay in this buffer for good
+		snapshot = (char *)malloc(header.length + 1);
+		ok = readFully(fd, snapshot, header.length);
+	}
+	if (ok) {
+		resetState();
+		bool refused = false;
+		if (primaryPort != 0 && connectPrimary(&refused)) {
+			// A follower starts over from the state of the primary
+			for (unsigned i = 1; i < header.fdCount; i++) {
+				close(fds[i]);
+			}
+			free(snapshot);
+			ok = readBootstrap(primary, false);
+		}
+		else if (primaryPort != 0 && !refused) {
+			// The primary is up but turned this server away, so the
+			// old one keeps following it and tries again later
+			fprintf(stderr, "Port %d would not be followed\n", primaryPort);
+			ok = false;
+		}
+		else {
+			if (primaryPort != 0) {
+				printf("Port %d is gone, taking writes\n", primaryPort);
+				primaryPort = 0;
+			}
+			ok = readSnapshot(snapshot, header.length, fds, header.fdCount);
+			indexUsers();
 		}
 	}
-}
+	if (!ok) {
+		fprintf(stderr, "Could not take over port %d\n", port);
+		exit(-1);
+	}
+	masterSocket = fds[0];
+	free(fds);
+
+	// Use the backlog of this server from now on
+	listen(masterSocket, QueueLength);
+
+	char done = 1;
+	writeFully(fd, &done, 1);
+	close(fd);
+	printf("Took over %u sockets and %llu bytes of state in %.3f ms\n",
+	       header.fdCount, header.length, (now() - start) * 1000);
+	return true;
+}
+
+// Hands everything over to the server connected on upgradeConnection and
+// exits. Returns, still serving, if that server goes away first.
+void
+IRCServer::handOff()
+{
+	int fd = upgradeConnection;
+	upgradeConnection = -1;
+	double start = now();
+
+	// Free the name for the new server
+	close(upgradeSocket);
+	upgradeSocket = -1;
+
+	struct timeval tv;
+	tv.tv_sec = RequestTimeoutMs / 1000;
+	tv.tv_usec = (RequestTimeoutMs % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	std::string snapshot;
+	pthread_mutex_lock(&stateLock);
+	int fdCount = historyFile >= 0 ? 2 : 1;
+	for (Subscriber * s = subscriberList; s != NULL; s = s->nextAll) {
+		fdCount++;
+	}
+	int * fds = (int *)malloc(fdCount * sizeof(int));
+	writeSnapshot(&snapshot, fds);
+	pthread_mutex_unlock(&stateLock);
+
+	HandOffHeader header;
+	header.magic = HandOffMagic;
+	header.fdCount = fdCount;
+	header.length = snapshot.size();
+	bool ok = writeFully(fd, &header, sizeof(header));
+	for (int i = 0; ok && i < fdCount; i += MaxHandOffFds) {
+		int n = fdCount - i < MaxHandOffFds ? fdCount - i : MaxHandOffFds;
+		ok = sendFds(fd, fds + i, n);
+	}
+	ok = ok && writeFully(fd, snapshot.data(), snapshot.size());
+
+	// Wait until the new server has restored the snapshot
+	char done;
+	ok = ok && read(fd, &done, 1) == 1;
+	close(fd);
+	free(fds);
+	if (!ok) {
+		fprintf(stderr, "The new server went away, still serving\n");
+		open_upgrade_socket(serverPort);
+		return;
+	}
+	printf("Handed over %d sockets and %lu bytes of state in %.3f ms\n",
+	       fdCount, (unsigned long)snapshot.size(), (now() - start) * 1000);
+	exit(0);
+}
+
+// Writes users, rooms with their members and history, and subscribers
+// to out. Users are written in name order and referred to by id, which
+// the new server keeps, so histories are copied as they are. Fills fds
+// with the listening socket, the history file if there is one, and the
+// socket of every subscriber in the order they are written.
+void
+IRCServer::writeSnapshot(std::string * out, int * fds)
+{
+	int i = 0;
+	fds[i++] = masterSocket;
+	putNumber(out, historyFile >= 0);
+	if (historyFile >= 0) {
+		fds[i++] = historyFile;
+		putLong(out, historyLength);
+	}
+
+	putNumber(out, userCount);
+	for (int id = 0; id < userCount; id++) {
+		Person * e = usersById[id];
+		putString(out, e->username);
+		putString(out, e->password);
+		putNumber(out, e->id);
+	}
+
+	putNumber(out, roomIndex.count);
+	for (Room * r = roomIndex.head[0]; r != NULL; r = r->next[0]) {
+		putString(out, r->roomName);
+		putNumber(out, r->messCount);
+		putNumber(out, r->memberCount);
+		for (int j = 0; j < r->memberCount; j++) {
+			putNumber(out, r->members[j]->id);
+			putNumber(out, findRoomRef(r->members[j], r)->readCursor);
+		}
+		putNumber(out, r->extentCount);
+		for (int j = 0; j < r->extentCount; j++) {
+			HistoryExtent * e = &r->extents[j];
+			putNumber(out, e->firstMessNum);
+			putNumber(out, e->count);
+			putLong(out, e->offset);
+			putLong(out, e->length);
+			int marks = (e->count + HistoryMarkInterval - 1) / HistoryMarkInterval;
+			out->append((const char *)e->marks, marks * sizeof(unsigned));
+		}
+		std::string history;
+		for (MessageSegment * g = r->firstSegment; g != NULL; g = g->next) {
+			history.append(g->data, g->length);
+		}
+		putBytes(out, history.data(), history.size());
+
+		int termCount = 0;
+		for (Postings * p = r->terms; p != NULL; p = p->next) {
+			termCount++;
+		}
+		putNumber(out, termCount);
+		for (Postings * p = r->terms; p != NULL; p = p->next) {
+			putString(out, p->term);
+			putNumber(out, p->count);
+			putNumber(out, p->last);
+			putBytes(out, (const char *)p->data, p->length);
+		}
+	}
+
+	// Subscribers keep the messages they had not received yet
+	int subscriberCount = 0;
+	for (Subscriber * s = subscriberList; s != NULL; s = s->nextAll) {
+		subscriberCount++;
+	}
+	putNumber(out, subscriberCount);
+	for (Subscriber * s = subscriberList; s != NULL; s = s->nextAll) {
+		fds[i++] = s->fd;
+		putNumber(out, s->person->id);
+		std::string pending;
+		for (int j = 0; j < s->queueCount; j++) {
+			Payload * p = s->queue[(s->queueHead + j) % SubscriberQueueLength];
+			int skip = j == 0 ? s->offset : 0;
+			pending.append(p->data + skip, p->length - skip);
+		}
+		putBytes(out, pending.data(), pending.size());
+	}
+}
+
+// Rebuilds the state written by writeSnapshot() in a server that was
+// just reset. Returns false if the snapshot is not valid.
+bool
+IRCServer::readSnapshot(char * data, long length, int * fds, int fdCount)
+{
+	SnapshotReader in;
+	in.p = data;
+	in.end = data + length;
+	in.ok = true;
+
+	int next = 1;
+	if (getNumber(&in)) {
+		if (fdCount < 2) {
+			return false;
+		}
+		historyFile = fds[next++];
+		historyLength = getLong(&in);
+	}
+
+	// Every record takes at least a number, which bounds the counts
+	unsigned users = getNumber(&in);
+	if (!in.ok || users > length / sizeof(unsigned)) {
+		return false;
+	}
+	Person * people = (Person *)malloc((users + 1) * sizeof(Person));
+	usersById = (Person **)calloc(users + 1, sizeof(Person *));
+	userCount = users;
+	userIdMax = users + 1;
+	for (unsigned i = 0; i < users; i++) {
+		people[i].username = getString(&in);
+		people[i].password = getString(&in);
+		people[i].id = getNumber(&in);
+		people[i].args = NULL;
+		people[i].roomIn = NULL;
+		people[i].subs = NULL;
+		if (!in.ok || (unsigned)people[i].id >= users || usersById[people[i].id] != NULL) {
+			return false;
+		}
+		usersById[people[i].id] = &people[i];
+	}
+	// By id, so a name added again keeps its first user
+	for (unsigned id = 0; id < users; id++) {
+		void * data;
+		if (!userIndex.find(usersById[id]->username, &data)) {
+			userIndex.insertItem(usersById[id]->username, usersById[id]);
+		}
+	}
+
+	unsigned roomCount = getNumber(&in);
+	if (!in.ok || roomCount > length / sizeof(unsigned)) {
+		return false;
+	}
+	for (unsigned i = 0; i < roomCount && in.ok; i++) {
+		Room * r = insertRoom(getString(&in));
+		if (r == NULL) {
+			return false;
+		}
+		unsigned messages = getNumber(&in);
+		unsigned memberCount = getNumber(&in);
+		if (!in.ok || memberCount > users) {
+			return false;
+		}
+		r->members = (Person **)malloc((memberCount + 1) * sizeof(Person *));
+		r->memberMax = memberCount;
+		for (unsigned j = 0; j < memberCount; j++) {
+			unsigned u = getNumber(&in);
+			if (u >= users) {
+				return false;
+			}
+			Person * e = usersById[u];
+			r->members[r->memberCount++] = e;
+
+			RoomRef * f = (RoomRef *)malloc(sizeof(RoomRef));
+			f->room = r;
+			f->readCursor = getNumber(&in);
+			f->next = e->roomIn;
+			e->roomIn = f;
+		}
+
+		unsigned extents = getNumber(&in);
+		if (!in.ok || extents > messages || (extents > 0 && historyFile < 0)) {
+			return false;
+		}
+		for (unsigned j = 0; j < extents; j++) {
+			HistoryExtent * e = addExtent(r);
+			e->firstMessNum = getNumber(&in);
+			e->count = getNumber(&in);
+			e->offset = getLong(&in);
+			e->length = getLong(&in);
+			if (!in.ok || e->count <= 0 || (unsigned)e->count > messages ||
+			    e->offset + e->length > historyLength) {
+				return false;
+			}
+			int marks = (e->count + HistoryMarkInterval - 1) / HistoryMarkInterval;
+			if (in.end - in.p < (long)(marks * sizeof(unsigned))) {
+				return false;
+			}
+			e->marks = (unsigned *)malloc(marks * sizeof(unsigned));
+			memcpy(e->marks, in.p, marks * sizeof(unsigned));
+			in.p += marks * sizeof(unsigned);
+		}
+
+		// The history becomes a single segment. Check every record
+		// first: the NUL after it stops a truncated varint.
+		unsigned historyLength;
+		const char * history = getBytes(&in, &historyLength);
+		const char * p = history;
+		const char * end = history + historyLength;
+		int firstMessNum = -1;
+		while (p < end) {
+			int messNum, from, textLength;
+			const char * text;
+			p = decodeMessage(p, &messNum, &from, &text, &textLength);
+			if (text > end || textLength < 0 || p > end ||
+			    messNum < 0 || (unsigned)messNum >= messages || (unsigned)from >= users) {
+				return false;
+			}
+			if (firstMessNum < 0) {
+				firstMessNum = messNum;
+			}
+		}
+		if (historyLength > 0) {
+			MessageSegment * g = newMessageSegment(r, historyLength);
+			memcpy(g->data, history, historyLength);
+			g->length = historyLength;
+			g->firstMessNum = firstMessNum;
+		}
+		r->messCount = messages;
+		messCount += messages;
+
+		unsigned termCount = getNumber(&in);
+		if (!in.ok || termCount > length / sizeof(unsigned)) {
+			return false;
+		}
+		for (unsigned j = 0; j < termCount && in.ok; j++) {
+			Postings * p = findPostings(r, getString(&in), true);
+			p->count = getNumber(&in);
+			p->last = getNumber(&in);
+			unsigned postingsLength;
+			const char * postings = getBytes(&in, &postingsLength);
+			if (p->count < 0 || (unsigned)p->count > messages || postingsLength > 5 * messages) {
+				return false;
+			}
+			p->data = (unsigned char *)malloc(postingsLength + 1);
+			memcpy(p->data, postings, postingsLength);
+			p->length = postingsLength;
+			p->capacity = postingsLength + 1;
+		}
+	}
+
+	unsigned subscriberCount = getNumber(&in);
+	if (!in.ok || subscriberCount != (unsigned)(fdCount - next)) {
+		return false;
+	}
+	for (unsigned i = 0; i < subscriberCount; i++) {
+		unsigned u = getNumber(&in);
+		unsigned pendingLength;
+		char * pending = getBytes(&in, &pendingLength);
+		if (u >= users) {
+			return false;
+		}
+		Subscriber * s = addSubscriber(fds[next + i], usersById[u]);
+		if (pendingLength > 0) {
+			Payload * p = newPayload(pendingLength);
+			memcpy(p->data, pending, pendingLength);
+			s->queue[0] = p;
+			s->queueCount = 1;
+			pendingSubscribers++;
+		}
+	}
+	return in.ok && in.p == in.end;
+}
+
+// Serves connections through io_uring: a multishot accept on the
+// listening socket, receives into buffers provided to the kernel, and
+// each answer sent with a send linked to the close of the socket. Returns
+// false if io_uring cannot be used, and never returns otherwise.
+bool
+IRCServer::runUringServer()
+{
+	IoUring ring;
+	if (!ring.init(UringEntries) ||
+	    !ring.initBuffers(0, UringBufferCount, UringBufferSize)) {
+		return false;
+	}
+
+	// Connections by socket
+	int connectionMax = 1024;
+	Connection ** connections = (Connection **)calloc(connectionMax, sizeof(Connection *));
+
+	ring.prepareAccept(masterSocket)->user_data = (unsigned long long)AcceptOp << 32;
+	if (upgradeSocket >= 0) {
+		ring.preparePoll(upgradeSocket, POLLIN)->user_data = (unsigned long long)UpgradeOp << 32;
+	}
+
+	while ( 1 ) {
+		ring.submit(1);
+
+		struct io_uring_cqe * cqe;
+		while ((cqe = ring.peekCqe()) != NULL) {
+			int op = cqe->user_data >> 32;
+			int fd = (int)(cqe->user_data & 0xffffffff);
+			int res = cqe->res;
+			unsigned flags = cqe->flags;
+			ring.seenCqe();
+
+			if (op == AcceptOp) {
+				if (!(flags & IORING_CQE_F_MORE) && upgradeConnection < 0) {
+					ring.prepareAccept(masterSocket)->user_data =
+						(unsigned long long)AcceptOp << 32;
+				}
+				if (res < 0) {
+					continue;
+				}
+				fd = res;
+				if (!admitConnection()) {
+					static const char busy[] = "BUSY\r\n";
+					struct io_uring_sqe * sqe = ring.prepareSend(fd, busy, strlen(busy));
+					sqe->flags |= IOSQE_IO_LINK;
+					sqe->user_data = ((unsigned long long)SendOp << 32) | fd;
+					ring.prepareClose(fd)->user_data =
+						((unsigned long long)CloseOp << 32) | fd;
+					continue;
+				}
+				if (fd >= connectionMax) {
+					int max = 2 * fd;
+					connections = (Connection **)realloc(connections, max * sizeof(Connection *));
+					memset(connections + connectionMax, 0,
+					       (max - connectionMax) * sizeof(Connection *));
+					connectionMax = max;
+				}
+				Connection * c = new Connection;
+				c->fd = fd;
+				c->commandLineLength = 0;
+				c->prevChar = 0;
+				c->readDeadline = EventLoop::now() + ReadTimeoutMs;
+				connections[fd] = c;
+				activeConnections++;
+				armRecv(&ring, c);
+			}
+			else if (op == RecvOp) {
+				Connection * c = connections[fd];
+				if (res == -ENOBUFS) {
+					// Every buffer is in use, try again
+					armRecv(&ring, c);
+					continue;
+				}
+				if (res < 0) {
+					// Failed, or cancelled by its timeout
+					ring.prepareClose(fd)->user_data = ((unsigned long long)CloseOp << 32) | fd;
+					continue;
+				}
+				bool complete = true;
+				if (res > 0) {
+					int id = flags >> IORING_CQE_BUFFER_SHIFT;
+					complete = readCommandLine(c, ring.buffer(id), res);
+					ring.recycleBuffer(id);
+				}
+				if (complete) {
+					if (finishConnection(&ring, c)) {
+						delete c;
+						connections[fd] = NULL;
+						activeConnections--;
+					}
+				}
+				else {
+					armRecv(&ring, c);
+				}
+			}
+			else if (op == CloseOp) {
+				if (res == -ECANCELED) {
+					// The linked send failed
+					close(fd);
+				}
+				if (fd < connectionMax && connections[fd] != NULL) {
+					delete connections[fd];
+					connections[fd] = NULL;
+					activeConnections--;
+				}
+			}
+			else if (op == UpgradeOp) {
+				// A new server wants to take over. Stop accepting and
+				// let the connections in flight finish.
+				upgradeConnection = accept4(upgradeSocket, NULL, NULL, SOCK_CLOEXEC);
+				if (upgradeConnection < 0) {
+					ring.preparePoll(upgradeSocket, POLLIN)->user_data =
+						(unsigned long long)UpgradeOp << 32;
+					continue;
+				}
+				ring.prepareCancel((unsigned long long)AcceptOp << 32)->user_data =
+					(unsigned long long)CancelOp << 32;
+			}
+		}
+
+		// Retry subscribers whose socket buffer was full
+		flushSubscribers();
+
+		if (upgradeConnection >= 0 && activeConnections == 0) {
+			handOff();
+
+			// The new server went away, accept again
+			ring.prepareAccept(masterSocket)->user_data = (unsigned long long)AcceptOp << 32;
+			if (upgradeSocket >= 0) {
+				ring.preparePoll(upgradeSocket, POLLIN)->user_data =
+					(unsigned long long)UpgradeOp << 32;
+			}
+		}
+	}
+}
+
+// Queues a receive for c, linked to a timeout for the time left until
+// its line must be complete
+void
+IRCServer::armRecv(IoUring * ring, Connection * c)
+{
+	unsigned long long t = EventLoop::now();
+	unsigned long long left = c->readDeadline > t ? c->readDeadline - t : 1;
+	c->readTimeout.tv_sec = left / 1000;
+	c->readTimeout.tv_nsec = (left % 1000) * 1000000;
+
+	struct io_uring_sqe * sqe = ring->prepareRecv(c->fd);
+	sqe->flags |= IOSQE_IO_LINK;
+	sqe->user_data = ((unsigned long long)RecvOp << 32) | c->fd;
+	ring->prepareLinkTimeout(&c->readTimeout)->user_data =
+		((unsigned long long)TimeoutOp << 32) | c->fd;
+}
+
+// Adds received bytes to the command line of c. Returns true once the
+// line is complete.
+bool
+IRCServer::readCommandLine(Connection * c, const char * data, int length)
+{
+	for (int i = 0; i < length; i++) {
+		unsigned char newChar = data[i];
+		if (isFrame(c->commandLine, c->commandLineLength)) {
+			// A binary request ends where its length says
+			c->commandLine[ c->commandLineLength ] = newChar;
+			c->commandLineLength++;
+			if (frameComplete(c->commandLine, c->commandLineLength)) {
+				return true;
+			}
+			continue;
+		}
+		if (newChar == '\n' && c->prevChar == '\r') {
+			return true;
+		}
+		c->commandLine[ c->commandLineLength ] = newChar;
+		c->commandLineLength++;
+		c->prevChar = newChar;
+		if (c->commandLineLength == MaxCommandLine) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Runs the command received by c and leaves its answer in c->answer.
+// Returns true if a subscriber kept the socket.
+bool
+IRCServer::runCommand(Connection * c)
+{
+	if (isFrame(c->commandLine, c->commandLineLength)) {
+		replyCapture = &c->answer;
+		bool kept = dispatchFrame(c->fd, c->commandLine, c->commandLineLength);
+		replyCapture = NULL;
+		return kept;
+	}
+
+	// Eliminate last \r
+	if (c->commandLineLength > 0 && c->commandLine[ c->commandLineLength - 1 ] == '\r') {
+		c->commandLineLength--;
+	}
+	c->commandLine[ c->commandLineLength ] = 0;
+
+	replyCapture = &c->answer;
+	bool kept = dispatchRequest(c->fd, c->commandLine);
+	replyCapture = NULL;
+	return kept;
+}
+
+// Runs the command of c and queues its answer, followed by the close of
+// the socket. Returns true if a subscriber kept the socket instead.
+bool
+IRCServer::finishConnection(IoUring * ring, Connection * c)
+{
+	bool kept = runCommand(c);
+
+	if (kept) {
+		// The answer is a short OK, and the subscriber writes directly
+		// from now on
+		write(c->fd, c->answer.data(), c->answer.size());
+		return true;
+	}
+	if (!c->answer.empty()) {
+		struct io_uring_sqe * sqe = ring->prepareSend(c->fd, c->answer.data(), c->answer.size());
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe->user_data = ((unsigned long long)SendOp << 32) | c->fd;
+	}
+	ring->prepareClose(c->fd)->user_data = ((unsigned long long)CloseOp << 32) | c->fd;
+	return false;
+}
+
+// Serves connections with coroutines on an epoll event loop: one
+// coroutine accepts and one more runs each connection, all on this
+// thread. Returns false if the event loop cannot be created, and never
+// returns otherwise.
+bool
+IRCServer::runEventLoopServer()
+{
+	EventLoop loop;
+	if (!loop.init()) {
+		return false;
+	}
+	fcntl(masterSocket, F_SETFL, fcntl(masterSocket, F_GETFL) | O_NONBLOCK);
+	loop.watch(masterSocket);
+	acceptConnections(&loop).detach();
+	if (upgradeSocket >= 0) {
+		loop.watch(upgradeSocket);
+		awaitUpgrade(&loop).detach();
+	}
+
+	while ( 1 ) {
+		// Wake up now and then while a subscriber has queued messages
+		loop.poll(flushTimeoutMs());
+		flushSubscribers();
+
+		if (upgradeConnection >= 0 && activeConnections == 0) {
+			handOff();
+
+			// The new server went away. Connections still waiting are
+			// accepted along with the next one.
+			if (upgradeSocket >= 0) {
+				loop.watch(upgradeSocket);
+				awaitUpgrade(&loop).detach();
+			}
+		}
+	}
+}
+
+// Waits for a server that wants to take over
+Task
+IRCServer::awaitUpgrade(EventLoop * loop)
+{
+	while ( 1 ) {
+		upgradeConnection = accept4(upgradeSocket, NULL, NULL, SOCK_CLOEXEC);
+		if (upgradeConnection >= 0) {
+			break;
+		}
+		co_await loop->readable(upgradeSocket);
+	}
+	loop->forget(upgradeSocket);
+}
+
+Task
+IRCServer::acceptConnections(EventLoop * loop)
+{
+	while ( 1 ) {
+		if (upgradeConnection >= 0) {
+			// Leave new connections to the server taking over
+			co_await loop->readable(masterSocket);
+			continue;
+		}
+		int fd = accept4(masterSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				co_await loop->readable(masterSocket);
+			}
+			else if (errno != EINTR && errno != ECONNABORTED) {
+				perror("accept");
+				co_await loop->readable(masterSocket);
+			}
+			continue;
+		}
+
+		if (!admitConnection()) {
+			const char * msg = "BUSY\r\n";
+			write(fd, msg, strlen(msg));
+			close(fd);
+			continue;
+		}
+		serveConnection(loop, fd).detach();
+	}
+}
+
+// Shuts down the socket of a connection that missed its deadline, which
+// fails the read or write its coroutine is waiting for
+void
+IRCServer::connectionTimeout(void * arg)
+{
+	Connection * c = (Connection *)arg;
+	c->timedOut = true;
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+// Reads the command line of a connection, runs it and sends the answer
+Task
+IRCServer::serveConnection(EventLoop * loop, int fd)
+{
+	Connection c;
+	c.fd = fd;
+	c.commandLineLength = 0;
+	c.prevChar = 0;
+	c.timedOut = false;
+	loop->watch(fd);
+	activeConnections++;
+
+	TimerWheel * timers = loop->timers();
+	TimerWheel::init(&c.deadline, connectionTimeout, &c);
+	timers->schedule(&c.deadline, EventLoop::now() + ReadTimeoutMs);
+
+	char buffer[MaxCommandLine];
+	bool complete = false;
+	while (!complete) {
+		ssize_t n = read(fd, buffer, sizeof(buffer));
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			co_await loop->readable(fd);
+			continue;
+		}
+		if (n <= 0) {
+			// Run whatever arrived, as the blocking loop does
+			break;
+		}
+		complete = readCommandLine(&c, buffer, n);
+	}
+
+	if (c.timedOut) {
+		loop->forget(fd);
+		close(fd);
+		activeConnections--;
+		co_return;
+	}
+
+	timers->schedule(&c.deadline, EventLoop::now() + RequestTimeoutMs);
+	bool kept = runCommand(&c);
+	bool sent;
+	co_await loop->writeAll(fd, c.answer.data(), c.answer.size(), &sent);
+	timers->cancel(&c.deadline);
+	loop->forget(fd);
+	if (!kept) {
+		close(fd);
+	}
+	activeConnections--;
+}
+
+//
+// Commands:
+//   Commands are started y the client.
+//
+//   Request: ADD-USER <USER> <PASSWD>\r\n
+//   Answer: OK\r\n or DENIED\r\n
+//   A name that is taken gets OK only with the password it has, and
+//   DENIED (User exists) with any other.
+//
+//   REQUEST: GET-ALL-USERS <USER> <PASSWD> [<CURSOR> [<LIMIT>]]\r\n
+//   Answer: USER1\r\n
+//            USER2\r\n
+//            ...
+//            \r\n
+//   Users are sorted by name. Only users after CURSOR ("-" for the
+//   first page) are listed, at most LIMIT of them.
+//
+//   REQUEST: CREATE-ROOM <USER> <PASSWD> <ROOM>\r\n
+//   Answer: OK\n or DENIED\r\n
+//
+//   Request: LIST-ROOMS <USER> <PASSWD> [<CURSOR> [<LIMIT> [<PREFIX>]]]\r\n
+//   Answer: room1\r\n
+//           room2\r\n
+//           ...
+//           \r\n
+//   Rooms are sorted by name. Only rooms after CURSOR ("-" for the
+//   first page) starting with PREFIX are listed, at most LIMIT of them.
+//
+//   Request: ENTER-ROOM <USER> <PASSWD> <ROOM>\r\n
+//   Answer: OK\n or DENIED\r\n
+//
+//   Request: LEAVE-ROOM <USER> <PASSWD>\r\n
+//   Answer: OK\n or DENIED\r\n
+//
+//   Request: SEND-MESSAGE <USER> <PASSWD> <MESSAGE> <ROOM>\n
+//   Answer: OK\n or DENIED\n
+//
+//   Request: GET-MESSAGES <USER> <PASSWD> <LAST-MESSAGE-NUM> <ROOM>\r\n
+//   Answer: MSGNUM1 USER1 MESSAGE1\r\n
+//           MSGNUM2 USER2 MESSAGE2\r\n
+//           MSGNUM3 USER2 MESSAGE2\r\n
+//           ...\r\n
+//           \r\n
+//
+//    REQUEST: GET-USERS-IN-ROOM <USER> <PASSWD> <ROOM> [<CURSOR> [<LIMIT>]]\r\n
+//    Answer: USER1\r\n
+//            USER2\r\n
+//            ...
+//            \r\n
+//
+//    REQUEST: SEARCH-MESSAGES <USER> <PASSWD> <ROOM> <TERMS>\r\n
+//    Answer: MSGNUM1 USER1 MESSAGE1\r\n
+//            ...
+//            \r\n
+//    Messages of ROOM holding every one of TERMS, ignoring case, at
+//    most the last 100 of them in order.
+//
+//    REQUEST: SYNC <USER> <PASSWD>\r\n
+//    Answer: ROOM1\r\n
+//            MSGNUM1 USER1 MESSAGE1\r\n
+//            ...
+//            \r\n
+//            ROOM2\r\n
+//            ...
+//            \r\n
+//            \r\n
+//            or NO-NEW-MESSAGES\r\n
+//    The messages USER has not read yet in each of its rooms, those sent
+//    since it entered the room or since its last SYNC or GET-MESSAGES of
+//    the room.
+//
+//    REQUEST: SUBSCRIBE <USER> <PASSWD>\r\n
+//    Answer: OK\r\n followed, on the same connection, by
+//            MSGNUM USER MESSAGE\r\n
+//            for every message later sent to the rooms of USER
+//
+//    REQUEST: BATCH <USER> <PASSWD> <LENGTH1> <COMMAND1> [<ARGS1>] <LENGTH2> ...\r\n
+//    Answer: BATCH <COUNT>\r\n
+//            <LENGTH1>\r\n
+//            <ANSWER1><LENGTH2>\r\n
+//            <ANSWER2>...
+//    Runs up to 16 commands of USER in order, each one given as the
+//    LENGTH bytes of "<COMMAND> <ARGS>" that follow it, such as
+//    "16 ENTER-ROOM lobby". Each answer is the one the command alone
+//    would get, LENGTH bytes long. The password is checked once, and
+//    BATCH, SUBSCRIBE, FOLLOW and JOIN cannot be batched. Every command
+//    counts against the rate limits as if it came alone, and one over
+//    them answers DENIED (Rate limit).
+//
+//    REQUEST: FOLLOW\r\n
+//    Answer: OK\r\n followed, on the same connection, by the records
+//            of the state and of every later change, as described
+//            under Replication below
+//    Only taken from this host. A follower answers DENIED (Read only)
+//    to FOLLOW and to every command that changes something.
+//
+//    REQUEST: JOIN <PORT>\r\n
+//    Answer: OK\r\n followed by the records of every user and of the
+//            rooms that now belong to the node on PORT, then by the
+//            users added later, as described under Cluster below
+//    Only taken from this host, by another node of the cluster.
+//
+//    In a cluster, a room command for a room of another node is
+//    answered MOVED <PORT>\r\n, the port of the node to ask instead.
+//
+// Binary requests:
+//   A request that starts with the byte 0xB1 is binary instead:
+//
+//   Request: 0xB1 <SIZE> <OPCODE> <N> <USER> <N> <PASSWD> <N> <ARGS>
+//   Answer: <SIZE> <ANSWER>
+//
+//   SIZE and N are varints, 7 bits a byte with the lowest first, each
+//   one the length of what follows it: the rest of the request, or the
+//   answer, or the field. OPCODE is a byte, the position of the command
+//   in the list ADD-USER, ENTER-ROOM, LEAVE-ROOM, SEND-MESSAGE,
+//   GET-MESSAGES, GET-USERS-IN-ROOM, GET-ALL-USERS, CREATE-ROOM,
+//   LIST-ROOMS, SEARCH-MESSAGES, SYNC, SUBSCRIBE, BATCH, FOLLOW, JOIN,
+//   from 0.
+//   ARGS and ANSWER are those of the text command, so nothing has to be
+//   scanned for the end of a line or of a list. After SUBSCRIBE the
+//   messages follow as text lines.
+//
+//   A frame whose fields could not come in a text line, with a space,
+//   CR or LF in the user, the password or a room name, or CR or LF in
+//   the text of a message, is answered ERROR (Bad frame).
+//
+
+void
+IRCServer::processRequest( int fd )
+{
+	// Buffer used to store the comand received from the client
+	char commandLine[ MaxCommandLine + 1 ];
+	int commandLineLength = 0;
+	int n;
+	
+	// Currently character read
+	unsigned char prevChar = 0;
+	unsigned char newChar = 0;
+	
+	//
+	// The client should send COMMAND-LINE\n
+	// Read the name of the client character by character until a
+	// \n is found.
+	//
+
+	// Give the client ReadTimeoutMs to send the whole line. A read waits
+	// at most that long, and the loop stops once the deadline has passed.
+	struct timeval tv;
+	tv.tv_sec = ReadTimeoutMs / 1000;
+	tv.tv_usec = (ReadTimeoutMs % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	double deadline = now() + ReadTimeoutMs / 1000.0;
+
+	// Read character by character until a \n is found or the command string is full.
+	while ( commandLineLength < MaxCommandLine &&
+		now() < deadline &&
+		read( fd, &newChar, 1) > 0 ) {
+
+		if (isFrame(commandLine, commandLineLength)) {
+			// A binary request ends where its length says
+			commandLine[ commandLineLength ] = newChar;
+			commandLineLength++;
+			if (frameComplete(commandLine, commandLineLength)) {
+				break;
+			}
+			continue;
+		}
+
+		if (newChar == '\n' && prevChar == '\r') {
+			break;
+		}
+		
+		commandLine[ commandLineLength ] = newChar;
+		commandLineLength++;
+
+		prevChar = newChar;
+	}
+	
+	if (now() >= deadline) {
+		close(fd);
+		return;
+	}
+
+	if (isFrame(commandLine, commandLineLength)) {
+		if (!dispatchFrame(fd, commandLine, commandLineLength)) {
+			close(fd);
+		}
+		return;
+	}
+	
+	// Add null character at the end of the string
+	// Eliminate last \r
+	commandLineLength--;
+        commandLine[ commandLineLength ] = 0;
+
+	if (!dispatchRequest(fd, commandLine)) {
+		close(fd);
+	}
+}
+
+// Parses a command line and runs its handler. Returns true if the
+// handler kept the connection open, false if it can be closed.
+bool
+IRCServer::dispatchRequest( int fd, const char * commandLine )
+{
+	printf("RECEIVED: %s\n", commandLine);
+
+	//printf("The commandLine has the following format:\n");
+	//printf("COMMAND <user> <password> <arguments>. See below.\n");
+	//printf("You need to separate the commandLine into those components\n");
+	//printf("For now, command, user, and password are hardwired.\n");
+
+	// Split a copy of the line in place into
+	// "<COMMAND> <USER> <PASSWORD> <ARGS>"
+	char line[ MaxCommandLine + 1 ];
+	snprintf(line, sizeof(line), "%s", commandLine);
+	char * fields[3];
+	char * p = line;
+	for (int i = 0; i < 3; i++)
+	{
+		fields[i] = p;
+		while (*p != '\0' && *p != ' ')
+		{
+			p++;
+		}
+		if (*p == ' ')
+		{
+			*p++ = '\0';
+		}
+	}
+
+	const char * command = fields[0];
+	const char * user = fields[1];
+	const char * password = fields[2];
+	const char * args = p;
+
+	printf("command=%s\n", command);
+	printf("user=%s\n", user);
+	printf( "password=%s\n", password );
+	printf("args=%s\n", args);
+
+	return serveRequest(fd, commandTable.find(command), user, password, args);
+}
+
+// Runs the handler of command, one of the commands above or -1. Returns
+// true if the handler kept the connection open.
+bool
+IRCServer::runRequest(int fd, int command, const char * user, const char * password, const char * args)
+{
+	// A follower gets its changes from the primary only
+	if (primaryPort != 0) {
+		switch (command) {
+		case AddUserCommand:
+		case EnterRoomCommand:
+		case LeaveRoomCommand:
+		case SendMessageCommand:
+		case CreateRoomCommand:
+		case SubscribeCommand:
+		case FollowCommand:
+		case JoinCommand: {
+			const char * msg = "DENIED (Read only)\r\n";
+			reply(fd, msg, strlen(msg));
+			return false;
+		}
+		}
+	}
+
+	// In a cluster the commands about a room go to the node that owns it
+	int owner = roomOwner(command, args);
+	if (owner != 0) {
+		char msg[32];
+		snprintf(msg, sizeof(msg), "MOVED %d\r\n", owner);
+		reply(fd, msg, strlen(msg));
+		return false;
+	}
+
+	switch (command) {
+	case AddUserCommand:
+		addUser(fd, user, password, args);
+		break;
+	case EnterRoomCommand:
+		enterRoom(fd, user, password, args);
+		break;
+	case LeaveRoomCommand:
+		leaveRoom(fd, user, password, args);
+		break;
+	case SendMessageCommand:
+		sendMessage(fd, user, password, args);
+		break;
+	case GetMessagesCommand:
+		getMessages(fd, user, password, args);
+		break;
+	case GetUsersInRoomCommand:
+		getUsersInRoom(fd, user, password, args);
+		break;
+	case GetAllUsersCommand:
+		getAllUsers(fd, user, password, args);
+		break;
+	case CreateRoomCommand:
+		createRoom(fd, user, password, args);
+		break;
+	case ListRoomsCommand:
+		listRooms(fd, user, password, args);
+		break;
+	case SearchMessagesCommand:
+		searchMessages(fd, user, password, args);
+		break;
+	case SyncCommand:
+		sync(fd, user, password, args);
+		break;
+	case SubscribeCommand:
+		if (subscribe(fd, user, password, args)) {
+			// The connection now belongs to the subscriber
+			return true;
+		}
+		break;
+	case BatchCommand:
+		batch(fd, user, password, args);
+		break;
+	case FollowCommand:
+		if (follow(fd, user, password, args)) {
+			// The connection now belongs to the follower
+			return true;
+		}
+		break;
+	case JoinCommand:
+		if (join(fd, user, password, args)) {
+			// The connection now belongs to the node
+			return true;
+		}
+		break;
+	default: {
+		const char * msg =  "UNKNOWN COMMAND\r\n";
+		reply(fd, msg, strlen(msg));
+	}
+	}
+
+	// Send OK answer
+	//const char * msg =  "OK\n";
+	//write(fd, msg, strlen(msg));
+	return false;
+}
+
+static char * putVarint(char * p, unsigned v);
+
+// Reads the varint at p, which must end before end. Returns the byte
+// after it, or NULL if it does not.
+static const char *
+getFrameVarint(const char * p, const char * end, unsigned * v)
+{
+	unsigned result = 0;
+	for (int shift = 0; p < end && shift < 35; shift += 7)
+	{
+		unsigned char b = *p++;
+		result |= (unsigned)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+		{
+			*v = result;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+// Whether the request read so far is a binary one
+bool
+IRCServer::isFrame(const char * data, int length)
+{
+	return length > 0 && (unsigned char)data[0] == BinaryFrameMagic;
+}
+
+// Whether the binary request read so far is whole, or too long to be
+bool
+IRCServer::frameComplete(const char * data, int length)
+{
+	if (length >= MaxCommandLine)
+	{
+		return true;
+	}
+	unsigned size;
+	const char * p = getFrameVarint(data + 1, data + length, &size);
+	return p != NULL && data + length - p >= (long)size;
+}
+
+// Runs a binary request. Returns true if the handler kept the connection
+// open, false if it can be closed.
+bool
+IRCServer::dispatchFrame(int fd, const char * frame, int length)
+{
+	// The magic byte and the length of the rest, then the opcode and
+	// the user, password and arguments, each one after its length
+	const char * end = frame + length;
+	unsigned size;
+	const char * p = getFrameVarint(frame + 1, end, &size);
+	bool ok = p != NULL && size >= 1 && end - p >= (long)size;
+	int command = -1;
+	if (ok)
+	{
+		end = p + size;
+		command = (unsigned char)*p++;
+	}
+	char fields[3][MaxCommandLine + 1];
+	for (int i = 0; i < 3 && ok; i++)
+	{
+		unsigned n;
+		p = getFrameVarint(p, end, &n);
+		ok = p != NULL && end - p >= (long)n && n <= MaxCommandLine &&
+			memchr(p, '\0', n) == NULL;
+		if (ok)
+		{
+			memcpy(fields[i], p, n);
+			fields[i][n] = '\0';
+			p += n;
+		}
+	}
+	ok = ok && frameFieldsValid(command, fields[0], fields[1], fields[2]);
+
+	// The handlers answer as they do in text, and the whole answer goes
+	// out after its length
+	std::string answer;
+	std::string * outer = replyCapture;
+	replyCapture = &answer;
+	bool kept = false;
+	if (!ok)
+	{
+		const char * msg = "ERROR (Bad frame)\r\n";
+		reply(fd, msg, strlen(msg));
+	}
+	else
+	{
+		printf("RECEIVED: frame\n");
+		printf("command=%s\n", command < CommandCount ? commandNames[command] : "?");
+		printf("user=%s\n", fields[0]);
+		printf("args=%s\n", fields[2]);
+
+		kept = serveRequest(fd, command < CommandCount ? command : -1,
+				    fields[0], fields[1], fields[2]);
+	}
+	replyCapture = outer;
+
+	char header[8];
+	char * h = putVarint(header, answer.size());
+	reply(fd, header, h - header);
+	reply(fd, answer.data(), answer.size());
+	return kept;
+}
+
+// Whether the fields of a binary request could have come in a text line,
+// which the history, the answers and the search keys count on: no space,
+// CR or LF in the user, the password or a room name, and no CR or LF in
+// the text of a message or anywhere else.
+bool
+IRCServer::frameFieldsValid(int command, const char * user, const char * password, const char * args)
+{
+	if (strpbrk(user, " \r\n") != NULL || strpbrk(password, " \r\n") != NULL ||
+	    strpbrk(args, "\r\n") != NULL)
+	{
+		return false;
+	}
+	switch (command)
+	{
+	case CreateRoomCommand:
+	case EnterRoomCommand:
+	case LeaveRoomCommand:
+		// args is the room
+		return strchr(args, ' ') == NULL;
+	case GetMessagesCommand: {
+		// args is "<LAST-MESSAGE-NUM> <ROOM>"
+		const char * space = strchr(args, ' ');
+		return space == NULL || strchr(space + 1, ' ') == NULL;
+	}
+	}
+	// The other rooms end at the first space
+	return true;
+}
+
+// Sends part of the answer to the current request. Handlers call this
+// instead of write() so that a backend can collect the answer and send it
+// itself.
+void
+IRCServer::reply(int fd, const void * data, int length)
+{
+	if (replyCapture != NULL) {
+		replyCapture->append((const char *)data, length);
+		return;
+	}
+	write(fd, data, length);
+}
+
+void
+IRCServer::initialize()
+{
+	resetState();
+
+	// Open password file
+	loadPasswordFile(PASSWORD_FILE);
+	indexUsers();
+}
+
+// Empties the server, without any user
+void
+IRCServer::resetState()
+{
+	// Nothing is published for the readers yet
+	directory = NULL;
+	roomTable = NULL;
+	snapshotEpoch = 1;
+	for (int i = 0; i < MaxSnapshotReaders; i++)
+	{
+		readerEpochs[i] = 0;
+	}
+	snapshotReaders = 0;
+	retiredSnapshots = NULL;
+	for (int i = 0; i < MaxRoomLevel; i++)
+	{
+		roomIndex.head[i] = NULL;
+	}
+	roomIndex.level = 1;
+	roomIndex.count = 0;
+	roomSeed = 2463534242u;
+	// No message and no user id yet
+	messCount = 0;
+	usersById = NULL;
+	userCount = 0;
+	userIdMax = 0;
+	historyFile = -1;
+	historyLength = 0;
+	// No connection is subscribed yet
+	subscriberList = NULL;
+	followerList = NULL;
+	pendingSubscribers = 0;
+	primary = NULL;
+	// Alone until the cluster is joined
+	clusterNodeCount = 0;
+	ring = NULL;
+	ringCount = 0;
+	peers = NULL;
+	applyingPeer = false;
+
+	replyCapture = NULL;
+	batching = false;
+	batchUser = NULL;
+
+	// Start the first CPU sample
+	cpuLoad = 0;
+	cpuSampleWall = now();
+	bucketSweepWall = cpuSampleWall;
+	cpuSampleUsed = cpuSeconds();
+}
+
+// Orders records by name, and records of the same name as they are in
+// the password file, which their names point into, since qsort is not
+// stable
+int
+IRCServer::comparePersonName(const void * a, const void * b)
+{
+	const char * x = ((const Person *)a)->username;
+	const char * y = ((const Person *)b)->username;
+	int order = strcmp(x, y);
+	if (order != 0)
+	{
+		return order;
+	}
+	return x < y ? -1 : x > y;
+}
+
+// Refills the bucket of key in table and takes one token from it.
+// Returns false if the bucket is empty.
+bool
+IRCServer::takeToken(HashTableVoid * table, const char * key, double rate, double burst, double t)
+{
+	void * data;
+	TokenBucket * b;
+	if (table->find(key, &data))
+	{
+		b = (TokenBucket*)data;
+		b->tokens += (t - b->stamp) * rate;
+		if (b->tokens > burst)
+		{
+			b->tokens = burst;
+		}
+	}
+	else
+	{
+		b = (TokenBucket*)malloc(sizeof(TokenBucket));
+		b->tokens = burst;
+		table->insertItem(key, b);
+	}
+	b->stamp = t;
+	if (b->tokens < 1)
+	{
+		return false;
+	}
+	b->tokens -= 1;
+	return true;
+}
+
+// Drops the buckets of table that have refilled to burst by t, which a
+// new bucket starts with anyway
+void
+IRCServer::sweepBuckets(HashTableVoid * table, double rate, double burst, double t)
+{
+	std::string full;
+	HashTableVoidIterator i(table);
+	const char * key;
+	void * data;
+	while (i.next(key, data))
+	{
+		TokenBucket * b = (TokenBucket*)data;
+		if (b->tokens + (t - b->stamp) * rate >= burst)
+		{
+			full.append(key, strlen(key) + 1);
+		}
+	}
+	for (size_t at = 0; at < full.size(); at = full.find('\0', at) + 1)
+	{
+		table->find(full.c_str() + at, &data);
+		table->removeElement(full.c_str() + at);
+		free(data);
+	}
+}
+
+// Charges a request to the bucket of its client address. Returns false if
+// it is exhausted.
+bool
+IRCServer::checkRateLimit(int fd)
+{
+	double t = now();
+	if (t - bucketSweepWall >= BucketSweepSeconds)
+	{
+		sweepBuckets(&addressBuckets, AddressRequestRate, AddressRequestBurst, t);
+		sweepBuckets(&userBuckets, UserRequestRate, UserRequestBurst, t);
+		bucketSweepWall = t;
+	}
+
+	char address[INET6_ADDRSTRLEN] = "";
+	struct sockaddr_storage peer;
+	socklen_t plen = sizeof(peer);
+	if (getpeername(fd, (struct sockaddr *)&peer, &plen) == 0)
+	{
+		if (peer.ss_family == AF_INET)
+		{
+			inet_ntop(AF_INET, &((struct sockaddr_in *)&peer)->sin_addr,
+				  address, sizeof(address));
+		}
+		else if (peer.ss_family == AF_INET6)
+		{
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&peer)->sin6_addr,
+				  address, sizeof(address));
+		}
+	}
+	return takeToken(&addressBuckets, address, AddressRequestRate, AddressRequestBurst, t);
+}
+
+// Charges a request to the bucket of user, whose password was checked, so
+// that made up names get no bucket. Returns false if it is exhausted.
+bool
+IRCServer::checkUserRate(const char * user)
+{
+	return takeToken(&userBuckets, user, UserRequestRate, UserRequestBurst, now());
+}
+
+// Runs a request once it is charged to its client address and, if its
+// password is right, to its user. Returns true if the handler kept the
+// connection open.
+bool
+IRCServer::serveRequest(int fd, int command, const char * user, const char * password, const char * args)
+{
+	const char * limited = "DENIED (Rate limit)\r\n";
+	if (!checkRateLimit(fd))
+	{
+		reply(fd, limited, strlen(limited));
+		return false;
+	}
+
+	// Reads the published snapshots answer take no lock
+	std::string answer;
+	if (answerFromSnapshot(command, user, password, args, &answer))
+	{
+		if (!checkUserRate(user))
+		{
+			reply(fd, limited, strlen(limited));
+			return false;
+		}
+		reply(fd, answer.data(), answer.size());
+		return false;
+	}
+
+	pthread_mutex_lock(&stateLock);
+	bool kept = false;
+	Person * e = findUser(user);
+	if (e != NULL && strcmp(e->password, password) == 0 && !checkUserRate(user))
+	{
+		reply(fd, limited, strlen(limited));
+	}
+	else
+	{
+		kept = runRequest(fd, command, user, password, args);
+	}
+	pthread_mutex_unlock(&stateLock);
+	return kept;
+}
+
+// Decides whether a new connection is served. Connections are shed while
+// the accept queue of the listening socket is nearly full or the process
+// has been using nearly all of a CPU.
+bool
+IRCServer::admitConnection()
+{
+	double t = now();
+	if (t - cpuSampleWall >= CpuSampleSeconds)
+	{
+		double used = cpuSeconds();
+		cpuLoad = (used - cpuSampleUsed) / (t - cpuSampleWall);
+		cpuSampleWall = t;
+		cpuSampleUsed = used;
+	}
+	if (cpuLoad > MaxCpuLoad)
+	{
+		return false;
+	}
+
+	// For a listening socket tcpi_unacked is the length of the accept
+	// queue and tcpi_sacked its limit
+	struct tcp_info info;
+	socklen_t ilen = sizeof(info);
+	if (getsockopt(masterSocket, IPPROTO_TCP, TCP_INFO, &info, &ilen) == 0 &&
+	    info.tcpi_sacked > 0 &&
+	    info.tcpi_unacked >= MaxBacklogFill * info.tcpi_sacked)
+	{
+		return false;
+	}
+	return true;
+}
+
+// Parses the "user:password" lines of one chunk of the mapped password
+// file in place and leaves them in c->people sorted by user name.
+void *
+IRCServer::parsePasswordChunk(void * arg)
+{
+	LoadChunk * c = (LoadChunk*)arg;
+
+	int lines = 1;
+	for (char * p = c->begin; p < c->end; p++)
+	{
+		if (*p == '\n')
+		{
+			lines++;
+		}
+	}
+	c->people = (Person*)malloc(lines*sizeof(Person));
+	c->count = 0;
+
+	char * line = c->begin;
+	while (line < c->end)
+	{
+		char * eol = (char*)memchr(line, '\n', c->end - line);
+		if (eol == NULL)
+		{
+			// Only the last chunk can end without a newline, and the
+			// loader has already taken care of that record.
+			break;
+		}
+		*eol = '\0';
+		if (eol > line && eol[-1] == '\r')
+		{
+			eol[-1] = '\0';
+		}
+		char * colon = strchr(line, ':');
+		if (colon != NULL && colon != line)
+		{
+			*colon = '\0';
+			Person * p = &c->people[c->count++];
+			p->username = line;
+			p->password = colon + 1;
+			p->args = NULL;
+			p->roomIn = NULL;
+			p->subs = NULL;
+		}
+		line = eol + 1;
+	}
+
+	qsort(c->people, c->count, sizeof(Person), comparePersonName);
+	return NULL;
+}
+
+// Loads every account of the password file at once. The file is mapped
+// privately and parsed in place by several threads, each one sorting its
+// own slice. The sorted slices are then merged into userIndex in a single
+// pass, so no record pays for a sorted insert.
+void
+IRCServer::loadPasswordFile(const char * path)
+{
+	struct timespec start, stop;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		close(fd);
+		return;
+	}
+	if (loadUserImage(PASSWORD_IMAGE, &st))
+	{
+		close(fd);
+		return;
+	}
+	long size = st.st_size;
+	char * data = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		perror("mmap");
+		return;
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+
+	// A last line without a newline cannot be terminated inside the
+	// mapping, so give it a buffer of its own.
+	char * end = data + size;
+	LoadChunk tail;
+	tail.count = 0;
+	if (end[-1] != '\n')
+	{
+		char * last = end;
+		while (last > data && last[-1] != '\n')
+		{
+			last--;
+		}
+		tail.begin = (char*)malloc(end - last + 2);
+		memcpy(tail.begin, last, end - last);
+		tail.begin[end - last] = '\n';
+		tail.end = tail.begin + (end - last) + 1;
+		parsePasswordChunk(&tail);
+		end = last;
+	}
+
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > MaxLoaderThreads)
+	{
+		nthreads = MaxLoaderThreads;
+	}
+	if (nthreads > (end - data) / MinLoaderChunk)
+	{
+		nthreads = (end - data) / MinLoaderChunk;
+	}
+	if (nthreads < 1)
+	{
+		nthreads = 1;
+	}
+
+	// Split the file at line boundaries
+	LoadChunk chunks[MaxLoaderThreads + 1];
+	pthread_t threads[MaxLoaderThreads];
+	char * p = data;
+	for (int i = 0; i < nthreads; i++)
+	{
+		chunks[i].begin = p;
+		if (i == nthreads - 1)
+		{
+			p = end;
+		}
+		else
+		{
+			p = data + (end - data) * (i + 1) / nthreads;
+			if (p < chunks[i].begin)
+			{
+				p = chunks[i].begin;
+			}
+			while (p < end && p[-1] != '\n')
+			{
+				p++;
+			}
+		}
+		chunks[i].end = p;
+	}
+	for (int i = 1; i < nthreads; i++)
+	{
+		pthread_create(&threads[i], NULL, parsePasswordChunk, &chunks[i]);
+	}
+	parsePasswordChunk(&chunks[0]);
+	for (int i = 1; i < nthreads; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	int nchunks = nthreads;
+	if (tail.count > 0)
+	{
+		chunks[nchunks++] = tail;
+	}
+
+	// Merge the sorted chunks into the user index. Duplicate names keep
+	// the record that appears first: it comes first in its chunk, and
+	// ties between chunks go to the earlier chunk.
+	int pos[MaxLoaderThreads + 1];
+	for (int i = 0; i < nchunks; i++)
+	{
+		pos[i] = 0;
+	}
+	Person * last = NULL;
+	int loaded = 0;
+	while (1)
+	{
+		int best = -1;
+		for (int i = 0; i < nchunks; i++)
+		{
+			if (pos[i] < chunks[i].count &&
+			    (best < 0 ||
+			     strcmp(chunks[i].people[pos[i]].username,
+				    chunks[best].people[pos[best]].username) < 0))
+			{
+				best = i;
+			}
+		}
+		if (best < 0)
+		{
+			break;
+		}
+		Person * e = &chunks[best].people[pos[best]++];
+		if (last != NULL && strcmp(last->username, e->username) == 0)
+		{
+			continue;
+		}
+		// In order, so each one goes at the end of the last leaf
+		userIndex.insertItem(e->username, e);
+		last = e;
+		registerUser(e);
+		loaded++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	double ms = (stop.tv_sec - start.tv_sec) * 1000.0 +
+		(stop.tv_nsec - start.tv_nsec) / 1000000.0;
+	printf("Loaded %d users from %s in %.3f ms (%d threads)\n",
+	       loaded, path, ms, nthreads);
+
+	saveUserImage(PASSWORD_IMAGE);
+}
+
+// Loads the users from the image at path, if it was saved after the
+// password file was last changed. Returns false if it was not.
+bool
+IRCServer::loadUserImage(const char * path, struct stat * passwords)
+{
+	struct timespec start, stop;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct stat st;
+	if (stat(path, &st) < 0 ||
+	    st.st_mtim.tv_sec < passwords->st_mtim.tv_sec ||
+	    (st.st_mtim.tv_sec == passwords->st_mtim.tv_sec &&
+	     st.st_mtim.tv_nsec <= passwords->st_mtim.tv_nsec))
+	{
+		return false;
+	}
+	if (!userImage.openMapped(path))
+	{
+		return false;
+	}
+
+	// The image lists the users in the order of their names, which is the
+	// order of the user index, so nothing is parsed or sorted
+	int count = 0;
+	const char * name;
+	void * password;
+	HashTableVoidIterator counter(&userImage);
+	while (counter.next(name, password))
+	{
+		count++;
+	}
+	Person * people = (Person*)malloc(count*sizeof(Person));
+	HashTableVoidIterator i(&userImage);
+	int loaded = 0;
+	while (i.next(name, password))
+	{
+		Person * e = &people[loaded++];
+		e->username = name;
+		e->password = (const char*)password;
+		e->args = NULL;
+		e->roomIn = NULL;
+		e->subs = NULL;
+		userIndex.insertItem(e->username, e);
+		registerUser(e);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	double ms = (stop.tv_sec - start.tv_sec) * 1000.0 +
+		(stop.tv_nsec - start.tv_nsec) / 1000000.0;
+	printf("Loaded %d users from %s in %.3f ms\n", loaded, path, ms);
+	return true;
+}
+
+// Saves the users there are now, by name, with their passwords as records
+void
+IRCServer::saveUserImage(const char * path)
+{
+	HashTableVoid passwords;
+	const char * name;
+	void * data;
+	BTreeVoidIterator i(&userIndex);
+	while (i.next(name, data))
+	{
+		passwords.insertItem(name, (void*)((Person*)data)->password);
+	}
+	if (!passwords.save(path))
+	{
+		perror(path);
+	}
+}
+
+bool
+IRCServer::checkPassword(int fd, const char * user, const char * password) {
+	// Every command of a batch is from the same user
+	if (batchUser != NULL)
+	{
+		return true;
+	}
+	// Here check the password
+	Person * e = findUser(user);
+	if (e == NULL || strcmp(e->password, password) != 0)
+	{
+		return false;
+	}
+	if (batching)
+	{
+		batchUser = e;
+	}
+	return true;
+}
+
+bool
+IRCServer::checkRoom(int fd, const char * user, const char * password, const char * args) 
+{
+	return findRoom(args) != NULL;
+}
+
+bool
+IRCServer::checkUserInRoom(int fd, const char * user, const char * password, const char * args)
+{
+	Room * r = findRoom(args);
+	if (r == NULL)
+	{
+		return false;
+	}
+	bool found;
+	findMember(r, user, &found);
+	return found;
+}
+
+IRCServer::Person *
+IRCServer::findUser(const char * user)
+{
+	void * data;
+	if (provisionedUsers.find(user, &data) || addedUsers.find(user, &data))
+	{
+		return (Person*)data;
+	}
+	return NULL;
+}
+
+// Puts the users there are now, nearly all of them for good, in the
+// perfect hash. Users added later go to addedUsers.
+void
+IRCServer::indexUsers()
+{
+	const char ** keys = (const char**)malloc(userCount*sizeof(const char*));
+	void ** values = (void**)malloc(userCount*sizeof(void*));
+	int n = 0;
+	const char * name;
+	void * data;
+	BTreeVoidIterator i(&userIndex);
+	while (i.next(name, data))
+	{
+		keys[n] = name;
+		values[n] = data;
+		n++;
+	}
+	if (!provisionedUsers.build(keys, values, n))
+	{
+		addedUsers.insertBatch(keys, values, n);
+	}
+	free(keys);
+	free(values);
+}
+
+IRCServer::Room *
+IRCServer::findRoom(const char * roomName)
+{
+	Room * r = lowerBoundRoom(roomName, NULL);
+	if (r != NULL && strcmp(r->roomName, roomName) == 0)
+	{
+		return r;
+	}
+	return NULL;
+}
+
+// Returns the first room whose name is not less than roomName. If update
+// is not NULL it receives, for every level, the last room before it
+// (NULL for the head of the index).
+IRCServer::Room *
+IRCServer::lowerBoundRoom(const char * roomName, Room ** update)
+{
+	Room * prev = NULL;
+	for (int l = roomIndex.level - 1; l >= 0; l--)
+	{
+		Room * r = prev != NULL ? prev->next[l] : roomIndex.head[l];
+		while (r != NULL && strcmp(r->roomName, roomName) < 0)
+		{
+			prev = r;
+			r = r->next[l];
+		}
+		if (update != NULL)
+		{
+			update[l] = prev;
+		}
+	}
+	return prev != NULL ? prev->next[0] : roomIndex.head[0];
+}
+
+// Adds a room to the index. Returns NULL if it already exists.
+IRCServer::Room *
+IRCServer::insertRoom(const char * roomName)
+{
+	Room * update[MaxRoomLevel];
+	Room * r = lowerBoundRoom(roomName, update);
+	if (r != NULL && strcmp(r->roomName, roomName) == 0)
+	{
+		return NULL;
+	}
+
+	// Each level holds a quarter of the rooms of the level below
+	int level = 1;
+	while (level < MaxRoomLevel)
+	{
+		roomSeed ^= roomSeed << 13;
+		roomSeed ^= roomSeed >> 17;
+		roomSeed ^= roomSeed << 5;
+		if ((roomSeed & 3) != 0)
+		{
+			break;
+		}
+		level++;
+	}
+	while (roomIndex.level < level)
+	{
+		update[roomIndex.level] = NULL;
+		roomIndex.level++;
+	}
+
+	// The name follows the links, in the same allocation
+	int nameLength = strlen(roomName) + 1;
+	Room * newRoom = (Room*)malloc(sizeof(Room) + (level - 1)*sizeof(Room*) + nameLength);
+	char * name = (char*)&newRoom->next[level];
+	memcpy(name, roomName, nameLength);
+	newRoom->roomName = name;
+	newRoom->messCount = 0;
+	newRoom->firstSegment = NULL;
+	newRoom->lastSegment = NULL;
+	newRoom->memorySegments = 0;
+	newRoom->extents = NULL;
+	newRoom->extentCount = 0;
+	newRoom->extentMax = 0;
+	newRoom->terms = NULL;
+	newRoom->members = NULL;
+	newRoom->memberCount = 0;
+	newRoom->memberMax = 0;
+	newRoom->snapshot = (RoomSnapshot*)malloc(sizeof(RoomSnapshot) + nameLength);
+	newRoom->snapshot->roster = NULL;
+	memcpy(newRoom->snapshot->roomName, roomName, nameLength);
+	newRoom->level = level;
+	for (int l = 0; l < level; l++)
+	{
+		Room ** link = update[l] != NULL ? &update[l]->next[l] : &roomIndex.head[l];
+		newRoom->next[l] = *link;
+		*link = newRoom;
+	}
+	roomIndex.count++;
+	retireSnapshot((void**)&roomTable, free);
+	return newRoom;
+}
+
+// Adds a room, and sends it to the followers. Returns NULL if it already
+// exists.
+IRCServer::Room *
+IRCServer::addRoom(const char * roomName)
+{
+	Room * r = insertRoom(roomName);
+	if (r != NULL)
+	{
+		replicate('R', roomName);
+	}
+	return r;
+}
+
+// Takes r out of the index and frees it with its members, history and
+// search terms, and sends the change to the followers. Its lines in the
+// history file stay where they are.
+void
+IRCServer::removeRoom(Room * r)
+{
+	replicate('D', r->roomName);
+	Room * update[MaxRoomLevel];
+	lowerBoundRoom(r->roomName, update);
+	for (int l = 0; l < r->level; l++)
+	{
+		Room ** link = update[l] != NULL ? &update[l]->next[l] : &roomIndex.head[l];
+		*link = r->next[l];
+	}
+	roomIndex.count--;
+	messCount -= r->messCount;
+
+	for (int i = 0; i < r->memberCount; i++)
+	{
+		RoomRef ** f = &r->members[i]->roomIn;
+		while ((*f)->room != r)
+		{
+			f = &(*f)->next;
+		}
+		RoomRef * old = *f;
+		*f = old->next;
+		free(old);
+	}
+	free(r->members);
+
+	while (r->firstSegment != NULL)
+	{
+		MessageSegment * g = r->firstSegment;
+		r->firstSegment = g->next;
+		free(g);
+	}
+	for (int i = 0; i < r->extentCount; i++)
+	{
+		free(r->extents[i].marks);
+	}
+	free(r->extents);
+
+	while (r->terms != NULL)
+	{
+		Postings * p = r->terms;
+		std::string key = r->roomName;
+		key += ' ';
+		key += p->term;
+		searchIndex.removeElement(key.c_str());
+		r->terms = p->next;
+		free(p->data);
+		free(p);
+	}
+	// Readers may still hold the snapshot of the room
+	retireSnapshot((void**)&roomTable, free);
+	retireSnapshot((void**)&r->snapshot->roster, freeRoster);
+	retireSnapshot((void**)&r->snapshot, free);
+	free(r);
+}
+
+// Binary search of user in the sorted members of room. Returns the index
+// of the member, or the index where it would be inserted.
+int
+IRCServer::findMember(Room * room, const char * user, bool * found)
+{
+	int lo = 0;
+	int hi = room->memberCount;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		int c = strcmp(room->members[mid]->username, user);
+		if (c == 0)
+		{
+			*found = true;
+			return mid;
+		}
+		if (c < 0)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	*found = false;
+	return lo;
+}
+
+// Gives e the next user id
+void
+IRCServer::registerUser(Person * e)
+{
+	if (userCount == userIdMax)
+	{
+		userIdMax = userIdMax == 0 ? 1024 : 2 * userIdMax;
+		usersById = (Person**)realloc(usersById, userIdMax*sizeof(Person*));
+	}
+	e->id = userCount;
+	usersById[userCount++] = e;
+}
+
+// Writes v in 7 bit groups, low first, with the high bit set on all but
+// the last. Returns the end of the encoding.
+static char *
+putVarint(char * p, unsigned v)
+{
+	while (v >= 0x80)
+	{
+		*p++ = (char)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (char)v;
+	return p;
+}
+
+static const char *
+getVarint(const char * p, unsigned * v)
+{
+	unsigned result = 0;
+	int shift = 0;
+	while (*p & 0x80)
+	{
+		result |= (unsigned)(*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	*v = result | ((unsigned)*p++ << shift);
+	return p;
+}
+
+// Adds an empty segment of at least capacity bytes to the history of
+// room
+IRCServer::MessageSegment *
+IRCServer::newMessageSegment(Room * room, int capacity)
+{
+	if (capacity < MessageSegmentSize)
+	{
+		capacity = MessageSegmentSize;
+	}
+	MessageSegment * g = (MessageSegment*)malloc(sizeof(MessageSegment) + capacity);
+	g->next = NULL;
+	g->firstMessNum = room->messCount;
+	g->length = 0;
+	g->capacity = capacity;
+	if (room->lastSegment == NULL)
+	{
+		room->firstSegment = g;
+	}
+	else
+	{
+		room->lastSegment->next = g;
+	}
+	room->lastSegment = g;
+	room->memorySegments++;
+	return g;
+}
+
+// Packs a message at the end of the history of room
+void
+IRCServer::appendMessage(Room * room, int messNum, Person * from, const char * text, int length)
+{
+	// Three varints take at most 15 bytes
+	int most = 15 + length;
+	MessageSegment * g = room->lastSegment;
+	if (g == NULL || g->capacity - g->length < most)
+	{
+		g = newMessageSegment(room, most);
+		if (room->memorySegments > HistoryMemorySegments)
+		{
+			spillSegment(room);
+		}
+	}
+	char * p = g->data + g->length;
+	p = putVarint(p, messNum);
+	p = putVarint(p, from->id);
+	p = putVarint(p, length);
+	memcpy(p, text, length);
+	g->length = p + length - g->data;
+}
+
+// Unpacks the record at p. The text is not NUL terminated. Returns the
+// start of the next record.
+const char *
+IRCServer::decodeMessage(const char * p, int * messNum, int * from, const char ** text, int * length)
+{
+	unsigned v;
+	p = getVarint(p, &v);
+	*messNum = v;
+	p = getVarint(p, &v);
+	*from = v;
+	p = getVarint(p, &v);
+	*length = v;
+	*text = p;
+	return p + v;
+}
+
+// Appends the GET-MESSAGES line of a message to out
+void
+IRCServer::appendMessageLine(std::string * out, int messNum, int from, const char * text, int length)
+{
+	char number[16];
+	snprintf(number, sizeof(number), "%d ", messNum);
+	*out += number;
+	*out += usersById[from]->username;
+	*out += ' ';
+	out->append(text, length);
+	*out += "\r\n";
+}
+
+// Copies the next term of p into term, lower case, and moves p past it.
+// Terms are runs of letters, digits and bytes of UTF-8 sequences; longer
+// ones are cut at max bytes. Returns 0 at the end of the text.
+static int
+nextTerm(const char ** p, const char * end, char * term, int max)
+{
+	const char * s = *p;
+	while (s < end && !isalnum((unsigned char)*s) && !((unsigned char)*s & 0x80))
+	{
+		s++;
+	}
+	int length = 0;
+	while (s < end && (isalnum((unsigned char)*s) || ((unsigned char)*s & 0x80)))
+	{
+		if (length < max)
+		{
+			term[length++] = tolower((unsigned char)*s);
+		}
+		s++;
+	}
+	term[length] = '\0';
+	*p = s;
+	return length;
+}
+
+// Returns the postings of term in room, or NULL if it is not there and
+// create is false
+IRCServer::Postings *
+IRCServer::findPostings(Room * room, const char * term, bool create)
+{
+	// Room names have no spaces, so "<ROOM> <TERM>" is unique
+	std::string key = room->roomName;
+	key += ' ';
+	key += term;
+	void * data;
+	if (searchIndex.find(key.c_str(), &data))
+	{
+		return (Postings*)data;
+	}
+	if (!create)
+	{
+		return NULL;
+	}
+	int termLength = strlen(term);
+	Postings * p = (Postings*)malloc(sizeof(Postings) + termLength);
+	memcpy(p->term, term, termLength + 1);
+	p->count = 0;
+	p->last = 0;
+	p->length = 0;
+	p->capacity = 0;
+	p->data = NULL;
+	p->next = room->terms;
+	room->terms = p;
+	searchIndex.insertItem(key.c_str(), p);
+	return p;
+}
+
+// Places in keys the searchIndex keys of the terms of text, kept in
+// buffer. Returns how many there are, at most max.
+int
+IRCServer::termKeys(Room * room, const char * text, int length, std::string * buffer, const char ** keys, int max)
+{
+	const char * p = text;
+	const char * end = text + length;
+	char term[MaxTermLength + 1];
+	int offsets[max];
+	int count = 0;
+	buffer->clear();
+	while (count < max && nextTerm(&p, end, term, MaxTermLength) > 0)
+	{
+		offsets[count++] = buffer->size();
+		*buffer += room->roomName;
+		*buffer += ' ';
+		*buffer += term;
+		*buffer += '\0';
+	}
+	// The buffer does not move any more
+	for (int i = 0; i < count; i++)
+	{
+		keys[i] = buffer->data() + offsets[i];
+	}
+	return count;
+}
+
+void
+IRCServer::addPosting(Postings * p, int messNum)
+{
+	if (p->count > 0 && p->last == messNum)
+	{
+		// Term repeated in the same message
+		return;
+	}
+	if (p->capacity - p->length < 5)
+	{
+		p->capacity = p->capacity == 0 ? 16 : 2 * p->capacity;
+		p->data = (unsigned char*)realloc(p->data, p->capacity);
+	}
+	char * end = putVarint((char*)p->data + p->length, messNum - p->last);
+	p->length = end - (char*)p->data;
+	p->last = messNum;
+	p->count++;
+}
+
+// Adds every term of a new message to the search index
+void
+IRCServer::indexMessage(Room * room, int messNum, const char * text, int length)
+{
+	// Most terms are already in the index, and are looked up together
+	std::string buffer;
+	const char * keys[MaxCommandLine / 2];
+	void * found[MaxCommandLine / 2];
+	int count = termKeys(room, text, length, &buffer, keys, MaxCommandLine / 2);
+	searchIndex.findBatch(keys, count, found);
+	int termStart = strlen(room->roomName) + 1;
+	for (int i = 0; i < count; i++)
+	{
+		// A new term may come twice, so it is looked for again
+		Postings * p = (Postings*)found[i];
+		if (p == NULL)
+		{
+			p = findPostings(room, keys[i] + termStart, true);
+		}
+		addPosting(p, messNum);
+	}
+}
+
+// Expands the postings of p into p->count message numbers
+void
+IRCServer::decodePostings(Postings * p, unsigned * out)
+{
+	const char * d = (const char*)p->data;
+	unsigned last = 0;
+	for (int i = 0; i < p->count; i++)
+	{
+		unsigned gap;
+		d = getVarint(d, &gap);
+		last += gap;
+		out[i] = last;
+	}
+}
+
+// Writes the numbers in both increasing lists a and b to out, which may
+// be a. Returns how many there are. Blocks of four of each list are
+// compared all against all at once, and the block with the smaller last
+// number is then replaced.
+int
+IRCServer::intersectPostings(const unsigned * a, int na, const unsigned * b, int nb, unsigned * out)
+{
+	int i = 0;
+	int j = 0;
+	int n = 0;
+#ifdef __SSE2__
+	while (i + 4 <= na && j + 4 <= nb)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + j));
+		__m128i m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi32(va, vb),
+				     _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+			_mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+				     _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(m));
+		unsigned lastA = a[i + 3];
+		unsigned lastB = b[j + 3];
+		for (int k = 0; k < 4; k++)
+		{
+			if (mask & (1 << k))
+			{
+				out[n++] = a[i + k];
+			}
+		}
+		if (lastA <= lastB)
+		{
+			i += 4;
+		}
+		if (lastB <= lastA)
+		{
+			j += 4;
+		}
+	}
+#endif
+	while (i < na && j < nb)
+	{
+		if (a[i] < b[j])
+		{
+			i++;
+		}
+		else if (b[j] < a[i])
+		{
+			j++;
+		}
+		else
+		{
+			out[n++] = a[i];
+			i++;
+			j++;
+		}
+	}
+	return n;
+}
+
+// Creates the history file. It has no name, so it goes away with the
+// last server holding it.
+bool
+IRCServer::openHistoryFile()
+{
+	historyFile = open(HISTORY_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (historyFile < 0 && errno == ENOENT)
+	{
+		mkdir(HISTORY_DIR, 0700);
+		historyFile = open(HISTORY_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	}
+	if (historyFile < 0)
+	{
+		perror("history file");
+		return false;
+	}
+	historyLength = 0;
+	return true;
+}
+
+IRCServer::HistoryExtent *
+IRCServer::addExtent(Room * room)
+{
+	if (room->extentCount == room->extentMax)
+	{
+		room->extentMax = room->extentMax == 0 ? 8 : 2 * room->extentMax;
+		room->extents = (HistoryExtent*)realloc(room->extents,
+							room->extentMax*sizeof(HistoryExtent));
+	}
+	return &room->extents[room->extentCount++];
+}
+
+// Moves the oldest segment of room in memory to the end of the history
+// file. The file is only ever appended to.
+void
+IRCServer::spillSegment(Room * room)
+{
+	if (historyFile < 0 && !openHistoryFile())
+	{
+		// Keep everything in memory
+		return;
+	}
+	MessageSegment * g = room->firstSegment;
+
+	std::string lines;
+	unsigned * marks = (unsigned*)malloc((g->length / HistoryMarkInterval + 1)*sizeof(unsigned));
+	int count = 0;
+	const char * p = g->data;
+	const char * end = g->data + g->length;
+	while (p < end)
+	{
+		int messNum;
+		int from;
+		const char * text;
+		int length;
+		p = decodeMessage(p, &messNum, &from, &text, &length);
+		if (count % HistoryMarkInterval == 0)
+		{
+			marks[count / HistoryMarkInterval] = lines.size();
+		}
+		appendMessageLine(&lines, messNum, from, text, length);
+		count++;
+	}
+
+	const char * data = lines.data();
+	long long left = lines.size();
+	long long offset = historyLength;
+	while (left > 0)
+	{
+		ssize_t n = pwrite(historyFile, data, left, offset);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			// Disk full, keep the segment in memory
+			perror("history file");
+			free(marks);
+			return;
+		}
+		data += n;
+		left -= n;
+		offset += n;
+	}
+
+	HistoryExtent * e = addExtent(room);
+	e->firstMessNum = g->firstMessNum;
+	e->count = count;
+	e->offset = historyLength;
+	e->length = lines.size();
+	e->marks = marks;
+	historyLength += lines.size();
+
+	room->firstSegment = g->next;
+	room->memorySegments--;
+	free(g);
+}
+
+// Sends the lines of the messages of room from first on that are in the
+// history file
+void
+IRCServer::replyHistory(int fd, Room * room, int first)
+{
+	// Last extent starting at or before first
+	int lo = 0;
+	int hi = room->extentCount;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (room->extents[mid].firstMessNum <= first)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	int i = lo > 0 ? lo - 1 : 0;
+
+	for (; i < room->extentCount; i++)
+	{
+		HistoryExtent * e = &room->extents[i];
+		long long start = e->offset;
+		int skip = first - e->firstMessNum;
+		if (skip >= e->count)
+		{
+			continue;
+		}
+		if (skip > 0)
+		{
+			std::string chunk;
+			size_t at;
+			if (!readHistoryChunk(e, first, &chunk, &start, &at))
+			{
+				return;
+			}
+			start += at;
+		}
+		replyFile(fd, historyFile, start, e->offset + e->length - start);
+	}
+}
+
+// Reads the lines of extent e from the mark at or before messNum up to
+// the next mark. Sets start to the offset of the chunk in the history
+// file, and at to the line of messNum in the chunk.
+bool
+IRCServer::readHistoryChunk(HistoryExtent * e, int messNum, std::string * chunk, long long * start, size_t * at)
+{
+	int skip = messNum - e->firstMessNum;
+	int mark = skip / HistoryMarkInterval;
+	int marks = (e->count + HistoryMarkInterval - 1) / HistoryMarkInterval;
+	*start = e->offset + e->marks[mark];
+	long long stop = mark + 1 < marks ? e->offset + e->marks[mark + 1] : e->offset + e->length;
+	chunk->resize(stop - *start);
+	if (pread(historyFile, &(*chunk)[0], chunk->size(), *start) != (ssize_t)chunk->size())
+	{
+		return false;
+	}
+	// Every line ends with the only "\r\n" it holds
+	*at = 0;
+	for (int lines = skip % HistoryMarkInterval; lines > 0; lines--)
+	{
+		*at = chunk->find("\r\n", *at) + 2;
+	}
+	return true;
+}
+
+// Appends the GET-MESSAGES lines of count messages of room, given by
+// increasing number
+void
+IRCServer::appendMessageLines(Room * room, const unsigned * nums, int count, std::string * out)
+{
+	MessageSegment * g = room->firstSegment;
+	int memoryStart = g != NULL ? g->firstMessNum : room->messCount;
+
+	// Older ones are read from the history file
+	int i = 0;
+	int e = 0;
+	for (; i < count && (int)nums[i] < memoryStart; i++)
+	{
+		while (e < room->extentCount &&
+		       (int)nums[i] >= room->extents[e].firstMessNum + room->extents[e].count)
+		{
+			e++;
+		}
+		std::string chunk;
+		long long start;
+		size_t at;
+		if (e == room->extentCount ||
+		    !readHistoryChunk(&room->extents[e], nums[i], &chunk, &start, &at))
+		{
+			continue;
+		}
+		out->append(chunk, at, chunk.find("\r\n", at) + 2 - at);
+	}
+
+	// The others in one pass over the segments in memory
+	const char * p = NULL;
+	for (; i < count && g != NULL; i++)
+	{
+		while (g->next != NULL && g->next->firstMessNum <= (int)nums[i])
+		{
+			g = g->next;
+			p = NULL;
+		}
+		if (p == NULL)
+		{
+			p = g->data;
+		}
+		const char * end = g->data + g->length;
+		while (p < end)
+		{
+			int messNum;
+			int from;
+			const char * text;
+			int length;
+			p = decodeMessage(p, &messNum, &from, &text, &length);
+			if (messNum == (int)nums[i])
+			{
+				appendMessageLine(out, messNum, from, text, length);
+				break;
+			}
+		}
+	}
+}
+
+// Sends length bytes of file from offset as part of the answer, from the
+// page cache straight to the socket. A backend collecting the answer gets
+// a copy instead.
+void
+IRCServer::replyFile(int fd, int file, long long offset, long long length)
+{
+	if (replyCapture != NULL) {
+		size_t old = replyCapture->size();
+		replyCapture->resize(old + length);
+		ssize_t n = pread(file, &(*replyCapture)[old], length, offset);
+		replyCapture->resize(old + (n > 0 ? n : 0));
+		return;
+	}
+	off_t o = offset;
+	while (length > 0) {
+		ssize_t n = sendfile(fd, file, &o, length);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return;
+		}
+		length -= n;
+	}
+}
+
+// Adds a user, and sends it to the followers. The name and password are
+// kept in the same allocation as the user. Returns NULL, and adds nothing,
+// if the name is taken.
+IRCServer::Person *
+IRCServer::addPerson(const char * user, const char * password)
+{
+	if (findUser(user) != NULL)
+	{
+		return NULL;
+	}
+
+	int userLength = strlen(user) + 1;
+	int passwordLength = strlen(password) + 1;
+	Person * newUser = (Person*)malloc(sizeof(Person) + userLength + passwordLength);
+	char * names = (char*)(newUser + 1);
+	memcpy(names, user, userLength);
+	memcpy(names + userLength, password, passwordLength);
+	newUser->username = names;
+	newUser->password = names + userLength;
+	newUser->args = NULL;
+	registerUser(newUser);
+	newUser->roomIn = NULL;
+	newUser->subs = NULL;
+	addedUsers.insertItem(user, newUser);
+	userIndex.insertItem(newUser->username, newUser);
+	retireSnapshot((void**)&directory, freeDirectory);
+	replicate('U', user, password);
+	return newUser;
+}
+
+void
+IRCServer::addUser(int fd, const char * user, const char * password, const char * args)
+{
+	// A name added again keeps its first user, so only its password
+	// gets OK
+	Person * e = findUser(user);
+	if (e != NULL && strcmp(e->password, password) != 0)
+	{
+		const char * msg = "DENIED (User exists)\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+	if (e == NULL)
+	{
+		addPerson(user, password);
+	}
+
+	const char * msg = "OK\r\n";
+	reply(fd, msg, strlen(msg));
+	return;
+}
+
+void
+IRCServer::enterRoom(int fd, const char * user, const char * password, const char * args)
+{
+        Person * e;
+        if (userIndex.count() == 0)
+        {
+                const char * msg = "DENIED (NO USERS).\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+        if (!checkPassword(fd, user, password))
+        {
+                const char * msg = "ERROR (Wrong password)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+
+	Room * r = findRoom(args);
+	if (r == NULL)
+	{
+		const char * msg = "ERROR (No room)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+	}
+
+	e = findUser(user);
+	addMember(r, e);
+	const char * msg = "OK\r\n";
+	reply(fd, msg, strlen(msg));
+}
+
+// Adds e to the members of r, unless it is one already, and sends the
+// change to the followers
+void
+IRCServer::addMember(Room * r, Person * e)
+{
+	if (insertMember(r, e))
+	{
+		replicate('E', r->roomName, e->username);
+	}
+}
+
+// Adds e to the members of r. Returns false if it is one already.
+bool
+IRCServer::insertMember(Room * r, Person * e)
+{
+	bool found;
+	int i = findMember(r, e->username, &found);
+	if (found)
+	{
+		return false;
+	}
+	if (r->memberCount == r->memberMax)
+	{
+		r->memberMax = r->memberMax == 0 ? 8 : 2 * r->memberMax;
+		r->members = (Person**)realloc(r->members, r->memberMax*sizeof(Person*));
+	}
+	memmove(&r->members[i + 1], &r->members[i],
+		(r->memberCount - i)*sizeof(Person*));
+	r->members[i] = e;
+	r->memberCount++;
+	retireSnapshot((void**)&r->snapshot->roster, freeRoster);
+
+	// Only messages sent from now on are new to the user
+	RoomRef * f = (RoomRef*)malloc(sizeof(RoomRef));
+	f->room = r;
+	f->readCursor = r->messCount;
+	f->next = e->roomIn;
+	e->roomIn = f;
+	return true;
+}
+
+void
+IRCServer::leaveRoom(int fd, const char * user, const char * password, const char * args)
+{
+        if (userIndex.count() == 0)
+        {
+                const char * msg = "DENIED (NO USERS).\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+        if (!checkPassword(fd, user, password))
+        {
+                const char * msg = "ERROR (Wrong password)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+	Room * r = findRoom(args);
+	if (r == NULL)
+	{
+		const char * msg = "Error (Room DNE)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+	}
+	bool found;
+	int i = findMember(r, user, &found);
+	if (!found)
+	{
+		const char * msg = "ERROR (No user in room)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+	}
+	removeMember(r, i);
+	const char * msg = "OK\r\n";
+	reply(fd, msg, strlen(msg));
+}
+
+// Removes member i of r, and sends the change to the followers
+void
+IRCServer::removeMember(Room * r, int i)
+{
+	Person * e = r->members[i];
+	replicate('L', r->roomName, e->username);
+	r->memberCount--;
+	retireSnapshot((void**)&r->snapshot->roster, freeRoster);
+	memmove(&r->members[i], &r->members[i + 1],
+		(r->memberCount - i)*sizeof(Person*));
+
+	RoomRef ** f = &e->roomIn;
+	while (*f != NULL)
+	{
+		if ((*f)->room == r)
+		{
+			RoomRef * old = *f;
+			*f = old->next;
+			free(old);
+			break;
+		}
+		f = &(*f)->next;
+	}
+}
+
+void
+IRCServer::sendMessage(int fd, const char * user, const char * password, const char * args)
+{
+        if (userIndex.count() == 0)
+        {
+                const char * msg = "DENIED (NO USERS).\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+        if (!checkPassword(fd, user, password))
+        {
+                const char * msg = "ERROR (Wrong password)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+
+	// args is "<ROOM> <MESSAGE>"
+	const char * space = strchr(args, ' ');
+	int roomLength = space != NULL ? space - args : strlen(args);
+	char roomName[roomLength + 1];
+	memcpy(roomName, args, roomLength);
+	roomName[roomLength] = '\0';
+	const char * text = space != NULL ? space + 1 : "";
+
+	if (roomIndex.count == 0)
+	{
+		const char * msg = "ERROR (NO ROOMS)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+	}
+	Room * r = findRoom(roomName);
+	bool found = false;
+	int i = 0;
+	if (r != NULL)
+	{
+		i = findMember(r, user, &found);
+	}
+	if (!found)
+	{
+		const char * msg = "ERROR (user not in room)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+	}
+
+	postMessage(r, r->members[i], text);
+
+	const char * msg = "OK\r\n";
+	reply(fd, msg, strlen(msg));
+}
+
+// Adds a message of from to the history of r, sends it to the followers
+// and to the subscribers of the members of r
+void
+IRCServer::postMessage(Room * r, Person * from, const char * text)
+{
+	int messNum = storeMessage(r, from, text);
+	replicate('M', r->roomName, from->username, text);
+
+	// Format the line once and hand it to every subscribed member
+	int length = snprintf(NULL, 0, "%d %s %s\r\n", messNum, from->username, text);
+	Payload * line = newPayload(length);
+	snprintf(line->data, length + 1, "%d %s %s\r\n", messNum, from->username, text);
+	broadcast(r, line);
+	releasePayload(line);
+}
+
+// Adds a message of from to the history of r and to its search terms.
+// Returns its number.
+int
+IRCServer::storeMessage(Room * r, Person * from, const char * text)
+{
+	int messNum = r->messCount;
+	appendMessage(r, messNum, from, text, strlen(text));
+	indexMessage(r, messNum, text, strlen(text));
+	r->messCount ++;
+	messCount ++;
+	return messNum;
+}
+
+void
+IRCServer::getMessages(int fd, const char * user, const char * password, const char * args)
+{
+        if (userIndex.count() == 0)
+        {
+                const char * msg = "ERROR (No users)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+        if (!checkPassword(fd, user, password))
+        {
+                const char * msg = "ERROR (Wrong password)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+
+	int tempMessCount = atoi(args);
+	const char * space = strchr(args, ' ');
+	const char * roomName = space != NULL ? space + 1 : "";
+
+	if (!checkUserInRoom(fd, user, password, roomName))
+        {
+                const char * msg = "ERROR (User not in room)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+
+	Room * r = findRoom(roomName);
+	int lastMessNum = r->messCount > 0 ? r->messCount - 1 : 0;
+	if (messCount == 0 || lastMessNum < tempMessCount)
+	{
+		const char * msg = "NO-NEW-MESSAGES\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+	}
+
+	replyMessages(fd, r, tempMessCount);
+	const char * end = "\r\n";
+	reply(fd, end, strlen(end));
+
+	// Everything up to the last message has been read now
+	bool found;
+	Person * e = r->members[findMember(r, user, &found)];
+	RoomRef * f = findRoomRef(e, r);
+	if (f->readCursor < r->messCount)
+	{
+		f->readCursor = r->messCount;
+	}
+}
+
+// Sends the GET-MESSAGES lines of the messages of room from first on
+void
+IRCServer::replyMessages(int fd, Room * r, int first)
+{
+	// Older messages come from the history file
+	MessageSegment * g = r->firstSegment;
+	if (r->extentCount > 0 && (g == NULL || first < g->firstMessNum))
+	{
+		replyHistory(fd, r, first);
+	}
+
+	// Skip the segments that end before the first message asked for,
+	// then scan the records in order and build the rest of the answer
+	while (g != NULL && g->next != NULL && g->next->firstMessNum <= first)
+	{
+		g = g->next;
+	}
+	std::string out;
+	for (; g != NULL; g = g->next)
+	{
+		const char * p = g->data;
+		const char * end = g->data + g->length;
+		while (p < end)
+		{
+			int messNum;
+			int from;
+			const char * text;
+			int length;
+			p = decodeMessage(p, &messNum, &from, &text, &length);
+			if (messNum >= first)
+			{
+				appendMessageLine(&out, messNum, from, text, length);
+			}
+		}
+	}
+	reply(fd, out.data(), out.size());
+}
+
+IRCServer::RoomRef *
+IRCServer::findRoomRef(Person * e, Room * room)
+{
+	RoomRef * f = e->roomIn;
+	while (f != NULL && f->room != room)
+	{
+		f = f->next;
+	}
+	return f;
+}
+
+void
+IRCServer::sync(int fd, const char * user, const char * password, const char * args)
+{
+        if (userIndex.count() == 0)
+        {
+                const char * msg = "ERROR (No users)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+        if (!checkPassword(fd, user, password))
+        {
+                const char * msg = "ERROR (Wrong password)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+
+	// A room has nothing new when its cursor has reached its count
+	Person * e = findUser(user);
+	bool any = false;
+	for (RoomRef * f = e->roomIn; f != NULL; f = f->next)
+	{
+		Room * r = f->room;
+		if (f->readCursor >= r->messCount)
+		{
+			continue;
+		}
+		std::string header = r->roomName;
+		header += "\r\n";
+		reply(fd, header.data(), header.size());
+		replyMessages(fd, r, f->readCursor);
+		const char * end = "\r\n";
+		reply(fd, end, strlen(end));
+		f->readCursor = r->messCount;
+		any = true;
+	}
+	if (!any)
+	{
+		const char * msg = "NO-NEW-MESSAGES\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+	const char * end = "\r\n";
+	reply(fd, end, strlen(end));
+}
 
 void
-IRCServer::addUser(int fd, const char * user, const char * password, const char * args)
+IRCServer::searchMessages(int fd, const char * user, const char * password, const char * args)
 {
-	// ere add a new user. For now always return OK.
-	Person * newUser = (Person*)malloc(sizeof(Person));
-	newUser->password = password;
-	newUser->username = user;
-	newUser->args = args;
-	newUser->roomIn = NULL;
-	newUser->next = NULL;
+        if (userIndex.count() == 0)
+        {
+                const char * msg = "ERROR (No users)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+        if (!checkPassword(fd, user, password))
+        {
+                const char * msg = "ERROR (Wrong password)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+
+	// args is "<ROOM> <TERMS>"
+	const char * space = strchr(args, ' ');
+	int roomLength = space != NULL ? space - args : strlen(args);
+	char roomName[roomLength + 1];
+	memcpy(roomName, args, roomLength);
+	roomName[roomLength] = '\0';
+	const char * terms = space != NULL ? space + 1 : "";
+
+	if (!checkUserInRoom(fd, user, password, roomName))
+        {
+                const char * msg = "ERROR (User not in room)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+	Room * r = findRoom(roomName);
+
+	// Postings of every term, shortest first
+	std::string buffer;
+	const char * keys[MaxCommandLine / 2];
+	void * found[MaxCommandLine / 2];
+	int termCount = termKeys(r, terms, strlen(terms), &buffer, keys, MaxCommandLine / 2);
+	bool missing = searchIndex.findBatch(keys, termCount, found) < termCount;
+	std::string out;
+	Postings * lists[MaxCommandLine / 2];
+	int listCount = 0;
+	for (int i = 0; i < termCount && !missing; i++)
+	{
+		Postings * q = (Postings*)found[i];
+		int k = listCount++;
+		while (k > 0 && lists[k - 1]->count > q->count)
+		{
+			lists[k] = lists[k - 1];
+			k--;
+		}
+		lists[k] = q;
+	}
+	if (listCount == 0 && !missing)
+	{
+		const char * msg = "ERROR (No terms)\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+
+	if (!missing)
+	{
+		unsigned * matches = (unsigned*)malloc(lists[0]->count*sizeof(unsigned));
+		unsigned * other = (unsigned*)malloc(lists[0]->count*sizeof(unsigned));
+		decodePostings(lists[0], matches);
+		int count = lists[0]->count;
+		for (int i = 1; i < listCount && count > 0; i++)
+		{
+			if (lists[i] == lists[i - 1])
+			{
+				// Same term twice
+				continue;
+			}
+			other = (unsigned*)realloc(other, lists[i]->count*sizeof(unsigned));
+			decodePostings(lists[i], other);
+			count = intersectPostings(matches, count, other, lists[i]->count, matches);
+		}
+		int first = count > MaxSearchResults ? count - MaxSearchResults : 0;
+		appendMessageLines(r, matches + first, count - first, &out);
+		free(matches);
+		free(other);
+	}
+	out += "\r\n";
+	reply(fd, out.data(), out.size());
+}
+
+void
+IRCServer::getUsersInRoom(int fd, const char * user, const char * password, const char * args)
+{
+        if (userIndex.count() == 0)
+        {
+                const char * msg = "DENIED (NO USERS).\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+        if (!checkPassword(fd, user, password))
+        {
+                const char * msg = "ERROR (Wrong password)\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+
+	// args is "<ROOM> [<CURSOR> [<LIMIT>]]"
+	const char * space = strchr(args, ' ');
+	int roomLength = space != NULL ? space - args : strlen(args);
+	char roomName[roomLength + 1];
+	memcpy(roomName, args, roomLength);
+	roomName[roomLength] = '\0';
+
+	// So that the next reads of the room take no lock
+	publishRoomTable();
+
+	Room * r = findRoom(roomName);
+	if (r == NULL)
+	{
+		char * msg1 = (char*)"\r\n";
+		reply(fd, msg1, strlen(msg1));
+		return;
+	}
+	sendRoster(fd, roomRoster(r), space != NULL ? space + 1 : "");
+}
+
+void
+IRCServer::getAllUsers(int fd, const char * user, const char * password,const  char * args)
+{
+	if (userIndex.count() == 0)
+	{
+		const char * msg = "DENIED (NO USERS).\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+	if (!checkPassword(fd, user, password))
+	{
+		const char * msg = "ERROR (Wrong password)\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+	if (directory == NULL)
+	{
+		char cursor[1024] = "-";
+		int limit = -1;
+		sscanf(args, "%1023s %d", cursor, &limit);
+		if (limit >= 0)
+		{
+			// A page after users were added comes from the index,
+			// without serializing every name again
+			const char * from = strcmp(cursor, "-") == 0 ? "" : cursor;
+			BTreeVoidIterator i(&userIndex, from);
+			const char * name;
+			void * data;
+			std::string out;
+			int count = 0;
+			while (count < limit && i.next(name, data))
+			{
+				if (strcmp(name, from) == 0)
+				{
+					continue;
+				}
+				out += name;
+				out += "\r\n";
+				count++;
+			}
+			out += "\r\n";
+			reply(fd, out.data(), out.size());
+			return;
+		}
+	}
+	sendRoster(fd, &publishDirectory()->names, args);
+	return;
+}
+
+void
+IRCServer::initRoster(Roster * r)
+{
+	r->data = NULL;
+	r->length = 0;
+	r->max = 0;
+	r->lines = NULL;
+	r->lineMax = 0;
+	r->count = 0;
+}
+
+// Adds the line of name at the end of r. The caller sets count to 0
+// before adding the first name.
+void
+IRCServer::appendRoster(Roster * r, const char * name)
+{
+	if (r->count == 0)
+	{
+		r->length = 0;
+	}
+	int n = strlen(name);
+	if (r->length + n + 4 > r->max)
+	{
+		r->max = 2 * (r->length + n + 4);
+		r->data = (char*)realloc(r->data, r->max);
+	}
+	if (r->count + 2 > r->lineMax)
+	{
+		r->lineMax = 2*(r->count + 2);
+		r->lines = (int*)realloc(r->lines, r->lineMax*sizeof(int));
+	}
+	r->lines[r->count] = r->length;
+	memcpy(r->data + r->length, name, n);
+	memcpy(r->data + r->length + n, "\r\n", 2);
+	r->length += n + 2;
+	r->count++;
+}
+
+void
+IRCServer::finishRoster(Roster * r)
+{
+	if (r->count == 0)
+	{
+		r->length = 0;
+		if (r->max < 2)
+		{
+			r->max = 2;
+			r->data = (char*)realloc(r->data, r->max);
+		}
+		if (r->lineMax < 1)
+		{
+			r->lineMax = 1;
+			r->lines = (int*)realloc(r->lines, sizeof(int));
+		}
+	}
+	r->lines[r->count] = r->length;
+	memcpy(r->data + r->length, "\r\n", 2);
+}
+
+// Returns the first line of r whose name is not less than name
+int
+IRCServer::lowerBoundRoster(Roster * r, const char * name)
+{
+	int n = strlen(name);
+	int lo = 0;
+	int hi = r->count;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		const char * line = r->data + r->lines[mid];
+		int lineLength = r->lines[mid + 1] - r->lines[mid] - 2;
+		int c = memcmp(line, name, lineLength < n ? lineLength : n);
+		if (c < 0 || (c == 0 && lineLength < n))
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Picks the lines of r selected by "[<CURSOR> [<LIMIT>]]": the names
+// after CURSOR ("-" for the first page), at most LIMIT of them, from first
+// up to, but not including, last.
+void
+IRCServer::pageRoster(Roster * r, const char * args, int * first, int * last)
+{
+	char cursor[1024] = "-";
+	int limit = -1;
+	sscanf(args, "%1023s %d", cursor, &limit);
+
+	int i = 0;
+	if (strcmp(cursor, "-") != 0)
+	{
+		i = lowerBoundRoster(r, cursor);
+		int n = strlen(cursor);
+		if (i < r->count &&
+		    r->lines[i + 1] - r->lines[i] - 2 == n &&
+		    memcmp(r->data + r->lines[i], cursor, n) == 0)
+		{
+			i++;
+		}
+	}
+	*first = i;
+	*last = r->count;
+	if (limit >= 0 && i + limit < *last)
+	{
+		*last = i + limit;
+	}
+}
+
+// Sends the page of r selected by args, as for pageRoster, as one slice
+// of the cached buffer
+void
+IRCServer::sendRoster(int fd, Roster * r, const char * args)
+{
+	int first;
+	int last;
+	pageRoster(r, args, &first, &last);
+
+	if (last == r->count)
+	{
+		// The page runs into the final "\r\n" already in the buffer
+		reply(fd, r->data + r->lines[first], r->length - r->lines[first] + 2);
+		return;
+	}
+	if (replyCapture != NULL)
+	{
+		reply(fd, r->data + r->lines[first], r->lines[last] - r->lines[first]);
+		reply(fd, "\r\n", 2);
+		return;
+	}
+	struct iovec iov[2];
+	iov[0].iov_base = r->data + r->lines[first];
+	iov[0].iov_len = r->lines[last] - r->lines[first];
+	iov[1].iov_base = (char*)"\r\n";
+	iov[1].iov_len = 2;
+	writev(fd, iov, 2);
+}
+
+// Appends the lines of r from first up to, but not including, last, and
+// the final "\r\n", to out
+void
+IRCServer::appendPage(Roster * r, int first, int last, std::string * out)
+{
+	out->append(r->data + r->lines[first], r->lines[last] - r->lines[first]);
+	out->append("\r\n", 2);
+}
+
+//
+// Snapshots:
+//   GET-ALL-USERS and GET-USERS-IN-ROOM are answered without the lock
+//   from snapshots that do not change once published: the directory of
+//   every user, the table of the rooms, and the roster of each room.
+//   Whoever holds the lock is the only writer. A change unpublishes the
+//   snapshots it makes stale, which are built again, with the lock held,
+//   by the next read that finds them missing. Until then that read, and
+//   any other that misses a snapshot, runs with the lock as usual.
+//
+//   A snapshot that was unpublished may still be read. Readers note the
+//   epoch they started in, and a snapshot is retired with the epoch after
+//   it was unpublished. It is freed once no reader started before that
+//   epoch is still reading.
+//
+
+// Slot of the current thread in readerEpochs, or -1 before it reads
+static thread_local int snapshotSlot = -1;
+
+void
+IRCServer::freeRoster(void * data)
+{
+	Roster * r = (Roster*)data;
+	free(r->data);
+	free(r->lines);
+	free(r);
+}
+
+void
+IRCServer::freeDirectory(void * data)
+{
+	UserDirectory * d = (UserDirectory*)data;
+	free(d->names.data);
+	free(d->names.lines);
+	free(d->passwords);
+	free(d);
+}
+
+// Starts reading snapshots. Returns the slot to pass to leaveSnapshot, or
+// -1 if there are too many reading threads already.
+int
+IRCServer::enterSnapshot()
+{
+	if (snapshotSlot < 0)
+	{
+		snapshotSlot = __atomic_fetch_add(&snapshotReaders, 1, __ATOMIC_SEQ_CST);
+	}
+	if (snapshotSlot >= MaxSnapshotReaders)
+	{
+		return -1;
+	}
+	__atomic_store_n(&readerEpochs[snapshotSlot],
+			 __atomic_load_n(&snapshotEpoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	return snapshotSlot;
+}
+
+void
+IRCServer::leaveSnapshot(int slot)
+{
+	__atomic_store_n(&readerEpochs[slot], 0, __ATOMIC_SEQ_CST);
+}
+
+// Unpublishes the snapshot *published, if there is one, and frees it with
+// release once no reader may hold it. Called with the lock held.
+void
+IRCServer::retireSnapshot(void ** published, void (*release)(void * data))
+{
+	void * data = *published;
+	if (data == NULL)
+	{
+		return;
+	}
+	__atomic_store_n(published, NULL, __ATOMIC_SEQ_CST);
+	RetiredSnapshot * t = (RetiredSnapshot*)malloc(sizeof(RetiredSnapshot));
+	t->data = data;
+	t->release = release;
+	t->epoch = __atomic_add_fetch(&snapshotEpoch, 1, __ATOMIC_SEQ_CST);
+	t->next = retiredSnapshots;
+	retiredSnapshots = t;
+	reclaimSnapshots();
+}
+
+// Frees the retired snapshots that every reader started after
+void
+IRCServer::reclaimSnapshots()
+{
+	unsigned long long oldest = ~0ull;
+	int readers = __atomic_load_n(&snapshotReaders, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < readers && i < MaxSnapshotReaders; i++)
+	{
+		unsigned long long e = __atomic_load_n(&readerEpochs[i], __ATOMIC_SEQ_CST);
+		if (e != 0 && e < oldest)
+		{
+			oldest = e;
+		}
+	}
+	RetiredSnapshot ** l = &retiredSnapshots;
+	while (*l != NULL)
+	{
+		RetiredSnapshot * t = *l;
+		if (t->epoch <= oldest)
+		{
+			*l = t->next;
+			t->release(t->data);
+			free(t);
+		}
+		else
+		{
+			l = &t->next;
+		}
+	}
+}
+
+// Returns the roster of r, built and published if it was not. Called with
+// the lock held.
+IRCServer::Roster *
+IRCServer::roomRoster(Room * r)
+{
+	Roster * roster = r->snapshot->roster;
+	if (roster != NULL)
+	{
+		return roster;
+	}
+	roster = (Roster*)malloc(sizeof(Roster));
+	initRoster(roster);
+	for (int i = 0; i < r->memberCount; i++)
+	{
+		appendRoster(roster, r->members[i]->username);
+	}
+	finishRoster(roster);
+	__atomic_store_n(&r->snapshot->roster, roster, __ATOMIC_SEQ_CST);
+	return roster;
+}
+
+// Publishes the table of the rooms, unless it is published already.
+// Called with the lock held.
+void
+IRCServer::publishRoomTable()
+{
+	if (roomTable != NULL)
+	{
+		return;
+	}
+	RoomTable * t = (RoomTable*)malloc(sizeof(RoomTable) + roomIndex.count*sizeof(RoomSnapshot*));
+	t->count = 0;
+	for (Room * r = roomIndex.head[0]; r != NULL; r = r->next[0])
+	{
+		t->rooms[t->count++] = r->snapshot;
+	}
+	__atomic_store_n(&roomTable, t, __ATOMIC_SEQ_CST);
+}
+
+// Returns the directory of the users, built and published if it was not.
+// Called with the lock held.
+IRCServer::UserDirectory *
+IRCServer::publishDirectory()
+{
+	if (directory != NULL)
+	{
+		return directory;
+	}
+	UserDirectory * d = (UserDirectory*)malloc(sizeof(UserDirectory));
+	initRoster(&d->names);
+	d->passwords = (const char**)malloc((userIndex.count() + 1)*sizeof(const char*));
+	const char * name;
+	void * data;
+	BTreeVoidIterator i(&userIndex);
+	while (i.next(name, data))
+	{
+		d->passwords[d->names.count] = ((Person*)data)->password;
+		appendRoster(&d->names, name);
+	}
+	finishRoster(&d->names);
+	__atomic_store_n(&directory, d, __ATOMIC_SEQ_CST);
+	return d;
+}
+
+// Checks the password of user against the users there were at startup,
+// who never change, or else against the published directory. Returns
+// false if the password is wrong, or the user is in neither.
+bool
+IRCServer::checkSnapshotPassword(const char * user, const char * password)
+{
+	void * data;
+	if (provisionedUsers.find(user, &data))
+	{
+		return strcmp(((Person*)data)->password, password) == 0;
+	}
+	UserDirectory * d = __atomic_load_n(&directory, __ATOMIC_SEQ_CST);
+	if (d == NULL)
+	{
+		return false;
+	}
+	Roster * r = &d->names;
+	int i = lowerBoundRoster(r, user);
+	int n = strlen(user);
+	return i < r->count &&
+		r->lines[i + 1] - r->lines[i] - 2 == n &&
+		memcmp(r->data + r->lines[i], user, n) == 0 &&
+		strcmp(d->passwords[i], password) == 0;
+}
 
-	if (userList.head == NULL)
+// Answers GET-ALL-USERS or GET-USERS-IN-ROOM in out from the snapshots,
+// without the lock. Returns false, with nothing in out, for any other
+// command, and for one that needs a snapshot that is not published or
+// answers anything but a page of names, so that it runs with the lock.
+bool
+IRCServer::answerFromSnapshot(int command, const char * user, const char * password, const char * args, std::string * out)
+{
+	if (command != GetAllUsersCommand && command != GetUsersInRoomCommand)
+	{
+		return false;
+	}
+	int slot = enterSnapshot();
+	if (slot < 0)
+	{
+		return false;
+	}
+	Roster * r = NULL;
+	const char * page = args;
+	if (checkSnapshotPassword(user, password))
 	{
-		userList.head = newUser;
-		const char * msg =  "OK\r\n";
-		write(fd, msg, strlen(msg));
-		return;		
+		if (command == GetAllUsersCommand)
+		{
+			UserDirectory * d = __atomic_load_n(&directory, __ATOMIC_SEQ_CST);
+			r = d != NULL ? &d->names : NULL;
+		}
+		else
+		{
+			// args is "<ROOM> [<CURSOR> [<LIMIT>]]"
+			const char * space = strchr(args, ' ');
+			int roomLength = space != NULL ? space - args : strlen(args);
+			char roomName[roomLength + 1];
+			memcpy(roomName, args, roomLength);
+			roomName[roomLength] = '\0';
+			page = space != NULL ? space + 1 : "";
+
+			RoomTable * t = __atomic_load_n(&roomTable, __ATOMIC_SEQ_CST);
+			int lo = 0;
+			int hi = t != NULL ? t->count : 0;
+			while (lo < hi)
+			{
+				int mid = (lo + hi) / 2;
+				int c = strcmp(t->rooms[mid]->roomName, roomName);
+				if (c == 0)
+				{
+					r = __atomic_load_n(&t->rooms[mid]->roster, __ATOMIC_SEQ_CST);
+					break;
+				}
+				if (c < 0)
+				{
+					lo = mid + 1;
+				}
+				else
+				{
+					hi = mid;
+				}
+			}
+		}
 	}
-	if (strcmp(user, userList.head->username) < 0)
+	if (r != NULL)
 	{
-		newUser->next = userList.head;
-		userList.head = newUser;
-		const char * msg =  "OK\r\n";
-                write(fd, msg, strlen(msg));
+		int first;
+		int last;
+		pageRoster(r, page, &first, &last);
+		appendPage(r, first, last, out);
+	}
+	leaveSnapshot(slot);
+	return r != NULL;
+}
+
+void
+IRCServer::createRoom(int fd, const char * user, const char * password,const  char * args)
+{
+	if (userIndex.count() == 0)
+        {
+                const char * msg = "DENIED (NO USERS).\r\n";
+                reply(fd, msg, strlen(msg));
+                return;
+        }
+        if (!checkPassword(fd, user, password))
+        {
+                const char * msg = "ERROR (Wrong password)\r\n";
+                reply(fd, msg, strlen(msg));
                 return;
-	}
-	Person * tempUser = userList.head;
-	while (tempUser->next != NULL)
+        }
+	if (*args == '\0' || addRoom(args) == NULL)
 	{
-		if (strcmp(user, tempUser->next->username) < 0)
-		{
-			newUser->next = tempUser->next;
-			tempUser->next = newUser;
-			const char * msg = "OK\r\n";
-		        write(fd, msg, strlen(msg));
-			return;
-		}
-		tempUser = tempUser->next;
+		const char * msg = "DENIED (Room exists)\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
 	}
-	tempUser->next = newUser;
+	
 	const char * msg = "OK\r\n";
-	write(fd, msg, strlen(msg));
-	return;
+        reply(fd, msg, strlen(msg));
+        return;
 }
 
+
 void
-IRCServer::enterRoom(int fd, const char * user, const char * password, const char * args)
+IRCServer::listRooms(int fd, const char * user, const char * password,const  char * args)
 {
-        Person * e;
-        if (userList.head == NULL)
+	if (userIndex.count() == 0)
         {
                 const char * msg = "DENIED (NO USERS).\r\n";
-                write(fd, msg, strlen(msg));
+                reply(fd, msg, strlen(msg));
                 return;
         }
         if (!checkPassword(fd, user, password))
         {
                 const char * msg = "ERROR (Wrong password)\r\n";
-                write(fd, msg, strlen(msg));
+                reply(fd, msg, strlen(msg));
                 return;
         }
 
-	char * roomName = (char*)args;
-	if (!checkRoom(fd, user, password, args))
+	// args is "[<CURSOR> [<LIMIT> [<PREFIX>]]]"
+	char cursor[1024] = "-";
+	char prefix[1024] = "";
+	int limit = -1;
+	sscanf(args, "%1023s %d %1023s", cursor, &limit, prefix);
+	int prefixLength = strlen(prefix);
+
+	// Start after the cursor, but not before the first name with the
+	// prefix
+	Room * r;
+	if (strcmp(cursor, "-") == 0 || strcmp(prefix, cursor) > 0)
 	{
-		const char * msg = "ERROR (No room)\r\n";
-                write(fd, msg, strlen(msg));
-                return;
+		r = lowerBoundRoom(prefix, NULL);
+	}
+	else
+	{
+		r = lowerBoundRoom(cursor, NULL);
+		if (r != NULL && strcmp(r->roomName, cursor) == 0)
+		{
+			r = r->next[0];
+		}
+	}
+
+	std::string out;
+	int count = 0;
+	while (r != NULL && count != limit &&
+	       strncmp(r->roomName, prefix, prefixLength) == 0)
+	{
+		out += r->roomName;
+		out += "\r\n";
+		count++;
+		r = r->next[0];
+	}
+	out += "\r\n";
+	reply(fd, out.data(), out.size());
+}
+
+// Keeps the connection open and registers it to receive every message
+// sent to the rooms the user is in. Returns true if the connection was
+// kept.
+bool
+IRCServer::subscribe(int fd, const char * user, const char * password, const char * args)
+{
+	if (userIndex.count() == 0)
+	{
+		const char * msg = "DENIED (NO USERS).\r\n";
+		reply(fd, msg, strlen(msg));
+		return false;
+	}
+	if (!checkPassword(fd, user, password))
+	{
+		const char * msg = "ERROR (Wrong password)\r\n";
+		reply(fd, msg, strlen(msg));
+		return false;
+	}
+	Person * e = findUser(user);
+
+	const char * msg = "OK\r\n";
+	reply(fd, msg, strlen(msg));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	addSubscriber(fd, e);
+	return true;
+}
+
+// Runs several commands of the same user, collecting the answer of each
+// one, and replies with all of them at once
+void
+IRCServer::batch(int fd, const char * user, const char * password, const char * args)
+{
+	// Frame every command before running any of them, so a bad batch
+	// changes nothing
+	const char * commands[MaxBatchCommands];
+	int lengths[MaxBatchCommands];
+	int count = 0;
+	const char * p = args;
+	const char * stop = args + strlen(args);
+	while (*p != '\0')
+	{
+		char * end;
+		long length = strtol(p, &end, 10);
+		if (count == MaxBatchCommands || end == p || *end != ' ' ||
+		    length <= 0 || length > stop - (end + 1) ||
+		    (end[1 + length] != '\0' && end[1 + length] != ' '))
+		{
+			const char * msg = "ERROR (Bad batch)\r\n";
+			reply(fd, msg, strlen(msg));
+			return;
+		}
+		commands[count] = end + 1;
+		lengths[count] = length;
+		count++;
+		p = end + 1 + length;
+		if (*p == ' ')
+		{
+			p++;
+		}
+	}
+	if (count == 0)
+	{
+		const char * msg = "ERROR (Bad batch)\r\n";
+		reply(fd, msg, strlen(msg));
+		return;
+	}
+
+	// Each command after the first, which the batch itself paid for, is
+	// charged as if it came on its own
+	Person * e = findUser(user);
+	bool known = e != NULL && strcmp(e->password, password) == 0;
+
+	std::string answers;
+	std::string answer;
+	std::string * outer = replyCapture;
+	replyCapture = &answer;
+	batching = true;
+	for (int i = 0; i < count; i++)
+	{
+		// Split a copy of "<COMMAND> <ARGS>"
+		char line[MaxCommandLine + 1];
+		memcpy(line, commands[i], lengths[i]);
+		line[lengths[i]] = '\0';
+		const char * commandArgs = "";
+		char * space = strchr(line, ' ');
+		if (space != NULL)
+		{
+			*space = '\0';
+			commandArgs = space + 1;
+		}
+
+		answer.clear();
+		int command = commandTable.find(line);
+		if (command == BatchCommand || command == SubscribeCommand ||
+		    command == FollowCommand || command == JoinCommand)
+		{
+			const char * msg = "DENIED (Not in a batch)\r\n";
+			reply(fd, msg, strlen(msg));
+		}
+		else if (i > 0 && (!checkRateLimit(fd) || (known && !checkUserRate(user))))
+		{
+			const char * msg = "DENIED (Rate limit)\r\n";
+			reply(fd, msg, strlen(msg));
+		}
+		else
+		{
+			runRequest(fd, command, user, password, commandArgs);
+		}
+		char length[32];
+		snprintf(length, sizeof(length), "%d\r\n", (int)answer.size());
+		answers += length;
+		answers += answer;
+	}
+	batching = false;
+	batchUser = NULL;
+	replyCapture = outer;
+
+	char header[32];
+	snprintf(header, sizeof(header), "BATCH %d\r\n", count);
+	reply(fd, header, strlen(header));
+	reply(fd, answers.data(), answers.size());
+}
+
+// Registers the non-blocking socket fd as a subscriber of e, or as a
+// follower if e is NULL
+IRCServer::Subscriber *
+IRCServer::addSubscriber(int fd, Person * e)
+{
+	Subscriber * s = (Subscriber*)malloc(sizeof(Subscriber));
+	s->fd = fd;
+	s->person = e;
+	s->queueHead = 0;
+	s->queueCount = 0;
+	s->offset = 0;
+	s->peer = false;
+	if (e == NULL)
+	{
+		s->next = NULL;
+		s->nextAll = followerList;
+		followerList = s;
+		return s;
+	}
+	s->next = e->subs;
+	e->subs = s;
+	s->nextAll = subscriberList;
+	subscriberList = s;
+	return s;
+}
+
+IRCServer::Payload *
+IRCServer::newPayload(int length)
+{
+	Payload * p = (Payload*)malloc(sizeof(Payload) + length);
+	p->refCount = 1;
+	p->length = length;
+	return p;
+}
+
+void
+IRCServer::releasePayload(Payload * p)
+{
+	p->refCount--;
+	if (p->refCount == 0)
+	{
+		free(p);
+	}
+}
+
+// Queues p on every connection subscribed by the members of room. The
+// payload itself is shared, so each recipient costs one pointer in its
+// queue and one write attempt.
+void
+IRCServer::broadcast(Room * room, Payload * p)
+{
+	for (int i = 0; i < room->memberCount; i++)
+	{
+		Subscriber * s = room->members[i]->subs;
+		while (s != NULL)
+		{
+			Subscriber * next = s->next;
+			enqueue(s, p);
+			s = next;
+		}
+	}
+}
+
+// Queues p on s and writes it right away if nothing is queued before it.
+// Drops s if it is too slow to keep up or gone.
+void
+IRCServer::enqueue(Subscriber * s, Payload * p)
+{
+	if (s->queueCount == SubscriberQueueLength)
+	{
+		dropSubscriber(s);
+		return;
+	}
+	int tail = (s->queueHead + s->queueCount) % SubscriberQueueLength;
+	s->queue[tail] = p;
+	p->refCount++;
+	s->queueCount++;
+	if (s->queueCount == 1)
+	{
+		pendingSubscribers++;
+		if (!flushSubscriber(s))
+		{
+			dropSubscriber(s);
+		}
+	}
+}
+
+// Writes as much of the queue of s as the socket takes without blocking.
+// Returns false if the connection is gone.
+bool
+IRCServer::flushSubscriber(Subscriber * s)
+{
+	while (s->queueCount > 0)
+	{
+		struct iovec iov[64];
+		int n = 0;
+		while (n < 64 && n < s->queueCount)
+		{
+			Payload * p = s->queue[(s->queueHead + n) % SubscriberQueueLength];
+			int skip = n == 0 ? s->offset : 0;
+			iov[n].iov_base = p->data + skip;
+			iov[n].iov_len = p->length - skip;
+			n++;
+		}
+		ssize_t written = writev(s->fd, iov, n);
+		if (written < 0)
+		{
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+		while (written > 0)
+		{
+			Payload * p = s->queue[s->queueHead];
+			int left = p->length - s->offset;
+			if (written < left)
+			{
+				s->offset += written;
+				break;
+			}
+			written -= left;
+			releasePayload(p);
+			s->offset = 0;
+			s->queueHead = (s->queueHead + 1) % SubscriberQueueLength;
+			s->queueCount--;
+		}
+		if (s->queueCount > 0 && s->offset > 0)
+		{
+			// Socket buffer is full
+			return true;
+		}
+	}
+	pendingSubscribers--;
+	return true;
+}
+
+// Retries the connections that still have queued messages. The threads
+// applying records queue messages too, so this holds the lock.
+void
+IRCServer::flushSubscribers()
+{
+	pthread_mutex_lock(&stateLock);
+	Subscriber * lists[2] = { subscriberList, followerList };
+	for (int i = 0; pendingSubscribers > 0 && i < 2; i++)
+	{
+		Subscriber * s = lists[i];
+		while (s != NULL)
+		{
+			Subscriber * next = s->nextAll;
+			if (s->queueCount > 0 && !flushSubscriber(s))
+			{
+				dropSubscriber(s);
+			}
+			s = next;
+		}
+	}
+	pthread_mutex_unlock(&stateLock);
+}
+
+// How long the main loop may wait for connections: a short while if a
+// subscriber has queued messages, otherwise until one comes
+int
+IRCServer::flushTimeoutMs()
+{
+	pthread_mutex_lock(&stateLock);
+	int timeout = pendingSubscribers > 0 ? 10 : -1;
+	pthread_mutex_unlock(&stateLock);
+	return timeout;
+}
+
+void
+IRCServer::dropSubscriber(Subscriber * s)
+{
+	if (s->queueCount > 0)
+	{
+		pendingSubscribers--;
+	}
+	while (s->queueCount > 0)
+	{
+		releasePayload(s->queue[s->queueHead]);
+		s->queueHead = (s->queueHead + 1) % SubscriberQueueLength;
+		s->queueCount--;
+	}
+	close(s->fd);
+
+	Subscriber ** l = &followerList;
+	if (s->person != NULL)
+	{
+		l = &s->person->subs;
+		while (*l != s)
+		{
+			l = &(*l)->next;
+		}
+		*l = s->next;
+		l = &subscriberList;
+	}
+	while (*l != s)
+	{
+		l = &(*l)->nextAll;
+	}
+	*l = s->nextAll;
+	free(s);
+}
+
+//
+// Replication:
+//   A server started with the port of a primary on this host connects
+//   to it and sends FOLLOW. The primary answers OK, then records with
+//   every user, room, member and message it has, then an S record, and
+//   from then on a record for each change as it makes it. The follower
+//   applies them on a thread of its own and answers only the commands
+//   that change nothing. Read cursors are its own.
+//
+//   A record is a varint with the length of the rest, the type, and its
+//   fields, each one a varint length and the bytes:
+//     U <USER> <PASSWD>      A user was added
+//     R <ROOM>               A room was created
+//     E <ROOM> <USER>        A user entered a room
+//     L <ROOM> <USER>        A user left a room
+//     M <ROOM> <USER> <TEXT> A message was sent
+//     D <ROOM>               A room moved to another node
+//     S                      The state there was is complete
+//
+//   When the stream ends, the follower takes writes itself if nothing
+//   listens on the port of the primary any more. Otherwise, when the
+//   primary restarted or dropped it for falling behind, it starts a new
+//   server that takes over from it, and follows the primary from
+//   scratch. If the primary turns the new server away, the new one
+//   exits and the old one tries again, waiting twice as long each time
+//   up to FollowRetryMaxSeconds.
+//
+
+static void
+putField(std::string * out, const char * data, unsigned length)
+{
+	char n[8];
+	out->append(n, putVarint(n, length) - n);
+	out->append(data, length);
+}
+
+// Appends the record made of body, its type and fields, to out
+static void
+putRecord(std::string * out, const std::string & body)
+{
+	char n[8];
+	out->append(n, putVarint(n, body.size()) - n);
+	*out += body;
+}
+
+// Whether the client on fd connects from this host
+static bool
+isLocalPeer(int fd)
+{
+	struct sockaddr_in peer;
+	socklen_t length = sizeof(peer);
+	return getpeername(fd, (struct sockaddr *)&peer, &length) == 0 &&
+		peer.sin_family == AF_INET &&
+		(ntohl(peer.sin_addr.s_addr) >> 24) == 127;
+}
+
+// Registers the connection of a server on this host that follows this
+// one, and queues the state there is now for it
+bool
+IRCServer::follow(int fd, const char * user, const char * password, const char * args)
+{
+	if (!isLocalPeer(fd))
+	{
+		const char * msg = "DENIED (Not local)\r\n";
+		reply(fd, msg, strlen(msg));
+		return false;
+	}
+	const char * msg = "OK\r\n";
+	reply(fd, msg, strlen(msg));
+
+	std::string state;
+	writeFollowerState(&state);
+	Payload * p = newPayload(state.size());
+	memcpy(p->data, state.data(), state.size());
+
+	// Sent by flushSubscribers(), once the answer is out
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	Subscriber * s = addSubscriber(fd, NULL);
+	s->queue[0] = p;
+	s->queueCount = 1;
+	pendingSubscribers++;
+	printf("New follower, %lu bytes of state\n", (unsigned long)state.size());
+	return true;
+}
+
+// Writes the records of every user, room, message and member to out,
+// followed by an S record
+void
+IRCServer::writeFollowerState(std::string * out)
+{
+	writeUsers(out);
+	for (Room * r = roomIndex.head[0]; r != NULL; r = r->next[0])
+	{
+		writeRoom(out, r);
+	}
+	putRecord(out, std::string(1, 'S'));
+}
+
+// Writes the record of every user to out, by id, so a follower gives
+// them the same ids
+void
+IRCServer::writeUsers(std::string * out)
+{
+	for (int id = 0; id < userCount; id++)
+	{
+		std::string body(1, 'U');
+		putField(&body, usersById[id]->username, strlen(usersById[id]->username));
+		putField(&body, usersById[id]->password, strlen(usersById[id]->password));
+		putRecord(out, body);
+	}
+}
+
+// Writes the records of r, its messages and its members to out
+void
+IRCServer::writeRoom(std::string * out, Room * r)
+{
+	std::string body(1, 'R');
+	putField(&body, r->roomName, strlen(r->roomName));
+	putRecord(out, body);
+
+	// Older messages are "<NUM> <USER> <TEXT>\r\n" lines in the history
+	// file
+	for (int i = 0; i < r->extentCount; i++)
+	{
+		HistoryExtent * e = &r->extents[i];
+		std::string lines;
+		lines.resize(e->length);
+		if (pread(historyFile, &lines[0], e->length, e->offset) != (ssize_t)e->length)
+		{
+			perror("history file");
+			continue;
+		}
+		size_t at = 0;
+		while (at < lines.size())
+		{
+			size_t from = lines.find(' ', at) + 1;
+			size_t text = lines.find(' ', from) + 1;
+			size_t end = lines.find("\r\n", text);
+			body.assign(1, 'M');
+			putField(&body, r->roomName, strlen(r->roomName));
+			putField(&body, lines.data() + from, text - 1 - from);
+			putField(&body, lines.data() + text, end - text);
+			putRecord(out, body);
+			at = end + 2;
+		}
+	}
+	for (MessageSegment * g = r->firstSegment; g != NULL; g = g->next)
+	{
+		const char * p = g->data;
+		while (p < g->data + g->length)
+		{
+			int messNum;
+			int from;
+			const char * text;
+			int length;
+			p = decodeMessage(p, &messNum, &from, &text, &length);
+			const char * name = usersById[from]->username;
+			body.assign(1, 'M');
+			putField(&body, r->roomName, strlen(r->roomName));
+			putField(&body, name, strlen(name));
+			putField(&body, text, length);
+			putRecord(out, body);
+		}
+	}
+
+	// Members after the messages, which are not new to them
+	for (int i = 0; i < r->memberCount; i++)
+	{
+		const char * name = r->members[i]->username;
+		body.assign(1, 'E');
+		putField(&body, r->roomName, strlen(r->roomName));
+		putField(&body, name, strlen(name));
+		putRecord(out, body);
+	}
+}
+
+// Sends a change to every follower
+void
+IRCServer::replicate(char type, const char * a, const char * b, const char * c)
+{
+	if (followerList == NULL)
+	{
+		return;
+	}
+	std::string body(1, type);
+	const char * fields[3] = { a, b, c };
+	for (int i = 0; i < 3 && fields[i] != NULL; i++)
+	{
+		putField(&body, fields[i], strlen(fields[i]));
+	}
+	std::string record;
+	putRecord(&record, body);
+	// The other nodes only share the users, each one sending those added
+	// on it
+	sendFollowers(record, type == 'U' && !applyingPeer);
+}
+
+// Queues records on every follower, and on the other nodes if toPeers
+void
+IRCServer::sendFollowers(const std::string & records, bool toPeers)
+{
+	if (followerList == NULL)
+	{
+		return;
+	}
+	Payload * p = newPayload(records.size());
+	memcpy(p->data, records.data(), records.size());
+	Subscriber * s = followerList;
+	while (s != NULL)
+	{
+		Subscriber * next = s->nextAll;
+		if (!s->peer || toPeers)
+		{
+			enqueue(s, p);
+		}
+		s = next;
+	}
+	releasePayload(p);
+}
+
+// Connects to the server on port of this host, sends request, if there
+// is one, and waits for OK, at most timeoutMs if it is not 0. Returns the
+// socket, or -1 and sets refused if nothing listens on port.
+int
+IRCServer::connectLocal(int port, const char * request, int timeoutMs, bool * refused)
+{
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons((u_short) port);
+	*refused = false;
+	int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+	{
+		*refused = errno == ECONNREFUSED;
+		close(fd);
+		return -1;
+	}
+	struct timeval tv;
+	tv.tv_sec = timeoutMs / 1000;
+	tv.tv_usec = (timeoutMs % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	char answer[4];
+	if (request != NULL &&
+	    (!writeFully(fd, request, strlen(request)) ||
+	     !readFully(fd, answer, sizeof(answer)) ||
+	     memcmp(answer, "OK\r\n", sizeof(answer)) != 0))
+	{
+		close(fd);
+		return -1;
+	}
+
+	// What follows may take any time to come
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+// Connects to the primary and asks to follow it. Returns false if it
+// does not answer or refuses, with refused set if nothing listens on its
+// port.
+bool
+IRCServer::connectPrimary(bool * refused)
+{
+	int fd = connectLocal(primaryPort, "FOLLOW\r\n", 0, refused);
+	if (fd < 0)
+	{
+		return false;
+	}
+	primary = new RecordReader;
+	primary->fd = fd;
+	primary->start = 0;
+	return true;
+}
+
+// Points body to the next record from the primary, which stays valid
+// until the next call. Returns false once the stream ends.
+bool
+IRCServer::readRecord(RecordReader * in, const char ** body, unsigned * length)
+{
+	while (1)
+	{
+		const char * p = in->data.data() + in->start;
+		const char * end = in->data.data() + in->data.size();
+		unsigned size;
+		const char * q = getFrameVarint(p, end, &size);
+		if (q != NULL && end - q >= (long)size)
+		{
+			*body = q;
+			*length = size;
+			in->start = q + size - in->data.data();
+			return true;
+		}
+		if (q == NULL && end - p >= 5)
+		{
+			// Not a length
+			return false;
+		}
+
+		// Keep only the partial record and read more
+		in->data.erase(0, in->start);
+		in->start = 0;
+		char buffer[64 * 1024];
+		ssize_t n = read(in->fd, buffer, sizeof(buffer));
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		in->data.append(buffer, n);
 	}
-	
-	Room * f = (Room*)malloc(sizeof(Room));
-	f->next = NULL;
-	f->roomName = roomName;
-	f->messCount = 0;
+}
 
-	e = userList.head;
-	while (e->next != NULL)
+// Applies the records of the state of the primary, or of another node,
+// up to the S record. Returns false if the stream ends before.
+bool
+IRCServer::readBootstrap(RecordReader * in, bool peer)
+{
+	const char * body;
+	unsigned length;
+	// Names of the rooms received, each one ending in '\0'
+	std::string rooms;
+	while (readRecord(in, &body, &length))
 	{
-		if (strcmp(user, e->username) == 0)
+		if (length == 1 && body[0] == 'S')
 		{
-			if (e->roomIn == NULL)
-			{
-				e->roomIn = f;
-			}
-			else if (strcmp(e->roomIn->roomName, roomName) == 0)
+			// The rooms are new to the followers, which get them whole
+			pthread_mutex_lock(&stateLock);
+			for (size_t at = 0; at < rooms.size(); at = rooms.find('\0', at) + 1)
 			{
+				Room * r = findRoom(rooms.c_str() + at);
+				if (r != NULL && followerList != NULL)
+				{
+					std::string records;
+					writeRoom(&records, r);
+					sendFollowers(records, false);
+				}
 			}
-			else
-			{
-				e->roomIn->next = f;
-			}
-			const char * msg = "OK\r\n";
-        		write(fd, msg, strlen(msg));
-        		return;
+			pthread_mutex_unlock(&stateLock);
+			return true;
 		}
-		e = e->next;
-	}
-	if (strcmp(user, e->username) == 0)
-	{
-		if (e->roomIn == NULL)
+		pthread_mutex_lock(&stateLock);
+		bool ok = applyRecord(body, length, peer, &rooms);
+		pthread_mutex_unlock(&stateLock);
+		if (!ok)
 		{
-			e->roomIn = f;
+			break;
 		}
-		else if (strcmp(e->roomIn->roomName, roomName) == 0)
-                {
-                }
-                else
-                {
-                        e->roomIn->next = f;
-                }
-		const char * msg = "OK\r\n";
-        	write(fd, msg, strlen(msg));
-        	return;
 	}
+	return false;
 }
 
-void
-IRCServer::leaveRoom(int fd, const char * user, const char * password, const char * args)
+// Makes the change of a record from the primary, or from another node.
+// Returns false if the record is not valid. The records of a bootstrap,
+// for which rooms is not NULL, only build the state: their rooms and
+// members are not sent to the followers, their messages not to the
+// subscribers, and the names of their rooms are added to rooms.
+bool
+IRCServer::applyRecord(const char * body, unsigned length, bool peer, std::string * rooms)
 {
-	Person * e;
-	Room * f;
-	Room * r;
-        if (userList.head == NULL)
-        {
-                const char * msg = "DENIED (NO USERS).\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-        }
-        if (!checkPassword(fd, user, password))
-        {
-                const char * msg = "ERROR (Wrong password)\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-        }
-	if (!checkRoom(fd, user, password, args))
+	const char * end = body + length;
+	const char * p = body + 1;
+	char fields[3][MaxCommandLine + 1];
+	int count = 0;
+	while (p < end)
 	{
-		const char * msg = "Error (Room DNE)\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-	}
-	if (!checkUserInRoom(fd, user, password, args))
-	{
-		const char * msg = "ERROR (No user in room)\r\n";
-                write(fd, msg, strlen(msg));
-                return;
+		unsigned n;
+		p = getFrameVarint(p, end, &n);
+		if (count == 3 || p == NULL || end - p < (long)n || n > MaxCommandLine)
+		{
+			return false;
+		}
+		memcpy(fields[count], p, n);
+		fields[count][n] = '\0';
+		count++;
+		p += n;
 	}
-	f = roomList.head;
-	while(f->next != NULL)
+
+	char type = length > 0 ? body[0] : 0;
+	applyingPeer = peer;
+	bool ok = false;
+	if (type == 'U' && count == 2)
 	{
-		if (strcmp(f->roomName, args) == 0)
+		// Every node sends the users it has when it is joined
+		if (!peer || findUser(fields[0]) == NULL)
 		{
-			break;
+			addPerson(fields[0], fields[1]);
 		}
-		f = f->next;
+		ok = true;
 	}
-
-	e = userList.head;
-	while (e->next != NULL)
+	else if (type == 'R' && count == 1 && rooms != NULL)
+	{
+		ok = insertRoom(fields[0]) != NULL;
+		rooms->append(fields[0], strlen(fields[0]) + 1);
+	}
+	else if (type == 'R' && count == 1)
+	{
+		ok = addRoom(fields[0]) != NULL;
+	}
+	else if (count >= 1)
 	{
-		if (strcmp(e->username, user) == 0)
+		// The others are about a room, and a user in it
+		Room * r = findRoom(fields[0]);
+		Person * e = count >= 2 ? findUser(fields[1]) : NULL;
+		bool found = false;
+		int i = r != NULL && e != NULL ? findMember(r, fields[1], &found) : 0;
+		if (r == NULL)
 		{
-			while (e->roomIn->next != NULL)
+			ok = false;
+		}
+		else if (type == 'D' && count == 1)
+		{
+			removeRoom(r);
+			ok = true;
+		}
+		else if (type == 'L' && count == 2 && found)
+		{
+			removeMember(r, i);
+			ok = true;
+		}
+		else if (type == 'E' && count == 2 && e != NULL)
+		{
+			if (rooms != NULL)
 			{
-				if (strcmp(e->roomIn->roomName, args) == 0)
-				{
-					e->roomIn = NULL;
-					const char * msg = "OK\r\n";
-		        		write(fd, msg, strlen(msg));
-		        		return;
-				}
-				e->roomIn = e->roomIn->next;
-			}
-			if (strcmp(e->roomIn->roomName, args) == 0)
-                        {
-                                e->roomIn = NULL;
-                                const char * msg = "OK\r\n";
-                                write(fd, msg, strlen(msg));
-                                return;
-                        }
-		}
-		e = e->next;
-	}
-	if (strcmp(e->username, user) == 0)
-	{
-                while (e->roomIn->next != NULL)
-                {
-                        if (strcmp(e->roomIn->roomName, args) == 0)
-                        {
-                                e->roomIn = NULL;
-                                const char * msg = "OK\r\n";
-                                write(fd, msg, strlen(msg));
-                                return;
-                        }
-                        e->roomIn = e->roomIn->next;
-                }
-                if (strcmp(e->roomIn->roomName, args) == 0)
-                {        
-                        e->roomIn = NULL;
-                        const char * msg = "OK\r\n";
-                        write(fd, msg, strlen(msg));
-                        return;
-                }
+				insertMember(r, e);
+			}
+			else
+			{
+				addMember(r, e);
+			}
+			ok = true;
+		}
+		else if (type == 'M' && count == 3 && e != NULL)
+		{
+			if (rooms != NULL)
+			{
+				storeMessage(r, e, fields[2]);
+			}
+			else
+			{
+				postMessage(r, e, fields[2]);
+			}
+			ok = true;
+		}
 	}
+	applyingPeer = false;
+	return ok;
 }
 
-void
-IRCServer::sendMessage(int fd, const char * user, const char * password, const char * args)
+// Applies the changes of the primary until its stream ends, then takes
+// writes or starts over
+void *
+IRCServer::followPrimary(void * arg)
 {
-        Person * e;
-        if (userList.head == NULL)
-        {
-                const char * msg = "DENIED (NO USERS).\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-        }
-        if (!checkPassword(fd, user, password))
-        {
-                const char * msg = "ERROR (Wrong password)\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-        }
-	e = userList.head;
-	while (e->next != NULL)
+	IRCServer * s = (IRCServer *)arg;
+	const char * body;
+	unsigned length;
+	while (readRecord(s->primary, &body, &length))
 	{
-		if (strcmp(user, e->username) == 0)
+		pthread_mutex_lock(&s->stateLock);
+		bool ok = s->applyRecord(body, length, false, NULL);
+		pthread_mutex_unlock(&s->stateLock);
+		if (!ok)
 		{
+			fprintf(stderr, "Bad record from port %d\n", s->primaryPort);
 			break;
 		}
-		e = e->next;
 	}
+	close(s->primary->fd);
 
-	char * tempRoom = (char*)malloc(sizeof(char)*100);
-	char * roomName = tempRoom;
-	char * tempMessage = (char*)malloc(sizeof(char)*1000);
-	char * tempArgs = (char*)args;
-	while (*tempArgs != ' ' && *tempArgs != '\0')
+	int wait = 1;
+	while (1)
 	{
-		*tempRoom = *tempArgs;
-		tempArgs++;
-		tempRoom++;
-	}
-	tempArgs ++;
-	tempMessage = tempArgs;
-
-	Message * newMessage = (Message*)malloc(sizeof(Message));
-	newMessage->message = tempMessage;
-	newMessage->messFrom = e;
-	newMessage->room = roomName;
-	newMessage->next = NULL;
+		bool gone;
+		int fd = connectLocal(s->primaryPort, NULL, 0, &gone);
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		if (gone)
+		{
+			pthread_mutex_lock(&s->stateLock);
+			printf("Port %d is gone, taking writes\n", s->primaryPort);
+			s->primaryPort = 0;
+			delete s->primary;
+			s->primary = NULL;
+			pthread_mutex_unlock(&s->stateLock);
+			return NULL;
+		}
 
-	Room * r;
-	if (roomList.head == NULL)
-	{
-		const char * msg = "ERROR (NO ROOMS)\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-	}
-	r = roomList.head;
-	while (r->next != NULL)
-	{
-		if (strcmp(r->roomName, roomName) == 0)
+		// This server exits once the new one has taken over, so the
+		// new one failed if it exits first
+		printf("Following port %d again\n", s->primaryPort);
+		pid_t pid = fork();
+		if (pid == 0)
 		{
-			newMessage->messNum = r->messCount;
-			r->messCount ++;
+			execv("/proc/self/exe", serverArgv);
+			_exit(127);
 		}
-		r = r->next;
+		if (pid > 0)
+		{
+			waitpid(pid, NULL, 0);
+		}
+		sleep(wait);
+		wait = wait * 2 < FollowRetryMaxSeconds ? wait * 2 : FollowRetryMaxSeconds;
 	}
-	if (strcmp(r->roomName, roomName) == 0)
+}
+
+//
+// Cluster:
+//   The nodes of a cluster are the servers on the ports listed in
+//   CLUSTER_FILE. A room belongs to a single node, picked by consistent
+//   hashing of its name: every node has ClusterPoints points on a ring
+//   of 64-bit hashes, and a room belongs to the node of the first point
+//   at or after the hash of its name. A node answers MOVED <PORT> to a
+//   command about a room of another node, and the client sends it
+//   there instead.
+//
+//   Every node has every user. A node that starts sends JOIN <PORT> to
+//   the nodes that are up. Each one adds it to its ring and answers OK,
+//   the U records of its users, the records of the rooms that belong
+//   to the new node now, which it drops, and an S record. From then on
+//   it sends the users added on it. A node joined by one it did not
+//   know joins it back, so every two nodes send each other their users.
+//   A node whose stream ends is joined again, or taken off the ring if
+//   nothing listens on its port any more. Its rooms are gone with it.
+//   A node waits JoinTimeoutMs for OK while it starts, since the node
+//   it joins may be starting too and waiting for it, and leaves joining
+//   the ones that did not answer to a thread for each.
+//
+
+// Hash of key for the ring. FNV-1a leaves the upper bits of short keys
+// alike, so they are mixed as MurmurHash3 does.
+static unsigned long long
+ringHash(const char * key, unsigned seed)
+{
+	unsigned long long h = perfectHashKey(key, seed);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+int
+IRCServer::compareRingPoints(const void * a, const void * b)
+{
+	const RingPoint * x = (const RingPoint *)a;
+	const RingPoint * y = (const RingPoint *)b;
+	if (x->hash != y->hash)
 	{
-		newMessage->messNum = r->messCount;
-		r->messCount ++;
+		return x->hash < y->hash ? -1 : 1;
 	}
+	return x->port - y->port;
+}
 
-	if (!checkUserInRoom(fd, user, password, newMessage->room))
+// Adds the node on port, from this host, to the cluster, and queues for
+// it the users and the rooms that belong to it now, which leave this
+// node. Joins it back if it is new.
+bool
+IRCServer::join(int fd, const char * user, const char * password, const char * args)
+{
+	// JOIN <PORT>
+	int port = atoi(user);
+	if (!isLocalPeer(fd))
 	{
-		const char * msg = "ERROR (user not in room)\r\n";
-                write(fd, msg, strlen(msg));
-                return;
+		const char * msg = "DENIED (Not local)\r\n";
+		reply(fd, msg, strlen(msg));
+		return false;
 	}
-	Message * f;
-	if (messList.head == NULL)
+	if (clusterNodeCount == 0 || port <= 0 || port == serverPort)
 	{
-		newMessage->next;
-		messList.head = newMessage;
-		const char * msg = "OK\r\n";
-        	write(fd, msg, strlen(msg));
-        	return;
+		const char * msg = "DENIED (No cluster)\r\n";
+		reply(fd, msg, strlen(msg));
+		return false;
 	}
-	f = messList.head;
-	while (f->next != NULL)
+	// A node that stopped waiting for the answer closed its end, and
+	// would lose the rooms sent to it
+	char c;
+	if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
 	{
-		f = f->next;
+		return false;
 	}
-	f->next = newMessage;
-
 	const char * msg = "OK\r\n";
-	write(fd, msg, strlen(msg));
-	return;
-}
+	reply(fd, msg, strlen(msg));
+	addNode(port);
 
-void
-IRCServer::getMessages(int fd, const char * user, const char * password, const char * args)
-{
-	Person * e;
-        if (userList.head == NULL)
-        {
-                const char * msg = "ERROR (No users)\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-        }
-        if (!checkPassword(fd, user, password))
-        {
-                const char * msg = "ERROR (Wrong password)\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-        }
-        e = userList.head;
-	while (e->next != NULL)
+	std::string state;
+	writeUsers(&state);
+	int moved = 0;
+	Room * r = roomIndex.head[0];
+	while (r != NULL)
 	{
-		if (strcmp(e->username, user) == 0)
+		Room * next = r->next[0];
+		if (nodeOf(r->roomName) == port)
 		{
-			break;
+			writeRoom(&state, r);
+			removeRoom(r);
+			moved++;
 		}
-		e = e->next;
-	}
-
-	int tempMessCount = atoi(args);
-	while (*args != ' ')
-	{
-		args++;
+		r = next;
 	}
-	args ++;
+	putRecord(&state, std::string(1, 'S'));
+	Payload * p = newPayload(state.size());
+	memcpy(p->data, state.data(), state.size());
 
-	char * roomName = (char*)args;
+	// Sent by flushSubscribers(), once the answer is out
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	Subscriber * s = addSubscriber(fd, NULL);
+	s->peer = true;
+	s->queue[0] = p;
+	s->queueCount = 1;
+	pendingSubscribers++;
+	printf("Node %d joined, %d rooms moved to it\n", port, moved);
 
-	if (!checkUserInRoom(fd, user, password, roomName))
-        {
-                const char * msg = "ERROR (User not in room)\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-        }
+	// Join it back, unless it was joined already
+	Peer * peer = new Peer;
+	peer->server = this;
+	peer->port = port;
+	peer->stream.fd = -1;
+	startPeer(peer);
+	return true;
+}
 
-	Message * m;
-	Message * n;
-	int lastMessNum = 0;
-	if (messList.head == NULL)
+// Joins the nodes of CLUSTER_FILE that are up, if this one is there
+void
+IRCServer::joinCluster()
+{
+	FILE * f = fopen(CLUSTER_FILE, "r");
+	if (f == NULL)
 	{
-		const char * msg = "NO-NEW-MESSAGES\r\n";
-                write(fd, msg, strlen(msg));
-                return;
+		return;
+	}
+	int ports[MaxClusterNodes];
+	int count = 0;
+	bool listed = false;
+	while (count < MaxClusterNodes && fscanf(f, "%d", &ports[count]) == 1)
+	{
+		listed = listed || ports[count] == serverPort;
+		count++;
+	}
+	fclose(f);
+	if (!listed)
+	{
+		return;
 	}
-	m = messList.head;
-	n = messList.head;
-	while (n->next != NULL)
+
+	pthread_mutex_lock(&stateLock);
+	addNode(serverPort);
+	pthread_mutex_unlock(&stateLock);
+	for (int i = 0; i < count; i++)
 	{
-		if (strcmp(n->room, roomName) == 0)
+		pthread_mutex_lock(&stateLock);
+		bool known = isNode(ports[i]);
+		pthread_mutex_unlock(&stateLock);
+		if (known)
+		{
+			continue;
+		}
+		Peer * p = new Peer;
+		p->server = this;
+		p->port = ports[i];
+		p->stream.fd = -1;
+		bool gone;
+		if (!joinNode(p, &gone) && gone)
 		{
-			lastMessNum = n->messNum;
+			// It joins this one when it starts
+			delete p;
+			continue;
 		}
-		n = n->next;
+		// Joined, or to be joined once it answers
+		pthread_mutex_lock(&stateLock);
+		startPeer(p);
+		pthread_mutex_unlock(&stateLock);
 	}
-	if (strcmp(n->room, roomName) == 0)
+	printf("In a cluster of %d nodes, with %d rooms here\n",
+	       clusterNodeCount, roomIndex.count);
+}
+
+// Sends JOIN to the node of p and applies the users and rooms it sends
+// back. Returns false if it cannot, with gone set if nothing listens on
+// the port of the node.
+bool
+IRCServer::joinNode(Peer * p, bool * gone)
+{
+	char request[32];
+	snprintf(request, sizeof(request), "JOIN %d\r\n", serverPort);
+	int fd = connectLocal(p->port, request, JoinTimeoutMs, gone);
+	if (fd < 0)
 	{
-		lastMessNum = n->messNum;
+		return false;
 	}
-
-	if (lastMessNum < tempMessCount)
+	p->stream.fd = fd;
+	p->stream.data.clear();
+	p->stream.start = 0;
+	if (!readBootstrap(&p->stream, true))
 	{
-		const char * msg = "NO-NEW-MESSAGES\r\n";
-                write(fd, msg, strlen(msg));
-                return;
+		close(fd);
+		p->stream.fd = -1;
+		return false;
 	}
+	pthread_mutex_lock(&stateLock);
+	addNode(p->port);
+	pthread_mutex_unlock(&stateLock);
+	return true;
+}
 
-	while (m->next != NULL)
+// Applies the users another node adds until its stream ends, then joins
+// it again, or takes it off the ring once it is gone
+void *
+IRCServer::followPeer(void * arg)
+{
+	Peer * p = (Peer *)arg;
+	IRCServer * s = p->server;
+	while (1)
 	{
-		if (strcmp(m->room, roomName) == 0 && tempMessCount <= m->messNum)
+		const char * body;
+		unsigned length;
+		while (p->stream.fd >= 0 && readRecord(&p->stream, &body, &length))
 		{
-			char * out = (char*)malloc(sizeof(char)*1000);
-
-			char buffer[32];
-			sprintf(buffer, "%d ", m->messNum);
-			char * msg1 = (char*)buffer;
-			char * msg2 = (char*)m->messFrom->username;
-                        char * msg3 = (char*)m->message;
-			char * msg4 = (char*)"\r\n";
-
-			strcat(out, msg1);
-                	strcat(out, msg2);
-                	strcat(out, " "); 
-        	        strcat(out, msg3);
-	                strcat(out, msg4);
-			
-			write(fd, out, strlen(out));
+			pthread_mutex_lock(&s->stateLock);
+			bool ok = s->applyRecord(body, length, true, NULL);
+			pthread_mutex_unlock(&s->stateLock);
+			if (!ok)
+			{
+				fprintf(stderr, "Bad record from node %d\n", p->port);
+				break;
+			}
+		}
+		if (p->stream.fd >= 0)
+		{
+			close(p->stream.fd);
+			p->stream.fd = -1;
 		}
-		m = m->next;
-	}
-	if (strcmp(m->room, roomName) == 0 && tempMessCount <= m->messNum)
-        {
-		char * out = (char*)malloc(sizeof(char)*1000);
-		
-		char buffer[32];
-		sprintf(buffer, "%d ", m->messNum);
-                char * msg1 = (char*)buffer;
-                char * msg2 = (char*)m->messFrom->username;
-                char * msg3 = (char*)m->message;
-                char * msg4 = (char*)"\r\n";
-		
-		strcat(out, msg1);
-		strcat(out, msg2);
-		strcat(out, " ");
-		strcat(out, msg3);
-		strcat(out, msg4);
 
-		write(fd, out, strlen(out));
+		bool gone;
+		if (s->joinNode(p, &gone))
+		{
+			continue;
+		}
+		if (gone)
+		{
+			pthread_mutex_lock(&s->stateLock);
+			s->removeNode(p->port);
+			Peer ** l = &s->peers;
+			while (*l != p)
+			{
+				l = &(*l)->next;
+			}
+			*l = p->next;
+			pthread_mutex_unlock(&s->stateLock);
+			printf("Node %d is gone\n", p->port);
+			delete p;
+			return NULL;
+		}
+		sleep(1);
 	}
-	char * end = (char*)"\r\n";
-        write(fd, end, strlen(end));
 }
 
+// Starts the thread that reads the users of the node of p, unless there
+// is one already. Called with the lock held.
 void
-IRCServer::getUsersInRoom(int fd, const char * user, const char * password, const char * args)
+IRCServer::startPeer(Peer * p)
 {
-	Person * e;
-	Room * f;
-        if (userList.head == NULL)
-        {
-                const char * msg = "DENIED (NO USERS).\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-        }
-        if (!checkPassword(fd, user, password))
-        {
-                const char * msg = "ERROR (Wrong password)\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-        }
-	e = userList.head;
-	char * roomName = (char*)args;
-	while (e->next != NULL)
+	for (Peer * q = peers; q != NULL; q = q->next)
 	{
-		f = e->roomIn;
-		if (f != NULL)
+		if (q->port == p->port)
 		{
-			while (f->next != NULL)
+			if (p->stream.fd >= 0)
 			{
-				if (strcmp(f->roomName, roomName) == 0)
-				{
-					char * msg1 = (char*)e->username;
-                			char * msg2 = (char*)"\r\n";
-					write(fd, msg1, strlen(msg1));
-                			write(fd, msg2, strlen(msg2));
-				}
-				f = f->next;
-			}
-			if (strcmp(f->roomName, roomName) == 0)
-                	{
-                	        char * msg1 = (char*)e->username;
-                	        char * msg2 = (char*)"\r\n";
-                	        write(fd, msg1, strlen(msg1));
-                	        write(fd, msg2, strlen(msg2));
-                	}
-		}
-		e = e->next;
-	}
-	f = e->roomIn;
-	if (f != NULL)
-	{
-        	while (f->next != NULL)
-        	{
-        	        if (strcmp(f->roomName, roomName) == 0)
-        	        {
-        	                char * msg1 = (char*)e->username;
-        	                char * msg2 = (char*)"\r\n";
-        	                write(fd, msg1, strlen(msg1));
-        	                write(fd, msg2, strlen(msg2));
-        	        }
-        	        f = f->next;
-        	}
-        	if (strcmp(f->roomName, roomName) == 0)
-        	{
-        	        char * msg1 = (char*)e->username;
-        	        char * msg2 = (char*)"\r\n";
-        	        write(fd, msg1, strlen(msg1));
-        	        write(fd, msg2, strlen(msg2));
-        	}
-	}
-	char * msg1 = (char*)"\r\n";
-	write(fd, msg1, strlen(msg1));
+				close(p->stream.fd);
+			}
+			delete p;
+			return;
+		}
+	}
+	p->next = peers;
+	peers = p;
+	pthread_t thread;
+	pthread_create(&thread, NULL, followPeer, p);
+	pthread_detach(thread);
 }
 
-void
-IRCServer::getAllUsers(int fd, const char * user, const char * password,const  char * args)
+bool
+IRCServer::isNode(int port)
 {
-	Person * e;
-	if (userList.head == NULL)
+	for (int i = 0; i < clusterNodeCount; i++)
 	{
-		const char * msg = "DENIED (NO USERS).\r\n";
-		write(fd, msg, strlen(msg));
-		return;
+		if (clusterNodes[i] == port)
+		{
+			return true;
+		}
 	}
-	if (!checkPassword(fd, user, password))
+	return false;
+}
+
+void
+IRCServer::addNode(int port)
+{
+	if (isNode(port) || clusterNodeCount == MaxClusterNodes)
 	{
-		const char * msg = "ERROR (Wrong password)\r\n";
-		write(fd, msg, strlen(msg));
 		return;
 	}
-	e = userList.head;
-	while (e->next != NULL)
+	clusterNodes[clusterNodeCount++] = port;
+	buildRing();
+}
+
+void
+IRCServer::removeNode(int port)
+{
+	for (int i = 0; i < clusterNodeCount; i++)
 	{
-		char * msg1 = (char*)e->username;
-		char * msg2 = (char*)"\r\n";
-		write(fd, msg1, strlen(msg1));
-		write(fd, msg2, strlen(msg2));
-		e = e->next;
+		if (clusterNodes[i] == port)
+		{
+			clusterNodes[i] = clusterNodes[--clusterNodeCount];
+			buildRing();
+			return;
+		}
 	}
-	char * msg1 = (char*)e->username;
-	char * msg2 = (char*)"\r\n\r\n";
-	write(fd, msg1, strlen(msg1));
-	write(fd, msg2, strlen(msg2));
-	return;
 }
 
+// Places the points of every node on the ring, in order
 void
-IRCServer::createRoom(int fd, const char * user, const char * password,const  char * args)
+IRCServer::buildRing()
 {
-	if (userList.head == NULL)
-        {
-                const char * msg = "DENIED (NO USERS).\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-        }
-        if (!checkPassword(fd, user, password))
-        {
-                const char * msg = "ERROR (Wrong password)\r\n";
-                write(fd, msg, strlen(msg));
-                return;
-        }
-	Room * newRoom = (Room*)malloc(sizeof(Room));
-	newRoom->roomName = args;
-	newRoom->messCount = 0;
-	newRoom->next = NULL;
-	if (roomList.head == NULL)
+	ringCount = clusterNodeCount * ClusterPoints;
+	ring = (RingPoint*)realloc(ring, ringCount * sizeof(RingPoint));
+	int n = 0;
+	for (int i = 0; i < clusterNodeCount; i++)
 	{
-		roomList.head = newRoom;
-		const char * msg = "OK\r\n";
-        	write(fd, msg, strlen(msg));
-		return;
+		char name[16];
+		snprintf(name, sizeof(name), "%d", clusterNodes[i]);
+		for (int j = 0; j < ClusterPoints; j++)
+		{
+			ring[n].hash = ringHash(name, j + 1);
+			ring[n].port = clusterNodes[i];
+			n++;
+		}
 	}
-	newRoom->next = roomList.head;
-	roomList.head = newRoom;
-	
-	const char * msg = "OK\r\n";
-        write(fd, msg, strlen(msg));
-        return;
+	qsort(ring, ringCount, sizeof(RingPoint), compareRingPoints);
 }
 
+// Port of the node a room belongs to
+int
+IRCServer::nodeOf(const char * roomName)
+{
+	unsigned long long h = ringHash(roomName, 0);
+	int lo = 0;
+	int hi = ringCount;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (ring[mid].hash < h)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return ring[lo < ringCount ? lo : 0].port;
+}
 
-void
-IRCServer::listRooms(int fd, const char * user, const char * password,const  char * args)
+// Port of the node that owns the room command is about, or 0 if it is
+// this one, if the command is not about a room or if there is no
+// cluster
+int
+IRCServer::roomOwner(int command, const char * args)
 {
-	
+	if (ringCount == 0)
+	{
+		return 0;
+	}
+	const char * name = args;
+	int length;
+	switch (command)
+	{
+	case CreateRoomCommand:
+	case EnterRoomCommand:
+	case LeaveRoomCommand:
+		length = strlen(args);
+		break;
+	case GetMessagesCommand: {
+		// args is "<LAST-MESSAGE-NUM> <ROOM>"
+		const char * space = strchr(args, ' ');
+		name = space != NULL ? space + 1 : "";
+		length = strlen(name);
+		break;
+	}
+	case SendMessageCommand:
+	case GetUsersInRoomCommand:
+	case SearchMessagesCommand:
+		// The room comes first
+		length = strcspn(args, " ");
+		break;
+	default:
+		return 0;
+	}
+	char roomName[MaxCommandLine + 1];
+	if (length > MaxCommandLine)
+	{
+		return 0;
+	}
+	memcpy(roomName, name, length);
+	roomName[length] = '\0';
+	int port = nodeOf(roomName);
+	return port == serverPort ? 0 : port;
 }
@@ -2,56 +2,486 @@
 #ifndef IRC_SERVER
 #define IRC_SERVER
 
+#include <string>
+#include <pthread.h>
+#include <linux/time_types.h>
+
+#include "BTreeVoid.h"
+#include "HashTableVoid.h"
+#include "PerfectHash.h"
+#include "Task.h"
+#include "TimerWheel.h"
+
+class IoUring;
+class EventLoop;
+
 #define PASSWORD_FILE "password.txt"
+// Users of the password file, saved by HashTableVoid::save the first time
+// the file is read and mapped instead of it while the file is unchanged
+#define PASSWORD_IMAGE "password.img"
+// Where older messages go, in a file that is deleted on exit
+#define HISTORY_DIR "history"
+// Ports of the nodes of the cluster on this host, one a line. A server
+// whose port is not there runs alone.
+#define CLUSTER_FILE "cluster.txt"
 
 class IRCServer {
+public:
+	// How connections are accepted, read and answered
+	enum Backend { BlockingBackend, UringBackend, EpollBackend };
+
+	enum { MaxCommandLine = 1024 };
+
+	// Most commands run by a single BATCH
+	enum { MaxBatchCommands = 16 };
+
+	// First byte of a binary request, which no text command starts with
+	enum { BinaryFrameMagic = 0xB1 };
+
+private:
 	// Add any variables you need
+	struct Person;
+
+	// Serialized "USER\r\n" lines answered by GET-ALL-USERS and
+	// GET-USERS-IN-ROOM, followed by the final "\r\n". Once published a
+	// roster does not change: another one is built after the names it
+	// holds change.
+	struct Roster {
+		char * data;
+		int length;
+		// Start of every line, plus the end of the last one
+		int * lines;
+		int count;
+		int max;
+		int lineMax;
+	};
+	typedef struct Roster Roster;
+
+	// What the readers that take no lock see of a room: its name and
+	// its published roster, or NULL until one is built
+	struct RoomSnapshot {
+		Roster * roster;
+		char roomName[1];
+	};
+	typedef struct RoomSnapshot RoomSnapshot;
+
+	// The rooms there are, sorted by name
+	struct RoomTable {
+		int count;
+		RoomSnapshot * rooms[1];
+	};
+	typedef struct RoomTable RoomTable;
+
+	// Every user, with the password of each line of names
+	struct UserDirectory {
+		Roster names;
+		const char ** passwords;
+	};
+	typedef struct UserDirectory UserDirectory;
+
+	// Snapshot no longer published, freed by release once every reader
+	// has started after epoch
+	struct RetiredSnapshot {
+		void * data;
+		void (*release)(void * data);
+		unsigned long long epoch;
+		RetiredSnapshot * next;
+	};
+	typedef struct RetiredSnapshot RetiredSnapshot;
+
+	// Threads that may read snapshots at the same time
+	enum { MaxSnapshotReaders = 16 };
+
+	// Block of the message history of a room, holding packed records:
+	// varint message number, varint sender id, varint text length and
+	// the text. A record never spans two segments.
+	struct MessageSegment {
+		MessageSegment * next;
+		int firstMessNum;
+		int length;
+		int capacity;
+		char data[1];
+	};
+	typedef struct MessageSegment MessageSegment;
+
+	enum { MessageSegmentSize = 64 * 1024 };
+
+	// Messages of a room moved to the history file, as the lines that
+	// GET-MESSAGES answers. marks[i] is the offset, from the start of the
+	// extent, of message firstMessNum + i * HistoryMarkInterval.
+	struct HistoryExtent {
+		int firstMessNum;
+		int count;
+		long long offset;
+		long long length;
+		unsigned * marks;
+	};
+	typedef struct HistoryExtent HistoryExtent;
+
+	// Segments of a room kept in memory before the oldest one is moved
+	// to the history file
+	enum { HistoryMarkInterval = 64, HistoryMemorySegments = 4 };
+
+	// Numbers of the messages of a room holding a term, increasing and
+	// stored as varint gaps. The terms of a room are linked together.
+	struct Postings {
+		Postings * next;
+		int count;
+		int last;
+		int length;
+		int capacity;
+		unsigned char * data;
+		char term[1];
+	};
+	typedef struct Postings Postings;
+
+	enum { MaxTermLength = 64, MaxSearchResults = 100 };
+
 	struct Room {
                 const char * roomName;
                 int messCount;
-                Room * next;
+                // History, oldest segment first
+                MessageSegment * firstSegment;
+                MessageSegment * lastSegment;
+                int memorySegments;
+                // Older history in the history file, oldest first
+                HistoryExtent * extents;
+                int extentCount;
+                int extentMax;
+                // Terms of the search index
+                Postings * terms;
+                // Members sorted by user name
+                struct Person ** members;
+                int memberCount;
+                int memberMax;
+                RoomSnapshot * snapshot;
+                // Skip list links, level entries long
+                int level;
+                Room * next[1];
         };
 	typedef struct Room Room;
 
-	struct LLRooms {
-                Room * head;          
+	enum { MaxRoomLevel = 16 };
+
+	// Rooms kept sorted by name in a skip list
+	struct RoomIndex {
+                Room * head[MaxRoomLevel];
+                int level;
+                int count;
         };
-        typedef struct LLRooms LLRooms;
+        typedef struct RoomIndex RoomIndex;
+
+	// Entry of the list of rooms a user is in
+	struct RoomRef {
+		Room * room;
+		// First message of the room the user has not read
+		int readCursor;
+		RoomRef * next;
+	};
+	typedef struct RoomRef RoomRef;
+
+	// Immutable reply line shared by every subscriber queue holding it.
+	// It is freed when the last queue releases it.
+	struct Payload {
+		int refCount;
+		int length;
+		char data[1];
+	};
+	typedef struct Payload Payload;
+
+	enum { SubscriberQueueLength = 256 };
+
+	// Connection kept open by SUBSCRIBE to receive the messages of the
+	// rooms its user is in, or by FOLLOW, with no person, to receive the
+	// changes to the state
+	struct Subscriber {
+		int fd;
+		struct Person * person;
+		Payload * queue[SubscriberQueueLength];
+		int queueHead;
+		int queueCount;
+		// Bytes of queue[queueHead] already written
+		int offset;
+		// Next connection of the same user
+		Subscriber * next;
+		// Next connection of the server, or next follower
+		Subscriber * nextAll;
+		// Whether the follower is another node of the cluster, which
+		// only gets the users added here
+		bool peer;
+	};
+	typedef struct Subscriber Subscriber;
+
+	// Records received from the primary, in data from start on
+	struct RecordReader {
+		int fd;
+		std::string data;
+		size_t start;
+	};
+	typedef struct RecordReader RecordReader;
+
+	// Most nodes of a cluster, and points each one has on the ring
+	enum { MaxClusterNodes = 64, ClusterPoints = 64 };
+
+	// A room belongs to the node of the first point of the ring at or
+	// after the hash of its name
+	struct RingPoint {
+		unsigned long long hash;
+		int port;
+	};
+	typedef struct RingPoint RingPoint;
+
+	// Another node of the cluster, and the users it sends, read by a
+	// thread of its own
+	struct Peer {
+		IRCServer * server;
+		int port;
+		RecordReader stream;
+		Peer * next;
+	};
+	typedef struct Peer Peer;
 
 	struct Person {
 		const char * password;
 		const char * username;
 		const char * args;
-		Room * roomIn;
-		struct Person * next;
+		// Position in usersById, which message records refer to
+		int id;
+		RoomRef * roomIn;
+		Subscriber * subs;
 	};
 	typedef struct Person Person;
 
-	struct LLUsers {
-		Person * head;
+	// Requests a client may still send, refilled over time
+	struct TokenBucket {
+		double tokens;
+		double stamp;
 	};
-	typedef struct LLUsers LLUsers;
+	typedef struct TokenBucket TokenBucket;
 
-	struct Message {
-		const char * message;
-		const char * room;
-		int messNum;
-		Person * messFrom;
-		Message * next;
+	// Connection of the io_uring or epoll backend whose command line is
+	// being received or whose answer is being sent
+	struct Connection {
+		int fd;
+		char commandLine[MaxCommandLine + 1];
+		int commandLineLength;
+		unsigned char prevChar;
+		std::string answer;
+		// Deadline of the epoll backend, which shuts the socket down
+		Timer deadline;
+		bool timedOut;
+		// When the line must be complete, and the time left for the
+		// current receive of the io_uring backend
+		unsigned long long readDeadline;
+		struct __kernel_timespec readTimeout;
 	};
-	typedef struct Message Message;
-	
-	struct LLMessage {
-		Message * head;
+	typedef struct Connection Connection;
+
+	// Slice of the password file parsed by one loader thread
+	struct LoadChunk {
+		char * begin;
+		char * end;
+		Person * people;
+		int count;
 	};
-	typedef struct LLMessage LLMessage;
+	typedef struct LoadChunk LoadChunk;
 
 private:
 	int open_server_socket(int port);
-	LLUsers userList;
-	LLMessage messList;
-	LLRooms roomList;
+	void open_upgrade_socket(int port);
+	bool takeOver(int port);
+	void handOff();
+	void writeSnapshot(std::string * out, int * fds);
+	bool readSnapshot(char * data, long length, int * fds, int fdCount);
+	void resetState();
+	void loadPasswordFile(const char * path);
+	bool loadUserImage(const char * path, struct stat * passwords);
+	void saveUserImage(const char * path);
+	static void * parsePasswordChunk(void * arg);
+	static int comparePersonName(const void * a, const void * b);
+	Person * findUser(const char * user);
+	void indexUsers();
+	Room * findRoom(const char * roomName);
+	Room * lowerBoundRoom(const char * roomName, Room ** update);
+	Room * insertRoom(const char * roomName);
+	int findMember(Room * room, const char * user, bool * found);
+	void registerUser(Person * e);
+	void appendMessage(Room * room, int messNum, Person * from, const char * text, int length);
+	MessageSegment * newMessageSegment(Room * room, int capacity);
+	static const char * decodeMessage(const char * p, int * messNum, int * from, const char ** text, int * length);
+	void appendMessageLine(std::string * out, int messNum, int from, const char * text, int length);
+	bool openHistoryFile();
+	void spillSegment(Room * room);
+	HistoryExtent * addExtent(Room * room);
+	void replyHistory(int fd, Room * room, int first);
+	void replyMessages(int fd, Room * room, int first);
+	static RoomRef * findRoomRef(Person * e, Room * room);
+	bool readHistoryChunk(HistoryExtent * e, int messNum, std::string * chunk, long long * start, size_t * at);
+	void appendMessageLines(Room * room, const unsigned * nums, int count, std::string * out);
+	Postings * findPostings(Room * room, const char * term, bool create);
+	static int termKeys(Room * room, const char * text, int length, std::string * buffer, const char ** keys, int max);
+	void indexMessage(Room * room, int messNum, const char * text, int length);
+	static void addPosting(Postings * p, int messNum);
+	static void decodePostings(Postings * p, unsigned * out);
+	static int intersectPostings(const unsigned * a, int na, const unsigned * b, int nb, unsigned * out);
+	void replyFile(int fd, int file, long long offset, long long length);
+	static Payload * newPayload(int length);
+	static void releasePayload(Payload * p);
+	static void initRoster(Roster * r);
+	static void appendRoster(Roster * r, const char * name);
+	static void finishRoster(Roster * r);
+	static int lowerBoundRoster(Roster * r, const char * name);
+	static void pageRoster(Roster * r, const char * args, int * first, int * last);
+	void sendRoster(int fd, Roster * r, const char * args);
+	static void appendPage(Roster * r, int first, int last, std::string * out);
+	static void freeRoster(void * data);
+	static void freeDirectory(void * data);
+	int enterSnapshot();
+	void leaveSnapshot(int slot);
+	void retireSnapshot(void ** published, void (*release)(void * data));
+	void reclaimSnapshots();
+	Roster * roomRoster(Room * r);
+	void publishRoomTable();
+	UserDirectory * publishDirectory();
+	bool checkSnapshotPassword(const char * user, const char * password);
+	bool answerFromSnapshot(int command, const char * user, const char * password, const char * args, std::string * out);
+	static bool takeToken(HashTableVoid * table, const char * key, double rate, double burst, double t);
+	void sweepBuckets(HashTableVoid * table, double rate, double burst, double t);
+	bool checkRateLimit(int fd);
+	bool checkUserRate(const char * user);
+	bool serveRequest(int fd, int command, const char * user, const char * password, const char * args);
+	bool admitConnection();
+	bool dispatchRequest(int fd, const char * commandLine);
+	static bool isFrame(const char * data, int length);
+	static bool frameComplete(const char * data, int length);
+	bool dispatchFrame(int fd, const char * frame, int length);
+	static bool frameFieldsValid(int command, const char * user, const char * password, const char * args);
+	bool runRequest(int fd, int command, const char * user, const char * password, const char * args);
+	void reply(int fd, const void * data, int length);
+	bool runUringServer();
+	bool readCommandLine(Connection * c, const char * data, int length);
+	bool runCommand(Connection * c);
+	bool finishConnection(IoUring * ring, Connection * c);
+	void armRecv(IoUring * ring, Connection * c);
+	static void connectionTimeout(void * arg);
+	bool runEventLoopServer();
+	Task acceptConnections(EventLoop * loop);
+	Task serveConnection(EventLoop * loop, int fd);
+	void broadcast(Room * room, Payload * p);
+	void enqueue(Subscriber * s, Payload * p);
+	bool flushSubscriber(Subscriber * s);
+	void flushSubscribers();
+	int flushTimeoutMs();
+	void dropSubscriber(Subscriber * s);
+	Subscriber * addSubscriber(int fd, Person * e);
+	Person * addPerson(const char * user, const char * password);
+	Room * addRoom(const char * roomName);
+	void addMember(Room * r, Person * e);
+	bool insertMember(Room * r, Person * e);
+	void removeMember(Room * r, int i);
+	void postMessage(Room * r, Person * from, const char * text);
+	int storeMessage(Room * r, Person * from, const char * text);
+	void replicate(char type, const char * a, const char * b = NULL, const char * c = NULL);
+	void sendFollowers(const std::string & records, bool toPeers);
+	void writeFollowerState(std::string * out);
+	void writeUsers(std::string * out);
+	void writeRoom(std::string * out, Room * r);
+	static int connectLocal(int port, const char * request, int timeoutMs, bool * refused);
+	bool connectPrimary(bool * refused);
+	bool readBootstrap(RecordReader * in, bool peer);
+	static bool readRecord(RecordReader * in, const char ** body, unsigned * length);
+	bool applyRecord(const char * body, unsigned length, bool peer, std::string * rooms);
+	static void * followPrimary(void * arg);
+	void removeRoom(Room * r);
+	void joinCluster();
+	bool joinNode(Peer * p, bool * gone);
+	void startPeer(Peer * p);
+	static void * followPeer(void * arg);
+	bool isNode(int port);
+	void addNode(int port);
+	void removeNode(int port);
+	void buildRing();
+	static int compareRingPoints(const void * a, const void * b);
+	int nodeOf(const char * roomName);
+	int roomOwner(int command, const char * args);
+	Task awaitUpgrade(EventLoop * loop);
+	// Users by name, in order, for GET-ALL-USERS. A name added again
+	// keeps its first user.
+	BTreeVoid userIndex;
+	// Published snapshots of the users and of the rooms, or NULL until
+	// they are built again after a change. Only changed with the lock
+	// held, and read without it.
+	UserDirectory * directory;
+	RoomTable * roomTable;
+	// Epoch of every snapshot reader since it started reading, or 0,
+	// and the snapshots waiting for the readers that may hold them
+	unsigned long long snapshotEpoch;
+	unsigned long long readerEpochs[MaxSnapshotReaders];
+	int snapshotReaders;
+	RetiredSnapshot * retiredSnapshots;
+	// Every user by id
+	Person ** usersById;
+	int userCount;
+	int userIdMax;
+	// Users by name: those there were at startup in a perfect hash, and
+	// those added since
+	PerfectHash provisionedUsers;
+	HashTableVoid addedUsers;
+	// Image the users of the password file were loaded from, which their
+	// names and passwords point into
+	HashTableVoid userImage;
+	// File holding the older history of every room, or -1, and its size
+	int historyFile;
+	long long historyLength;
+	RoomIndex roomIndex;
+	unsigned int roomSeed;
+	Subscriber * subscriberList;
+	// Connections of the servers following this one
+	Subscriber * followerList;
+	int pendingSubscribers;
+	// Port of the primary on this host while this server follows it,
+	// taking no changes of its own, or 0
+	int primaryPort;
+	RecordReader * primary;
+	// Held while a request runs, and while a follower applies a record
+	pthread_mutex_t stateLock;
+	// Nodes of the cluster this server is in, itself included, and
+	// their points sorted by hash. There is no cluster while there are
+	// no nodes.
+	int clusterNodes[MaxClusterNodes];
+	int clusterNodeCount;
+	RingPoint * ring;
+	int ringCount;
+	// Nodes whose users a thread reads
+	Peer * peers;
+	// Whether the record being applied comes from another node, so it
+	// is not sent back to the nodes
+	bool applyingPeer;
 	int messCount;
+	int masterSocket;
+	// Port served, and the local socket a new server connects to in
+	// order to take over from this one
+	int serverPort;
+	int upgradeSocket;
+	// Connection of the server taking over, or -1. Once it is set no
+	// new connections are accepted, and the state is handed over as
+	// soon as activeConnections drops to 0.
+	int upgradeConnection;
+	int activeConnections;
+	HashTableVoid userBuckets;
+	HashTableVoid addressBuckets;
+	// Postings by "<ROOM> <TERM>"
+	HashTableVoid searchIndex;
+	double cpuLoad;
+	double cpuSampleWall;
+	double bucketSweepWall;
+	double cpuSampleUsed;
+	// Where reply() collects the answer, or NULL to write it right away
+	std::string * replyCapture;
+	// Whether a BATCH is running, and its user once its password was
+	// checked, so that the rest of its commands skip the check
+	bool batching;
+	Person * batchUser;
 
 public:
 	void initialize();
@@ -66,9 +496,15 @@ public:
 	void getAllUsers(int fd, const char * user, const char * password, const char * args);
 	void createRoom(int fd, const char * user, const char * password, const char * args);
 	void listRooms(int fd, const char * user, const char * password, const char * args);
+	void searchMessages(int fd, const char * user, const char * password, const char * args);
+	void sync(int fd, const char * user, const char * password, const char * args);
+	bool subscribe(int fd, const char * user, const char * password, const char * args);
+	void batch(int fd, const char * user, const char * password, const char * args);
+	bool follow(int fd, const char * user, const char * password, const char * args);
+	bool join(int fd, const char * user, const char * password, const char * args);
 	bool checkRoom(int fd, const char * user, const char * password, const char * roomName);
 	bool checkUserInRoom(int fd, const char * user, const char * password, const char * args);
-	void runServer(int port);
+	void runServer(int port, Backend backend = BlockingBackend, int primaryPort = 0);
 };
 
 #endif
@@ -0,0 +1,429 @@
+
+//
+// Tests of IRCServer that run the server
+//
+// Each test starts the servers it needs from ./IRCServer, in a directory
+// of its own under /tmp, and talks to them over loopback.
+//
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Server binary, found before moving to the directory of the test
+char server[PATH_MAX];
+
+// First port of the test, away from those of other runs
+int basePort;
+
+void
+enterTestDirectory()
+{
+  assert(realpath("IRCServer", server) != NULL);
+  char dir[] = "/tmp/IRCServerTestXXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  assert(chdir(dir) == 0);
+  basePort = 20000 + getpid() % 20000;
+}
+
+void
+leaveTestDirectory()
+{
+  char dir[PATH_MAX];
+  assert(getcwd(dir, sizeof(dir)) != NULL);
+  assert(chdir("/") == 0);
+  char command[PATH_MAX + 16];
+  snprintf(command, sizeof(command), "rm -rf %s", dir);
+  system(command);
+}
+
+int
+connectTo(int port)
+{
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  int fd = socket(PF_INET, SOCK_STREAM, 0);
+  assert(fd >= 0);
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Sends request, of length bytes, and reads the answer until the server
+// closes the connection. Returns the length of the answer, or -1 if the
+// server could not be reached.
+int
+request(int port, const char * request, int length, char * answer, int max)
+{
+  int fd = connectTo(port);
+  if (fd < 0) {
+    return -1;
+  }
+  assert(write(fd, request, length) == length);
+  int n;
+  int total = 0;
+  while (total < max - 1 && (n = read(fd, answer + total, max - 1 - total)) > 0) {
+    total += n;
+  }
+  answer[total] = '\0';
+  close(fd);
+  return total;
+}
+
+// Sends a text request and returns its answer
+const char *
+ask(int port, const char * line)
+{
+  static char answer[65536];
+  char text[2048];
+  int length = snprintf(text, sizeof(text), "%s\r\n", line);
+  if (request(port, text, length, answer, sizeof(answer)) < 0) {
+    return NULL;
+  }
+  return answer;
+}
+
+// Starts a server on port with the given backend, following the one on
+// primary if it is not 0, and waits until it answers
+int
+startServer(int port, const char * backend, int primary = 0)
+{
+  char portText[16];
+  snprintf(portText, sizeof(portText), "%d", port);
+  char primaryText[16];
+  snprintf(primaryText, sizeof(primaryText), "%d", primary);
+  int pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    if (primary != 0) {
+      execl(server, "IRCServer", portText, backend, "1024", primaryText, (char *) NULL);
+    }
+    else {
+      execl(server, "IRCServer", portText, backend, (char *) NULL);
+    }
+    _exit(127);
+  }
+  for (int i = 0; i < 100; i++) {
+    int fd = connectTo(port);
+    if (fd >= 0) {
+      close(fd);
+      return pid;
+    }
+    usleep(50000);
+  }
+  assert(!"server did not start");
+  return -1;
+}
+
+void
+stopServer(int pid)
+{
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+}
+
+// Sends SUBSCRIBE for user and returns the connection, after its OK
+int
+subscribe(int port, const char * user)
+{
+  int fd = connectTo(port);
+  assert(fd >= 0);
+  char line[256];
+  int length = snprintf(line, sizeof(line), "SUBSCRIBE %s pw\r\n", user);
+  assert(write(fd, line, length) == length);
+  char ok[4];
+  int n = 0;
+  while (n < 4) {
+    int r = read(fd, ok + n, 4 - n);
+    assert(r > 0);
+    n += r;
+  }
+  assert(!memcmp(ok, "OK\r\n", 4));
+  return fd;
+}
+
+// Whether anything comes on fd within ms
+bool
+receives(int fd, int ms)
+{
+  struct pollfd p;
+  p.fd = fd;
+  p.events = POLLIN;
+  return poll(&p, 1, ms) > 0;
+}
+
+// Opcodes of the binary requests
+enum { AddUserOp = 0, EnterRoomOp = 1, SendMessageOp = 3, CreateRoomOp = 7 };
+
+char *
+putVarint(char * p, unsigned v)
+{
+  while (v >= 0x80) {
+    *p++ = (char)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (char)v;
+  return p;
+}
+
+// Sends a binary request and returns its answer, without its length
+const char *
+askFrame(int port, int opcode, const char * user, const char * password, const char * args)
+{
+  const char * fields[3] = { user, password, args };
+  char body[2048];
+  char * p = body;
+  *p++ = (char)opcode;
+  for (int i = 0; i < 3; i++) {
+    int n = strlen(fields[i]);
+    p = putVarint(p, n);
+    memcpy(p, fields[i], n);
+    p += n;
+  }
+  char frame[2048 + 8];
+  frame[0] = (char)0xB1;
+  char * q = putVarint(frame + 1, p - body);
+  memcpy(q, body, p - body);
+  q += p - body;
+
+  static char answer[65536];
+  int length = request(port, frame, q - frame, answer, sizeof(answer));
+  assert(length > 0);
+  // Answers here are shorter than 128 bytes, so their length is a byte
+  assert((unsigned char)answer[0] == length - 1);
+  return answer + 1;
+}
+
+const char * BadFrame = "ERROR (Bad frame)\r\n";
+
+void test1()
+{
+  // Rooms that move to a node when it joins another one are not sent to
+  // the subscribers of either node as new messages, and reach the
+  // followers of the node once
+  enterTestDirectory();
+  int a = basePort;
+  int b = basePort + 1;
+  FILE * f = fopen("cluster.txt", "w");
+  fprintf(f, "%d\n%d\n", a, b);
+  fclose(f);
+  const int Users = 10;
+  f = fopen("password.txt", "w");
+  for (int u = 0; u < Users; u++) {
+    fprintf(f, "u%d:pw\n", u);
+  }
+  fclose(f);
+
+  // B alone has every room, each one with a member and a message
+  int pidB = startServer(b, "epoll");
+  const int Rooms = 40;
+  char line[256];
+  for (int i = 0; i < Rooms; i++) {
+    snprintf(line, sizeof(line), "CREATE-ROOM u%d pw room%d", i % Users, i);
+    assert(!strcmp(ask(b, line), "OK\r\n"));
+    snprintf(line, sizeof(line), "ENTER-ROOM u%d pw room%d", i % Users, i);
+    assert(!strcmp(ask(b, line), "OK\r\n"));
+    snprintf(line, sizeof(line), "SEND-MESSAGE u%d pw room%d old %d", i % Users, i, i);
+    assert(!strcmp(ask(b, line), "OK\r\n"));
+  }
+  int subsB[Users];
+  for (int u = 0; u < Users; u++) {
+    snprintf(line, sizeof(line), "u%d", u);
+    subsB[u] = subscribe(b, line);
+  }
+
+  // A starts while B does not answer, so it serves before joining B,
+  // with subscribers of its own
+  kill(pidB, SIGSTOP);
+  int pidA = startServer(a, "epoll");
+  int subsA[Users];
+  for (int u = 0; u < Users; u++) {
+    snprintf(line, sizeof(line), "u%d", u);
+    subsA[u] = subscribe(a, line);
+  }
+  int pidF = startServer(basePort + 2, "epoll", a);
+  kill(pidB, SIGCONT);
+
+  // Wait for the rooms of A to move to it
+  const char * rooms = "\r\n";
+  for (int i = 0; i < 100 && !strcmp(rooms, "\r\n"); i++) {
+    usleep(100000);
+    rooms = ask(a, "LIST-ROOMS u0 pw");
+  }
+  assert(strcmp(rooms, "\r\n") != 0);
+  char moved[64];
+  sscanf(rooms, "%63s", moved);
+  int room = atoi(moved + 4);
+  snprintf(line, sizeof(line), "GET-MESSAGES u%d pw 0 %s", room % Users, moved);
+  char expected[256];
+  snprintf(expected, sizeof(expected), "0 u%d old %d\r\n\r\n", room % Users, room);
+  assert(!strcmp(ask(a, line), expected));
+  assert(!strcmp(ask(basePort + 2, line), expected));
+
+  for (int u = 0; u < Users; u++) {
+    assert(!receives(subsA[u], 300));
+    assert(!receives(subsB[u], 0));
+  }
+
+  // Messages sent from now on do go out
+  snprintf(line, sizeof(line), "SEND-MESSAGE u%d pw %s new", room % Users, moved);
+  assert(!strcmp(ask(a, line), "OK\r\n"));
+  assert(receives(subsA[room % Users], 1000));
+
+  for (int u = 0; u < Users; u++) {
+    close(subsA[u]);
+    close(subsB[u]);
+  }
+  stopServer(pidF);
+  stopServer(pidA);
+  stopServer(pidB);
+  leaveTestDirectory();
+  printf("Test1 passed\n");
+}
+
+void test2()
+{
+  // A binary request cannot put a space, CR or LF in a user name
+  enterTestDirectory();
+  int pid = startServer(basePort, "epoll");
+  assert(!strcmp(askFrame(basePort, AddUserOp, "al", "pw", ""), "OK\r\n"));
+  assert(!strcmp(askFrame(basePort, AddUserOp, "bo b", "pw", ""), BadFrame));
+  assert(!strcmp(askFrame(basePort, AddUserOp, "cy\r\nzz", "pw", ""), BadFrame));
+  assert(!strcmp(askFrame(basePort, AddUserOp, "dd\n", "pw", ""), BadFrame));
+  assert(!strcmp(ask(basePort, "GET-ALL-USERS al pw"), "al\r\n\r\n"));
+  stopServer(pid);
+  leaveTestDirectory();
+  printf("Test2 passed\n");
+}
+
+void test3()
+{
+  // Nor in a password
+  enterTestDirectory();
+  int pid = startServer(basePort, "epoll");
+  assert(!strcmp(askFrame(basePort, AddUserOp, "al", "pw", ""), "OK\r\n"));
+  assert(!strcmp(askFrame(basePort, AddUserOp, "bo", "p w", ""), BadFrame));
+  assert(!strcmp(askFrame(basePort, AddUserOp, "cy", "pw\r", ""), BadFrame));
+  assert(!strcmp(askFrame(basePort, AddUserOp, "dd", "\npw", ""), BadFrame));
+  assert(!strcmp(ask(basePort, "GET-ALL-USERS al pw"), "al\r\n\r\n"));
+  stopServer(pid);
+  leaveTestDirectory();
+  printf("Test3 passed\n");
+}
+
+void test4()
+{
+  // Nor in the name of a room
+  enterTestDirectory();
+  int pid = startServer(basePort, "epoll");
+  assert(!strcmp(askFrame(basePort, AddUserOp, "al", "pw", ""), "OK\r\n"));
+  assert(!strcmp(askFrame(basePort, CreateRoomOp, "al", "pw", "lobby"), "OK\r\n"));
+  assert(!strcmp(askFrame(basePort, CreateRoomOp, "al", "pw", "two words"), BadFrame));
+  assert(!strcmp(askFrame(basePort, CreateRoomOp, "al", "pw", "fake\r\nroom"), BadFrame));
+  assert(!strcmp(askFrame(basePort, EnterRoomOp, "al", "pw", "lobby x"), BadFrame));
+  assert(!strcmp(askFrame(basePort, EnterRoomOp, "al", "pw", "lobby\n"), BadFrame));
+  assert(!strcmp(ask(basePort, "LIST-ROOMS al pw"), "lobby\r\n\r\n"));
+  assert(!strcmp(ask(basePort, "GET-USERS-IN-ROOM al pw lobby"), "\r\n"));
+  stopServer(pid);
+  leaveTestDirectory();
+  printf("Test4 passed\n");
+}
+
+void test5()
+{
+  // A message may have spaces, but no CR or LF, which would add lines to
+  // the answers of GET-MESSAGES
+  enterTestDirectory();
+  int pid = startServer(basePort, "epoll");
+  assert(!strcmp(askFrame(basePort, AddUserOp, "al", "pw", ""), "OK\r\n"));
+  assert(!strcmp(askFrame(basePort, CreateRoomOp, "al", "pw", "lobby"), "OK\r\n"));
+  assert(!strcmp(askFrame(basePort, EnterRoomOp, "al", "pw", "lobby"), "OK\r\n"));
+  assert(!strcmp(askFrame(basePort, SendMessageOp, "al", "pw", "lobby hi there"), "OK\r\n"));
+  assert(!strcmp(askFrame(basePort, SendMessageOp, "al", "pw", "lobby hi\r\n1 bo forged"), BadFrame));
+  assert(!strcmp(askFrame(basePort, SendMessageOp, "al", "pw", "lobby hi\r"), BadFrame));
+  assert(!strcmp(askFrame(basePort, SendMessageOp, "al", "pw", "lobby \nhi"), BadFrame));
+  assert(!strcmp(ask(basePort, "GET-MESSAGES al pw 0 lobby"), "0 al hi there\r\n\r\n"));
+  stopServer(pid);
+  leaveTestDirectory();
+  printf("Test5 passed\n");
+}
+
+void test6()
+{
+  // A name added again keeps its first user, and adds nothing to the
+  // server or to its followers
+  enterTestDirectory();
+  int pid = startServer(basePort, "epoll");
+  int followerPid = startServer(basePort + 1, "epoll", basePort);
+  assert(!strcmp(ask(basePort, "ADD-USER al pw"), "OK\r\n"));
+  for (int i = 0; i < 10; i++) {
+    assert(!strcmp(ask(basePort, "ADD-USER al other"), "DENIED (User exists)\r\n"));
+  }
+  assert(!strcmp(ask(basePort, "ADD-USER al pw"), "OK\r\n"));
+  assert(!strcmp(ask(basePort, "GET-ALL-USERS al other"), "ERROR (Wrong password)\r\n"));
+  assert(!strcmp(ask(basePort, "GET-ALL-USERS al pw"), "al\r\n\r\n"));
+  usleep(200000);
+  assert(!strcmp(ask(basePort + 1, "GET-ALL-USERS al pw"), "al\r\n\r\n"));
+  stopServer(followerPid);
+  stopServer(pid);
+  leaveTestDirectory();
+  printf("Test6 passed\n");
+}
+
+void
+usage()
+{
+  // Print usage
+  fprintf(stderr, "IRCServerTest test1|test2|test3|test4|test5|test6\n");
+}
+
+int
+main( int argc, char **argv)
+{
+  if (argc == 1) {
+    usage();
+    exit(1);
+  }
+
+  if ( !strcmp(argv[1], "test1")) {
+    test1();
+  }
+  else if ( !strcmp(argv[1], "test2")) {
+    test2();
+  }
+  else if ( !strcmp(argv[1], "test3")) {
+    test3();
+  }
+  else if ( !strcmp(argv[1], "test4")) {
+    test4();
+  }
+  else if ( !strcmp(argv[1], "test5")) {
+    test5();
+  }
+  else if ( !strcmp(argv[1], "test6")) {
+    test6();
+  }
+  else {
+    usage();
+    exit(1);
+  }
+
+  exit(0);
+}
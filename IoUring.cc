@@ -0,0 +1,313 @@
+
+//
+// Implementation of the io_uring ring used by the IRC server
+//
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+#include "IoUring.h"
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params * p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int
+io_uring_register(int fd, unsigned opcode, void * arg, unsigned count)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+IoUring::IoUring()
+{
+	_ringFd = -1;
+	_sqRing = MAP_FAILED;
+	_cqRing = MAP_FAILED;
+	_sqes = (struct io_uring_sqe *)MAP_FAILED;
+	_bufRing = (struct io_uring_buf_ring *)MAP_FAILED;
+	_bufBase = NULL;
+}
+
+IoUring::~IoUring()
+{
+	if (_bufRing != MAP_FAILED)
+	{
+		munmap(_bufRing, _bufRingSize);
+	}
+	delete [] _bufBase;
+	if (_sqes != MAP_FAILED)
+	{
+		munmap(_sqes, _sqesSize);
+	}
+	if (_cqRing != MAP_FAILED && _cqRing != _sqRing)
+	{
+		munmap(_cqRing, _cqRingSize);
+	}
+	if (_sqRing != MAP_FAILED)
+	{
+		munmap(_sqRing, _sqRingSize);
+	}
+	if (_ringFd >= 0)
+	{
+		close(_ringFd);
+	}
+}
+
+// Creates the ring and maps its queues
+bool
+IoUring::init(unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	_ringFd = io_uring_setup(entries, &p);
+	if (_ringFd < 0)
+	{
+		return false;
+	}
+
+	_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (_cqRingSize > _sqRingSize)
+		{
+			_sqRingSize = _cqRingSize;
+		}
+		_cqRingSize = _sqRingSize;
+	}
+	_sqRing = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQ_RING);
+	if (_sqRing == MAP_FAILED)
+	{
+		return false;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		_cqRing = _sqRing;
+	}
+	else
+	{
+		_cqRing = mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_CQ_RING);
+		if (_cqRing == MAP_FAILED)
+		{
+			return false;
+		}
+	}
+	_sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	_sqes = (struct io_uring_sqe *)mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE,
+					    MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQES);
+	if (_sqes == MAP_FAILED)
+	{
+		return false;
+	}
+
+	char * sq = (char *)_sqRing;
+	_sqHead = (unsigned *)(sq + p.sq_off.head);
+	_sqTail = (unsigned *)(sq + p.sq_off.tail);
+	_sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	_sqEntries = p.sq_entries;
+	_sqArray = (unsigned *)(sq + p.sq_off.array);
+	_sqLocalTail = *_sqTail;
+	_sqPending = 0;
+
+	char * cq = (char *)_cqRing;
+	_cqHead = (unsigned *)(cq + p.cq_off.head);
+	_cqTail = (unsigned *)(cq + p.cq_off.tail);
+	_cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return true;
+}
+
+// Registers a ring of count provided buffers. count must be a power of 2.
+bool
+IoUring::initBuffers(int group, int count, int size)
+{
+	_bufRingSize = count * sizeof(struct io_uring_buf);
+	_bufRing = (struct io_uring_buf_ring *)mmap(NULL, _bufRingSize, PROT_READ | PROT_WRITE,
+						    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (_bufRing == MAP_FAILED)
+	{
+		return false;
+	}
+
+	// Fault the ring in before the kernel pins it
+	memset(_bufRing, 0, _bufRingSize);
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)_bufRing;
+	reg.ring_entries = count;
+	reg.bgid = group;
+	if (io_uring_register(_ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	{
+		return false;
+	}
+
+	_bufBase = new char[(size_t)count * size];
+	_bufCount = count;
+	_bufSize = size;
+	_bufGroup = group;
+	_bufTail = 0;
+	for (int i = 0; i < count; i++)
+	{
+		recycleBuffer(i);
+	}
+	return true;
+}
+
+char *
+IoUring::buffer(int id)
+{
+	return _bufBase + (size_t)id * _bufSize;
+}
+
+void
+IoUring::recycleBuffer(int id)
+{
+	// The entries start at the beginning of the ring, where tail overlays
+	// the reserved field of the first one. bufs[] cannot be used from C++
+	// since the kernel header pads it behind an empty struct.
+	struct io_uring_buf * b = (struct io_uring_buf *)_bufRing + (_bufTail & (_bufCount - 1));
+	b->addr = (unsigned long)buffer(id);
+	b->len = _bufSize;
+	b->bid = id;
+	_bufTail++;
+	__atomic_store_n(&_bufRing->tail, _bufTail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *
+IoUring::getSqe()
+{
+	if (_sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+	{
+		submit(0);
+	}
+	unsigned index = _sqLocalTail & _sqMask;
+	struct io_uring_sqe * sqe = &_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	_sqArray[index] = index;
+	_sqLocalTail++;
+	_sqPending++;
+	return sqe;
+}
+
+struct io_uring_sqe *
+IoUring::prepareAccept(int fd)
+{
+	struct io_uring_sqe * sqe = getSqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	return sqe;
+}
+
+struct io_uring_sqe *
+IoUring::prepareRecv(int fd)
+{
+	struct io_uring_sqe * sqe = getSqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->len = _bufSize;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = _bufGroup;
+	return sqe;
+}
+
+struct io_uring_sqe *
+IoUring::prepareSend(int fd, const void * data, size_t length)
+{
+	struct io_uring_sqe * sqe = getSqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)data;
+	sqe->len = length;
+	// Retry short sends until everything is out
+	sqe->msg_flags = MSG_WAITALL;
+	return sqe;
+}
+
+struct io_uring_sqe *
+IoUring::prepareClose(int fd)
+{
+	struct io_uring_sqe * sqe = getSqe();
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	return sqe;
+}
+
+struct io_uring_sqe *
+IoUring::preparePoll(int fd, unsigned events)
+{
+	struct io_uring_sqe * sqe = getSqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	return sqe;
+}
+
+struct io_uring_sqe *
+IoUring::prepareCancel(unsigned long long userData)
+{
+	struct io_uring_sqe * sqe = getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = userData;
+	return sqe;
+}
+
+struct io_uring_sqe *
+IoUring::prepareLinkTimeout(struct __kernel_timespec * ts)
+{
+	struct io_uring_sqe * sqe = getSqe();
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)ts;
+	sqe->len = 1;
+	return sqe;
+}
+
+int
+IoUring::submit(unsigned wait)
+{
+	__atomic_store_n(_sqTail, _sqLocalTail, __ATOMIC_RELEASE);
+	int n;
+	do {
+		n = io_uring_enter(_ringFd, _sqPending, wait,
+				   wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+	{
+		return -errno;
+	}
+	_sqPending -= n;
+	return n;
+}
+
+struct io_uring_cqe *
+IoUring::peekCqe()
+{
+	unsigned head = *_cqHead;
+	if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+	{
+		return NULL;
+	}
+	return &_cqes[head & _cqMask];
+}
+
+void
+IoUring::seenCqe()
+{
+	__atomic_store_n(_cqHead, *_cqHead + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,102 @@
+
+#ifndef IO_URING
+#define IO_URING
+
+//
+// Minimal io_uring ring used by the IRC server
+//
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+// Submission and completion queues of one io_uring instance, set up with
+// the raw system calls, plus an optional ring of provided receive buffers.
+class IoUring {
+  int _ringFd;
+
+  // Submission queue
+  unsigned * _sqHead;
+  unsigned * _sqTail;
+  unsigned * _sqArray;
+  unsigned _sqMask;
+  unsigned _sqEntries;
+  unsigned _sqLocalTail;
+  unsigned _sqPending;
+  struct io_uring_sqe * _sqes;
+
+  // Completion queue
+  unsigned * _cqHead;
+  unsigned * _cqTail;
+  unsigned _cqMask;
+  struct io_uring_cqe * _cqes;
+
+  void * _sqRing;
+  size_t _sqRingSize;
+  void * _cqRing;
+  size_t _cqRingSize;
+  size_t _sqesSize;
+
+  // Provided buffers
+  struct io_uring_buf_ring * _bufRing;
+  size_t _bufRingSize;
+  char * _bufBase;
+  int _bufCount;
+  int _bufSize;
+  int _bufGroup;
+  unsigned short _bufTail;
+
+ public:
+  IoUring();
+  ~IoUring();
+
+  // Creates a ring of the given number of entries. Returns false if
+  // io_uring is not available.
+  bool init(unsigned entries);
+
+  // Registers count buffers of size bytes each as buffer group group.
+  // Returns false if the kernel does not support provided buffer rings.
+  bool initBuffers(int group, int count, int size);
+
+  // Returns the provided buffer with the given id
+  char * buffer(int id);
+
+  // Gives a provided buffer back to the kernel
+  void recycleBuffer(int id);
+
+  // Returns a cleared submission entry. Submits pending entries first if
+  // the queue is full.
+  struct io_uring_sqe * getSqe();
+
+  // Multishot accept on a listening socket
+  struct io_uring_sqe * prepareAccept(int fd);
+
+  // Receive into a buffer of the provided buffer group
+  struct io_uring_sqe * prepareRecv(int fd);
+
+  // Send of the whole buffer
+  struct io_uring_sqe * prepareSend(int fd, const void * data, size_t length);
+
+  struct io_uring_sqe * prepareClose(int fd);
+
+  // One-shot poll of fd for the given poll(2) events
+  struct io_uring_sqe * preparePoll(int fd, unsigned events);
+
+  // Cancels the pending request whose user_data is userData
+  struct io_uring_sqe * prepareCancel(unsigned long long userData);
+
+  // Timeout cancelling the previous entry, which must have IOSQE_IO_LINK.
+  // ts must stay valid until submit().
+  struct io_uring_sqe * prepareLinkTimeout(struct __kernel_timespec * ts);
+
+  // Submits pending entries and waits for at least wait completions.
+  // Returns the number of entries submitted or -errno.
+  int submit(unsigned wait);
+
+  // Returns the next completion or NULL if there is none
+  struct io_uring_cqe * peekCqe();
+
+  // Releases the completion returned by peekCqe()
+  void seenCqe();
+};
+
+#endif
@@ -0,0 +1,79 @@
+//
+// Implementation of the perfect hash of keys known at run time
+//
+#include "PerfectHash.h"
+
+PerfectHash::PerfectHash()
+{
+	_count = 0;
+	_seed = 0;
+	_displacements = NULL;
+	_keys = NULL;
+	_values = NULL;
+}
+
+// Empties the table
+void PerfectHash::clear()
+{
+	free(_displacements);
+	free(_keys);
+	free(_values);
+	_count = 0;
+	_seed = 0;
+	_displacements = NULL;
+	_keys = NULL;
+	_values = NULL;
+}
+
+// Replaces the contents with n different keys and their objects.
+// Returns false, leaving the table empty, if the keys repeat.
+bool PerfectHash::build(const char ** keys, void ** values, int n)
+{
+	clear();
+	if (n == 0)
+	{
+		return true;
+	}
+	unsigned * displacements = (unsigned *)malloc(perfectHashBuckets(n)*sizeof(unsigned));
+	int * slots = (int *)malloc(n*sizeof(int));
+	unsigned seed;
+	if (!perfectHashBuild(keys, n, &seed, displacements, slots))
+	{
+		free(displacements);
+		free(slots);
+		return false;
+	}
+
+	// Lay the keys and objects out by slot, so a lookup reads one of each
+	_keys = (const char **)malloc(n*sizeof(const char *));
+	_values = (void **)malloc(n*sizeof(void *));
+	for (int s = 0; s < n; s++)
+	{
+		_keys[s] = keys[slots[s]];
+		_values[s] = values[slots[s]];
+	}
+	free(slots);
+	_displacements = displacements;
+	_seed = seed;
+	_count = n;
+	return true;
+}
+
+// Find a key and place in "data" the corresponding record. Returns false
+// if key does not exist.
+bool PerfectHash::find(const char * key, void ** data)
+{
+	if (_count == 0)
+	{
+		return false;
+	}
+	unsigned long long h = perfectHashKey(key, _seed);
+	unsigned d = _displacements[perfectHashBucket(h, perfectHashBuckets(_count))];
+	int s = perfectHashSlot(h, d, _count);
+	if (strcmp(_keys[s], key) != 0)
+	{
+		return false;
+	}
+	*data = _values[s];
+	return true;
+}
@@ -0,0 +1,247 @@
+#ifndef PERFECT_HASH
+#define PERFECT_HASH
+
+//
+// Minimal perfect hash for fixed sets of keys
+//
+// The keys are spread over buckets, and each bucket, largest first, gets
+// a displacement that sends all of its keys to slots still free. With as
+// many slots as keys, a lookup is one hash, one displacement and a single
+// key comparison, and nothing is chained. This is the CHD scheme of
+// Belazzougui, Botelho and Dietzfelbinger.
+//
+// The builder is constexpr, so small tables such as the command names can
+// be made by the compiler with StaticPerfectHash.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+// Average number of keys in a bucket
+enum { PerfectHashBucketLoad = 4 };
+
+// Seeds tried before giving up on a key set
+enum { PerfectHashMaxSeeds = 32 };
+
+// 64-bit FNV-1a of key, started from seed
+constexpr unsigned long long perfectHashKey(const char * key, unsigned seed)
+{
+  unsigned long long h = 14695981039346656037ull ^ seed;
+  for (const char * p = key; *p != '\0'; p++) {
+    h ^= (unsigned char)*p;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// Final mix of MurmurHash3
+constexpr unsigned perfectHashMix(unsigned x)
+{
+  x ^= x >> 16;
+  x *= 0x85ebca6bu;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35u;
+  x ^= x >> 16;
+  return x;
+}
+
+constexpr int perfectHashBuckets(int n)
+{
+  return n / PerfectHashBucketLoad + 1;
+}
+
+constexpr int perfectHashBucket(unsigned long long h, int buckets)
+{
+  return (h >> 32) % buckets;
+}
+
+// Slot of a key with hash h in a bucket with displacement d
+constexpr int perfectHashSlot(unsigned long long h, unsigned d, int n)
+{
+  unsigned h1 = (unsigned)h;
+  unsigned h2 = (unsigned)(h >> 32) | 1;
+  return perfectHashMix(h1 + d * h2) % n;
+}
+
+constexpr bool perfectHashEqual(const char * a, const char * b)
+{
+  while (*a != '\0' && *a == *b) {
+    a++;
+    b++;
+  }
+  return *a == *b;
+}
+
+// Places the n keys with seed. Returns false if two keys of a bucket hash
+// the same or a bucket finds no displacement.
+constexpr bool perfectHashPlace(const char * const * keys, int n, unsigned seed,
+                                unsigned * displacements, int * slots)
+{
+  int buckets = perfectHashBuckets(n);
+  unsigned long long * hashes = new unsigned long long[n];
+  int * next = new int[n];
+  int * head = new int[buckets];
+  int * size = new int[buckets];
+  int maxSize = 0;
+  for (int b = 0; b < buckets; b++) {
+    head[b] = -1;
+    size[b] = 0;
+    displacements[b] = 0;
+  }
+  for (int i = 0; i < n; i++) {
+    hashes[i] = perfectHashKey(keys[i], seed);
+    int b = perfectHashBucket(hashes[i], buckets);
+    next[i] = head[b];
+    head[b] = i;
+    if (++size[b] > maxSize) {
+      maxSize = size[b];
+    }
+  }
+  for (int s = 0; s < n; s++) {
+    slots[s] = -1;
+  }
+
+  // Buckets by decreasing size, as the big ones are the hard ones to place
+  int * start = new int[maxSize + 2];
+  int * order = new int[buckets];
+  for (int k = 0; k <= maxSize + 1; k++) {
+    start[k] = 0;
+  }
+  for (int b = 0; b < buckets; b++) {
+    start[maxSize - size[b] + 1]++;
+  }
+  for (int k = 1; k <= maxSize + 1; k++) {
+    start[k] += start[k - 1];
+  }
+  for (int b = 0; b < buckets; b++) {
+    order[start[maxSize - size[b]]++] = b;
+  }
+
+  // A single key is placed in about n / free tries, so this is enough
+  // even for the last ones
+  unsigned long long maxDisplacement = 64ull * n + 1024;
+  int * taken = new int[maxSize + 1];
+  bool ok = true;
+  for (int o = 0; o < buckets && ok; o++) {
+    int b = order[o];
+    if (size[b] == 0) {
+      break;
+    }
+    // Keys that hash the same never part, whatever the displacement
+    for (int i = head[b]; i >= 0 && ok; i = next[i]) {
+      for (int j = next[i]; j >= 0 && ok; j = next[j]) {
+        ok = hashes[i] != hashes[j];
+      }
+    }
+    if (!ok) {
+      break;
+    }
+    unsigned long long d = 0;
+    for (; d < maxDisplacement; d++) {
+      int k = 0;
+      bool fits = true;
+      for (int i = head[b]; i >= 0 && fits; i = next[i]) {
+        int s = perfectHashSlot(hashes[i], d, n);
+        fits = slots[s] < 0;
+        for (int j = 0; j < k && fits; j++) {
+          fits = taken[j] != s;
+        }
+        taken[k++] = s;
+      }
+      if (fits) {
+        break;
+      }
+    }
+    if (d == maxDisplacement) {
+      ok = false;
+      break;
+    }
+    displacements[b] = d;
+    int k = 0;
+    for (int i = head[b]; i >= 0; i = next[i]) {
+      slots[taken[k++]] = i;
+    }
+  }
+
+  delete [] hashes;
+  delete [] next;
+  delete [] head;
+  delete [] size;
+  delete [] start;
+  delete [] order;
+  delete [] taken;
+  return ok;
+}
+
+// Finds a seed and displacements that give each of the n keys a slot of
+// its own. slots[s] is then the index of the key in slot s. Returns false
+// if the keys repeat.
+constexpr bool perfectHashBuild(const char * const * keys, int n, unsigned * seed,
+                                unsigned * displacements, int * slots)
+{
+  for (unsigned s = 0; s < PerfectHashMaxSeeds; s++) {
+    if (perfectHashPlace(keys, n, s, displacements, slots)) {
+      *seed = s;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Perfect hash of N keys known at compile time. find returns the index of
+// a key in the array the table was made from, or -1.
+template <int N>
+struct StaticPerfectHash {
+  const char * const * _keys;
+  unsigned _seed;
+  unsigned _displacements[perfectHashBuckets(N)];
+  int _slots[N];
+
+  constexpr StaticPerfectHash(const char * const (&keys)[N])
+    : _keys(keys), _seed(0), _displacements(), _slots()
+  {
+    if (!perfectHashBuild(keys, N, &_seed, _displacements, _slots)) {
+      // Not a constant expression, so repeated keys do not compile
+      abort();
+    }
+  }
+
+  constexpr int find(const char * key) const
+  {
+    unsigned long long h = perfectHashKey(key, _seed);
+    unsigned d = _displacements[perfectHashBucket(h, perfectHashBuckets(N))];
+    int i = _slots[perfectHashSlot(h, d, N)];
+    return perfectHashEqual(_keys[i], key) ? i : -1;
+  }
+};
+
+// Perfect hash of keys known when the program runs, mapping them to
+// objects like HashTableVoid. The keys are not copied and must outlive
+// the table.
+class PerfectHash {
+  int _count;
+  unsigned _seed;
+  unsigned * _displacements;
+
+  // Key and object of each slot
+  const char ** _keys;
+  void ** _values;
+
+ public:
+  PerfectHash();
+
+  // Replaces the contents with n different keys and their objects.
+  // Returns false, leaving the table empty, if the keys repeat.
+  bool build(const char ** keys, void ** values, int n);
+
+  // Find a key and place in "data" the corresponding record. Returns
+  // false if key does not exist.
+  bool find(const char * key, void ** data);
+
+  // Empties the table
+  void clear();
+
+  int count() { return _count; }
+};
+
+#endif
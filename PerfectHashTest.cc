@@ -0,0 +1,140 @@
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "PerfectHash.h"
+
+constexpr const char * colors[] = {
+  "red", "green", "blue", "cyan", "magenta", "yellow", "black", "white", "orange"
+};
+
+// Made by the compiler
+constexpr StaticPerfectHash<9> colorTable(colors);
+
+static_assert(colorTable.find("red") == 0);
+static_assert(colorTable.find("orange") == 8);
+static_assert(colorTable.find("purple") == -1);
+static_assert(colorTable.find("") == -1);
+
+void test1()
+{
+  // Every key is found at its own index, and nothing else is
+  for (int i = 0; i < 9; i++) {
+    assert(colorTable.find(colors[i]) == i);
+  }
+  assert(colorTable.find("re") == -1);
+  assert(colorTable.find("redd") == -1);
+  assert(colorTable.find("RED") == -1);
+
+  printf("Test1 passed\n");
+}
+
+void test2()
+{
+  PerfectHash h;
+  void * data;
+  assert(!h.find("a", &data));
+
+  const char * keys[] = { "Rachael", "Monica", "Phoebe", "Joey", "Ross", "Chandler" };
+  void * values[] = { (void *) 8, (void *) 9, (void *) 10, (void *) 6, (void *) 8, (void *) 7 };
+  assert(h.build(keys, values, 6));
+  assert(h.count() == 6);
+  for (int i = 0; i < 6; i++) {
+    assert(h.find(keys[i], &data));
+    assert(data == values[i]);
+  }
+  assert(!h.find("John", &data));
+
+  // A single key, and then none
+  assert(h.build(keys, values, 1));
+  assert(h.find("Rachael", &data) && data == (void *) 8);
+  assert(!h.find("Monica", &data));
+  assert(h.build(keys, values, 0));
+  assert(!h.find("Rachael", &data));
+
+  printf("Test2 passed\n");
+}
+
+void test3()
+{
+  // A set about as big as a provisioned user directory
+  const int n = 200000;
+  char (*names)[16] = new char[n][16];
+  const char ** keys = new const char *[n];
+  void ** values = new void *[n];
+  for (int i = 0; i < n; i++) {
+    sprintf(names[i], "user%d", i);
+    keys[i] = names[i];
+    values[i] = (void *)(long)(i + 1);
+  }
+
+  PerfectHash h;
+  assert(h.build(keys, values, n));
+  for (int i = 0; i < n; i++) {
+    void * data;
+    assert(h.find(keys[i], &data));
+    assert(data == values[i]);
+  }
+  char other[16];
+  for (int i = n; i < 2 * n; i++) {
+    void * data;
+    sprintf(other, "user%d", i);
+    assert(!h.find(other, &data));
+  }
+
+  h.clear();
+  delete [] names;
+  delete [] keys;
+  delete [] values;
+
+  printf("Test3 passed\n");
+}
+
+void test4()
+{
+  // Repeated keys cannot be placed
+  const char * keys[] = { "a", "b", "a" };
+  void * values[] = { NULL, NULL, NULL };
+  PerfectHash h;
+  assert(!h.build(keys, values, 3));
+  void * data;
+  assert(!h.find("a", &data));
+
+  printf("Test4 passed\n");
+}
+
+void
+usage()
+{
+  // Print usage
+  fprintf(stderr, "PerfectHashTest test1|test2|test3|test4\n");
+}
+
+int
+main( int argc, char **argv)
+{
+  if (argc == 1) {
+    usage();
+    exit(1);
+  }
+
+  if ( !strcmp(argv[1], "test1")) {
+    test1();
+  }
+  else if ( !strcmp(argv[1], "test2")) {
+    test2();
+  }
+  else if ( !strcmp(argv[1], "test3")) {
+    test3();
+  }
+  else if ( !strcmp(argv[1], "test4")) {
+    test4();
+  }
+  else {
+    usage();
+    exit(1);
+  }
+
+  exit(0);
+}
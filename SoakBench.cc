@@ -0,0 +1,192 @@
+
+//
+// Soak benchmark for IRCServer
+//
+// Sends a constant mix of requests that leave the state of the server
+// unchanged, for as long as asked, and samples the resident set size of
+// the server process. Once warmed up the server should not grow, so the
+// run fails if its RSS grows by more than the given limit.
+//
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Users the requests are spread over, to stay below the rate limit of a
+// single user
+const int Users = 8;
+
+struct sockaddr_in serverAddress;
+
+double
+now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Resident set size of a process in KB, or -1 if it is gone
+long
+residentKB(int pid)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  FILE * f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  char line[256];
+  long kb = -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (!strncmp(line, "VmRSS:", 6)) {
+      kb = atol(line + 6);
+      break;
+    }
+  }
+  fclose(f);
+  return kb;
+}
+
+// Sends one request and reads the whole answer. Returns false if the
+// server could not be reached.
+bool
+request(const char * line)
+{
+  int fd = socket(PF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  if (connect(fd, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0 ||
+      write(fd, line, strlen(line)) < 0) {
+    close(fd);
+    return false;
+  }
+  char answer[4096];
+  int n;
+  int length = 0;
+  while ((n = read(fd, answer, sizeof(answer))) > 0) {
+    length += n;
+  }
+  close(fd);
+  return length > 0;
+}
+
+int
+main(int argc, char ** argv)
+{
+  if (argc < 5) {
+    fprintf(stderr, "SoakBench <host> <port> <server-pid> <seconds> "
+	    "[<requests-per-second> [<max-growth-kb>]]\n");
+    exit(1);
+  }
+
+  struct hostent * host = gethostbyname(argv[1]);
+  if (host == NULL) {
+    fprintf(stderr, "Unknown host %s\n", argv[1]);
+    exit(1);
+  }
+  memset(&serverAddress, 0, sizeof(serverAddress));
+  serverAddress.sin_family = AF_INET;
+  memcpy(&serverAddress.sin_addr, host->h_addr, host->h_length);
+  serverAddress.sin_port = htons(atoi(argv[2]));
+
+  int pid = atoi(argv[3]);
+  double seconds = atof(argv[4]);
+  // The default stays below the rate limit of a single client address
+  double rate = argc > 5 ? atof(argv[5]) : 80;
+  long maxGrowth = argc > 6 ? atol(argv[6]) : 1024;
+
+  // State the mix reads: users in a room with a few messages
+  char line[512];
+  for (int u = 0; u < Users; u++) {
+    snprintf(line, sizeof(line), "ADD-USER soak%d pw\r\n", u);
+    request(line);
+  }
+  request("CREATE-ROOM soak0 pw soakroom\r\n");
+  for (int u = 0; u < Users; u++) {
+    snprintf(line, sizeof(line), "ENTER-ROOM soak%d pw soakroom\r\n", u);
+    request(line);
+  }
+  for (int i = 0; i < 16; i++) {
+    snprintf(line, sizeof(line), "SEND-MESSAGE soak%d pw soakroom message %d\r\n", i % Users, i);
+    request(line);
+  }
+
+  // Every command once, plus the ones that are turned down
+  const char * mix[] = {
+    "GET-ALL-USERS soak%d pw\r\n",
+    "LIST-ROOMS soak%d pw\r\n",
+    "GET-USERS-IN-ROOM soak%d pw soakroom\r\n",
+    "GET-MESSAGES soak%d pw 0 soakroom\r\n",
+    "LEAVE-ROOM soak%d pw soakroom\r\n",
+    "ENTER-ROOM soak%d pw soakroom\r\n",
+    "CREATE-ROOM soak%d pw soakroom\r\n",
+    "GET-ALL-USERS soak%d wrong\r\n",
+    "NO-SUCH-COMMAND soak%d pw\r\n",
+  };
+  int mixLength = sizeof(mix) / sizeof(mix[0]);
+
+  // Growth is measured from the end of the warm up, when allocator
+  // caches and the buffers of the server have reached their size
+  double warmUp = seconds / 10 < 5 ? 5 : seconds / 10;
+  int samples = 20;
+  double start = now();
+  double nextSample = start + warmUp;
+  long baseline = -1;
+  long last = -1;
+  long peak = 0;
+  long requests = 0;
+  long failures = 0;
+
+  while (now() - start < seconds) {
+    snprintf(line, sizeof(line), mix[requests % mixLength], (int)(requests / mixLength % Users));
+    if (!request(line)) {
+      failures++;
+    }
+    requests++;
+
+    // Pace the requests
+    double due = start + requests / rate;
+    double wait = due - now();
+    if (wait > 0) {
+      usleep((useconds_t)(wait * 1e6));
+    }
+
+    if (now() >= nextSample) {
+      last = residentKB(pid);
+      if (last < 0) {
+	fprintf(stderr, "Server %d is gone\n", pid);
+	exit(1);
+      }
+      if (baseline < 0) {
+	baseline = last;
+      }
+      if (last > peak) {
+	peak = last;
+      }
+      printf("%8.0f s  %10ld requests  rss %ld KB\n", now() - start, requests, last);
+      fflush(stdout);
+      nextSample += (seconds - warmUp) / samples;
+    }
+  }
+  last = residentKB(pid);
+
+  printf("requests:    %ld (%ld failed)\n", requests, failures);
+  printf("rss KB:      baseline %ld  end %ld  peak %ld\n", baseline, last, peak);
+  if (baseline < 0 || last < 0) {
+    fprintf(stderr, "Run longer than the warm up of %.0f s\n", warmUp);
+    exit(1);
+  }
+  if (last - baseline > maxGrowth) {
+    printf("FAILED: grew by %ld KB, more than %ld KB\n", last - baseline, maxGrowth);
+    exit(1);
+  }
+  printf("OK: grew by %ld KB\n", last - baseline);
+  exit(0);
+}
@@ -0,0 +1,79 @@
+
+#ifndef TASK
+#define TASK
+
+//
+// Coroutine task used to write socket code in straight-line form
+//
+
+#include <coroutine>
+#include <exception>
+
+// A coroutine returning nothing. It starts suspended, and runs either when
+// another coroutine awaits it, which resumes when the task finishes, or
+// when it is detached, in which case it frees itself at the end.
+class Task {
+ public:
+  struct promise_type {
+    std::coroutine_handle<> _continuation;
+    bool _detached = false;
+
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+        promise_type & p = h.promise();
+        if (p._detached) {
+          h.destroy();
+          return std::noop_coroutine();
+        }
+        if (p._continuation) {
+          return p._continuation;
+        }
+        return std::noop_coroutine();
+      }
+      void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+ private:
+  std::coroutine_handle<promise_type> _handle;
+
+  explicit Task(std::coroutine_handle<promise_type> h) : _handle(h) {}
+
+ public:
+  Task(Task && other) : _handle(other._handle) { other._handle = nullptr; }
+  Task(const Task &) = delete;
+  Task & operator=(const Task &) = delete;
+  ~Task() {
+    if (_handle) {
+      _handle.destroy();
+    }
+  }
+
+  // Awaiting a task runs it and resumes the caller when it is done
+  bool await_ready() { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+    _handle.promise()._continuation = caller;
+    return _handle;
+  }
+  void await_resume() {}
+
+  // Starts the task on its own. It runs until its first suspension.
+  void detach() {
+    std::coroutine_handle<promise_type> h = _handle;
+    _handle = nullptr;
+    h.promise()._detached = true;
+    h.resume();
+  }
+};
+
+#endif
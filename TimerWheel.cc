@@ -0,0 +1,155 @@
+
+//
+// Implementation of the hierarchical timing wheel
+//
+#include <stddef.h>
+
+#include "TimerWheel.h"
+
+TimerWheel::TimerWheel(unsigned long long now)
+{
+	for (int l = 0; l < Levels; l++)
+	{
+		for (int s = 0; s < Slots; s++)
+		{
+			_slots[l][s]._next = &_slots[l][s];
+			_slots[l][s]._prev = &_slots[l][s];
+		}
+	}
+	_current = now;
+	_count = 0;
+}
+
+void
+TimerWheel::init(Timer * t, void (*callback)(void * arg), void * arg)
+{
+	t->_next = NULL;
+	t->_prev = NULL;
+	t->_expires = 0;
+	t->_callback = callback;
+	t->_arg = arg;
+}
+
+// Links t into the slot of the lowest wheel whose current period holds
+// its expiration time
+void
+TimerWheel::place(Timer * t)
+{
+	int level = 0;
+	while (level < Levels - 1 &&
+	       (t->_expires >> (SlotBits * (level + 1))) != (_current >> (SlotBits * (level + 1))))
+	{
+		level++;
+	}
+	Timer * head = &_slots[level][(t->_expires >> (SlotBits * level)) & (Slots - 1)];
+	t->_next = head;
+	t->_prev = head->_prev;
+	head->_prev->_next = t;
+	head->_prev = t;
+}
+
+void
+TimerWheel::schedule(Timer * t, unsigned long long expires)
+{
+	if (armed(t))
+	{
+		cancel(t);
+	}
+	if (expires <= _current)
+	{
+		expires = _current + 1;
+	}
+	// The top wheel must not wrap around onto its current slot
+	unsigned long long max = _current + ((unsigned long long)(Slots - 1) << (SlotBits * (Levels - 1)));
+	if (expires > max)
+	{
+		expires = max;
+	}
+	t->_expires = expires;
+	place(t);
+	_count++;
+}
+
+void
+TimerWheel::cancel(Timer * t)
+{
+	if (!armed(t))
+	{
+		return;
+	}
+	t->_prev->_next = t->_next;
+	t->_next->_prev = t->_prev;
+	t->_next = NULL;
+	t->_prev = NULL;
+	_count--;
+}
+
+// Moves the timers of the current slot of a wheel to the lower wheels
+void
+TimerWheel::cascade(int level)
+{
+	Timer * head = &_slots[level][(_current >> (SlotBits * level)) & (Slots - 1)];
+	Timer * t = head->_next;
+	head->_next = head;
+	head->_prev = head;
+	while (t != head)
+	{
+		Timer * next = t->_next;
+		place(t);
+		t = next;
+	}
+}
+
+void
+TimerWheel::advance(unsigned long long now)
+{
+	while (_current < now)
+	{
+		if (_count == 0)
+		{
+			_current = now;
+			return;
+		}
+		_current++;
+
+		// Refill the lower wheels when they wrap around, higher ones first
+		int level = 0;
+		while (level < Levels - 1 &&
+		       ((_current >> (SlotBits * level)) & (Slots - 1)) == 0)
+		{
+			level++;
+		}
+		for (; level > 0; level--)
+		{
+			cascade(level);
+		}
+
+		// Callbacks may arm or cancel timers, so take them one at a time
+		Timer * head = &_slots[0][_current & (Slots - 1)];
+		while (head->_next != head)
+		{
+			Timer * t = head->_next;
+			cancel(t);
+			t->_callback(t->_arg);
+		}
+	}
+}
+
+int
+TimerWheel::timeout()
+{
+	if (_count == 0)
+	{
+		return -1;
+	}
+	int slot = _current & (Slots - 1);
+	for (int s = slot + 1; s < Slots; s++)
+	{
+		if (_slots[0][s]._next != &_slots[0][s])
+		{
+			return s - slot;
+		}
+	}
+	// Nothing else due in this wheel, wake up when it wraps around
+	return Slots - slot;
+}
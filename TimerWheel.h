@@ -0,0 +1,60 @@
+
+#ifndef TIMER_WHEEL
+#define TIMER_WHEEL
+
+//
+// Hierarchical timing wheel
+//
+
+// A timer is embedded in the object it belongs to. It is armed by
+// TimerWheel::schedule() and calls _callback(_arg) when it expires.
+struct Timer {
+  Timer * _next;
+  Timer * _prev;
+  unsigned long long _expires;
+  void (*_callback)(void * arg);
+  void * _arg;
+};
+
+// Timers kept in four wheels of 64 slots with a tick of one millisecond.
+// The first wheel holds the timers of the current 64 ms, the second those
+// of the current 4 s, and so on, up to about 4.6 hours ahead. Arming and
+// cancelling a timer take O(1), and a tick only touches the timers of its
+// slot, plus the ones moved down when a wheel wraps around.
+class TimerWheel {
+ public:
+  enum { Levels = 4, SlotBits = 6, Slots = 1 << SlotBits };
+
+ private:
+  // Sentinels of the circular list of every slot
+  Timer _slots[Levels][Slots];
+  // Last tick processed
+  unsigned long long _current;
+  int _count;
+
+  void place(Timer * t);
+  void cascade(int level);
+
+ public:
+  TimerWheel(unsigned long long now);
+
+  // Initializes a timer that is not armed
+  static void init(Timer * t, void (*callback)(void * arg), void * arg);
+
+  // Arms t to expire at the given time, in ms. Re-arms it if it is armed.
+  void schedule(Timer * t, unsigned long long expires);
+
+  // Disarms t. Does nothing if it is not armed.
+  void cancel(Timer * t);
+
+  static bool armed(Timer * t) { return t->_next != 0; }
+
+  // Runs the callbacks of every timer expired by now
+  void advance(unsigned long long now);
+
+  // Milliseconds until advance() may have work to do, or -1 if no timer
+  // is armed
+  int timeout();
+};
+
+#endif
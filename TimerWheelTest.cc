@@ -0,0 +1,189 @@
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TimerWheel.h"
+
+struct Fired {
+  int count;
+  unsigned long long when;
+};
+
+unsigned long long clockNow;
+
+void
+onExpire(void * arg)
+{
+  Fired * f = (Fired *) arg;
+  f->count++;
+  f->when = clockNow;
+}
+
+void
+advanceTo(TimerWheel & w, unsigned long long t)
+{
+  // Step like an event loop does, so that callbacks see the right time
+  while (clockNow < t) {
+    clockNow++;
+    w.advance(clockNow);
+  }
+}
+
+void test1()
+{
+  clockNow = 1000;
+  TimerWheel w(clockNow);
+  Fired f = {0, 0};
+  Timer t;
+  TimerWheel::init(&t, onExpire, &f);
+
+  w.schedule(&t, 1010);
+  assert(TimerWheel::armed(&t));
+  advanceTo(w, 1009);
+  assert(f.count == 0);
+  advanceTo(w, 1010);
+  assert(f.count == 1);
+  assert(f.when == 1010);
+  assert(!TimerWheel::armed(&t));
+
+  printf("Test1 passed\n");
+}
+
+void test2()
+{
+  clockNow = 0;
+  TimerWheel w(clockNow);
+  Fired f = {0, 0};
+  Timer t;
+  TimerWheel::init(&t, onExpire, &f);
+
+  w.schedule(&t, 50);
+  w.cancel(&t);
+  assert(!TimerWheel::armed(&t));
+  advanceTo(w, 100);
+  assert(f.count == 0);
+
+  // Cancelling twice does nothing
+  w.cancel(&t);
+  assert(w.timeout() == -1);
+
+  printf("Test2 passed\n");
+}
+
+void test3()
+{
+  // Timers in every wheel expire exactly on time
+  unsigned long long delays[] = { 1, 63, 64, 65, 4095, 4096, 4097, 300000, 262144 * 3 + 17 };
+  int n = sizeof(delays) / sizeof(delays[0]);
+
+  clockNow = 123;
+  TimerWheel w(clockNow);
+  Fired f[9];
+  Timer t[9];
+  for (int i = 0; i < n; i++) {
+    f[i].count = 0;
+    TimerWheel::init(&t[i], onExpire, &f[i]);
+    w.schedule(&t[i], clockNow + delays[i]);
+  }
+  advanceTo(w, 123 + delays[n - 1]);
+  for (int i = 0; i < n; i++) {
+    assert(f[i].count == 1);
+    assert(f[i].when == 123 + delays[i]);
+  }
+
+  printf("Test3 passed\n");
+}
+
+void test4()
+{
+  // Re-arming moves the timer, and a deadline in the past fires on the
+  // next tick
+  clockNow = 5000;
+  TimerWheel w(clockNow);
+  Fired f = {0, 0};
+  Timer t;
+  TimerWheel::init(&t, onExpire, &f);
+
+  w.schedule(&t, 9000);
+  w.schedule(&t, 5100);
+  advanceTo(w, 5100);
+  assert(f.count == 1 && f.when == 5100);
+
+  w.schedule(&t, 10);
+  advanceTo(w, 5101);
+  assert(f.count == 2 && f.when == 5101);
+
+  advanceTo(w, 9100);
+  assert(f.count == 2);
+
+  printf("Test4 passed\n");
+}
+
+void test5()
+{
+  // Many timers, half of them cancelled
+  const int n = 100000;
+  clockNow = 0;
+  TimerWheel w(clockNow);
+  Fired * f = new Fired[n];
+  Timer * t = new Timer[n];
+  for (int i = 0; i < n; i++) {
+    f[i].count = 0;
+    TimerWheel::init(&t[i], onExpire, &f[i]);
+    w.schedule(&t[i], 1 + (i * 7919) % 20000);
+  }
+  for (int i = 0; i < n; i += 2) {
+    w.cancel(&t[i]);
+  }
+  advanceTo(w, 20000);
+  for (int i = 0; i < n; i++) {
+    assert(f[i].count == (i % 2));
+    if (i % 2) {
+      assert(f[i].when == (unsigned long long)(1 + (i * 7919) % 20000));
+    }
+  }
+  assert(w.timeout() == -1);
+  delete [] f;
+  delete [] t;
+
+  printf("Test5 passed\n");
+}
+
+void
+usage()
+{
+  // Print usage
+  fprintf(stderr, "TimerWheelTest test1|test2|test3|test4|test5\n");
+}
+
+int
+main( int argc, char **argv)
+{
+  if (argc == 1) {
+    usage();
+    exit(1);
+  }
+
+  if ( !strcmp(argv[1], "test1")) {
+    test1();
+  }
+  else if ( !strcmp(argv[1], "test2")) {
+    test2();
+  }
+  else if ( !strcmp(argv[1], "test3")) {
+    test3();
+  }
+  else if ( !strcmp(argv[1], "test4")) {
+    test4();
+  }
+  else if ( !strcmp(argv[1], "test5")) {
+    test5();
+  }
+  else {
+    usage();
+    exit(1);
+  }
+
+  exit(0);
+}